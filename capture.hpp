@@ -0,0 +1,296 @@
+#pragma once
+
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <netinet/in.h>
+
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#define CAPTURE_MAGIC   "CHATCAP1"
+#define CAPTURE_VERSION 1
+
+// Longest datagram a capture record holds
+#define CAPTURE_MAX_LENGTH 65535
+
+namespace chat {
+
+//---------------------------------------------------------------------------------------
+// Capture files
+//
+// A capture starts with a capture_file_header, followed by one record per
+// datagram, in the order the server handled them:
+//
+//   +-----------------------+---------------------+---------------------+
+//   | capture_file_header   | capture_record_hdr  | length bytes        | ...
+//   | (16 bytes)            | (24 bytes)          | datagram            |
+//   +-----------------------+---------------------+---------------------+
+//
+// Integers are little-endian, converted with htole/letoh on the way in and
+// out, except the address and port, which are kept in network order as in
+// sockaddr_in. Datagrams to the server are recorded
+// after any reliable delivery envelope has been removed, datagrams from the
+// server as the handlers produced them, before bundling and wrapping, so a
+// capture replays against a server with any options.
+//---------------------------------------------------------------------------------------
+
+/**
+ * @struct capture_file_header
+ * @brief Start of a capture file
+ * @var capture_file_header::magic_
+ *  Member 'magic_' CAPTURE_MAGIC
+ * @var capture_file_header::version_
+ *  Member 'version_' CAPTURE_VERSION
+ * @var capture_file_header::reserved_
+ *  Member 'reserved_' zero
+ */
+struct capture_file_header {
+    char magic_[8];
+    uint32_t version_;
+    uint32_t reserved_;
+};
+
+/**
+ * @brief direction of a captured datagram
+*/
+enum capture_direction {
+    CAPTURE_TO_SERVER = 0,
+    CAPTURE_FROM_SERVER = 1,
+};
+
+/**
+ * @struct capture_record_header
+ * @brief Start of each record, followed by length bytes of datagram
+ * @var capture_record_header::ns_
+ *  Member 'ns_' time the datagram was handled, ns since the capture started
+ * @var capture_record_header::address_
+ *  Member 'address_' client IPv4 address, sender or recipient, network order
+ * @var capture_record_header::port_
+ *  Member 'port_' client port, network order
+ * @var capture_record_header::direction_
+ *  Member 'direction_' a capture_direction
+ * @var capture_record_header::reserved_
+ *  Member 'reserved_' zero
+ * @var capture_record_header::length_
+ *  Member 'length_' number of datagram bytes that follow
+ * @var capture_record_header::reserved2_
+ *  Member 'reserved2_' zero
+ */
+struct capture_record_header {
+    uint64_t ns_;
+    uint32_t address_;
+    uint16_t port_;
+    uint8_t direction_;
+    uint8_t reserved_;
+    uint32_t length_;
+    uint32_t reserved2_;
+};
+
+static_assert(sizeof(capture_file_header) == 16, "capture file header layout");
+static_assert(sizeof(capture_record_header) == 24, "capture record header layout");
+
+/**
+ * @brief Records collected by one worker, written to the capture together
+*/
+class capture_batch {
+public:
+    bool empty() const { return bytes_.empty(); }
+
+    void clear() { bytes_.clear(); }
+
+    /**
+     * @brief append a record
+     * @param ns time since the capture started
+     * @param direction a capture_direction
+     * @param address of the client
+     * @param data datagram bytes
+     * @param length number of bytes
+    */
+    void add(uint64_t ns, capture_direction direction, const sockaddr_in& address, const char * data, size_t length) {
+        capture_record_header header{};
+        header.ns_ = htole64(ns);
+        header.address_ = address.sin_addr.s_addr;
+        header.port_ = address.sin_port;
+        header.direction_ = static_cast<uint8_t>(direction);
+        header.length_ = htole32(static_cast<uint32_t>(length));
+        size_t at = bytes_.size();
+        bytes_.resize(at + sizeof(header) + length);
+        memcpy(&bytes_[at], &header, sizeof(header));
+        memcpy(&bytes_[at + sizeof(header)], data, length);
+    }
+
+    const char * data() const { return bytes_.data(); }
+    size_t size() const { return bytes_.size(); }
+
+private:
+    std::vector<char> bytes_;
+};
+
+/**
+ * @brief Appends the traffic of every worker to one capture file
+ *
+ * Workers collect each batch's records in a capture_batch and write it with
+ * a single locked, buffered write, so recording costs a copy per datagram
+ * and one lock per batch.
+*/
+class capture_writer {
+public:
+    ~capture_writer() { close(); }
+
+    bool is_open() const { return file_ != nullptr; }
+
+    /**
+     * @brief create or truncate a capture file, before any worker starts
+     * @param path of the capture
+     * @param now monotonic time the capture starts at
+    */
+    void open(const std::string& path, uint64_t now) {
+        file_ = fopen(path.c_str(), "wb");
+        if (file_ == nullptr) {
+            throw std::system_error(errno, std::generic_category(), "open " + path);
+        }
+        capture_file_header header{};
+        memcpy(header.magic_, CAPTURE_MAGIC, sizeof(header.magic_));
+        header.version_ = htole32(CAPTURE_VERSION);
+        if (fwrite(&header, sizeof(header), 1, file_) != 1) {
+            throw std::system_error(errno, std::generic_category(), "write " + path);
+        }
+        start_ns_ = now;
+    }
+
+    void close() {
+        if (file_ != nullptr) {
+            fclose(file_);
+            file_ = nullptr;
+        }
+    }
+
+    /**
+     * @brief time since the capture started
+    */
+    uint64_t since_start(uint64_t now) const { return now > start_ns_ ? now - start_ns_ : 0; }
+
+    /**
+     * @brief write a batch of records and clear it
+    */
+    void write(capture_batch& batch) {
+        if (batch.empty()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            records_bytes_ += batch.size();
+            if (fwrite(batch.data(), batch.size(), 1, file_) != 1) {
+                failed_ = true;
+            }
+        }
+        batch.clear();
+    }
+
+    /**
+     * @brief bytes of records written
+    */
+    uint64_t bytes() const { return records_bytes_; }
+
+    /**
+     * @brief true if any write failed, the capture is then incomplete
+    */
+    bool failed() const { return failed_; }
+
+private:
+    FILE * file_ = nullptr;
+    uint64_t start_ns_ = 0;
+    std::mutex mutex_;
+    uint64_t records_bytes_ = 0;
+    bool failed_ = false;
+};
+
+/**
+ * @struct capture_record
+ * @brief A record read back from a capture
+ * @var capture_record::ns_
+ *  Member 'ns_' time since the capture started
+ * @var capture_record::address_
+ *  Member 'address_' client the datagram came from or went to
+ * @var capture_record::direction_
+ *  Member 'direction_' to or from the server
+ * @var capture_record::data_
+ *  Member 'data_' datagram bytes, valid until the next read
+ * @var capture_record::length_
+ *  Member 'length_' number of datagram bytes
+ */
+struct capture_record {
+    uint64_t ns_;
+    sockaddr_in address_;
+    capture_direction direction_;
+    const char * data_;
+    size_t length_;
+};
+
+/**
+ * @brief Reads the records of a capture file in order
+*/
+class capture_reader {
+public:
+    ~capture_reader() {
+        if (file_ != nullptr) {
+            fclose(file_);
+        }
+    }
+
+    /**
+     * @brief open a capture and check its header
+     * @throws std::system_error if it cannot be read or is not a capture
+    */
+    void open(const std::string& path) {
+        file_ = fopen(path.c_str(), "rb");
+        if (file_ == nullptr) {
+            throw std::system_error(errno, std::generic_category(), "open " + path);
+        }
+        capture_file_header header;
+        if (fread(&header, sizeof(header), 1, file_) != 1 ||
+            memcmp(header.magic_, CAPTURE_MAGIC, sizeof(header.magic_)) != 0 ||
+            le32toh(header.version_) != CAPTURE_VERSION) {
+            throw std::system_error(EINVAL, std::generic_category(), "not a capture " + path);
+        }
+    }
+
+    /**
+     * @brief read the next record
+     * @return false at the end of the capture, or at a truncated last record
+    */
+    bool next(capture_record& record) {
+        capture_record_header header;
+        if (fread(&header, sizeof(header), 1, file_) != 1) {
+            return false;
+        }
+        uint32_t length = le32toh(header.length_);
+        if (length > CAPTURE_MAX_LENGTH || header.direction_ > CAPTURE_FROM_SERVER) {
+            return false;
+        }
+        buffer_.resize(length);
+        if (length > 0 && fread(buffer_.data(), length, 1, file_) != 1) {
+            return false;
+        }
+        record.ns_ = le64toh(header.ns_);
+        record.address_ = sockaddr_in{};
+        record.address_.sin_family = AF_INET;
+        record.address_.sin_addr.s_addr = header.address_;
+        record.address_.sin_port = header.port_;
+        record.direction_ = static_cast<capture_direction>(header.direction_);
+        record.data_ = buffer_.data();
+        record.length_ = length;
+        return true;
+    }
+
+private:
+    FILE * file_ = nullptr;
+    std::vector<char> buffer_;
+};
+
+}; // namespace chat
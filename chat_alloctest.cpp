@@ -0,0 +1,412 @@
+// the server, less its main, so its allocations go through the operator new
+// defined below
+#define CHAT_SERVER_NO_MAIN
+#include <chat_server.cpp>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <new>
+#include <time.h>
+
+// Time allowed for the server to bind and the clients to join
+#define ALLOCTEST_JOIN_MS 5000
+
+// JOINs not acknowledged after this long are sent again
+#define ALLOCTEST_JOIN_RETRY_MS 100
+
+// One message in this many is a BROADCAST, the rest are DIRECTMESSAGEs
+#define ALLOCTEST_BROADCAST_EVERY 8
+
+namespace {
+
+/**
+ * @brief heap allocations made through operator new by any thread but the
+ *        test's own
+*/
+std::atomic<uint64_t> allocations{0};
+
+/**
+ * @brief set on the thread driving the clients, whose allocations are not
+ *        the server's
+*/
+thread_local bool driver = false;
+
+void * counted_alloc(size_t size) {
+    if (!driver) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    return malloc(size == 0 ? 1 : size);
+}
+
+void * counted_alloc(size_t size, std::align_val_t alignment) {
+    if (!driver) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    void * p = nullptr;
+    size_t align = std::max(static_cast<size_t>(alignment), sizeof(void*));
+    return posix_memalign(&p, align, size == 0 ? 1 : size) == 0 ? p : nullptr;
+}
+
+// kept out of line, so the compiler does not pair free with operator new
+// once a delete is inlined, and warn
+[[gnu::noinline]] void counted_free(void * p) noexcept {
+    free(p);
+}
+
+}; // namespace
+
+void * operator new(size_t size) {
+    void * p = counted_alloc(size);
+    if (p == nullptr) {
+        throw std::bad_alloc{};
+    }
+    return p;
+}
+
+void * operator new[](size_t size) {
+    return operator new(size);
+}
+
+void * operator new(size_t size, const std::nothrow_t&) noexcept {
+    return counted_alloc(size);
+}
+
+void * operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return counted_alloc(size);
+}
+
+void * operator new(size_t size, std::align_val_t alignment) {
+    void * p = counted_alloc(size, alignment);
+    if (p == nullptr) {
+        throw std::bad_alloc{};
+    }
+    return p;
+}
+
+void * operator new[](size_t size, std::align_val_t alignment) {
+    return operator new(size, alignment);
+}
+
+void operator delete(void * p) noexcept { counted_free(p); }
+void operator delete[](void * p) noexcept { counted_free(p); }
+void operator delete(void * p, size_t) noexcept { counted_free(p); }
+void operator delete[](void * p, size_t) noexcept { counted_free(p); }
+void operator delete(void * p, std::align_val_t) noexcept { counted_free(p); }
+void operator delete[](void * p, std::align_val_t) noexcept { counted_free(p); }
+void operator delete(void * p, size_t, std::align_val_t) noexcept { counted_free(p); }
+void operator delete[](void * p, size_t, std::align_val_t) noexcept { counted_free(p); }
+
+namespace {
+
+/**
+ * @struct alloctest_options
+ * @brief Command line configuration, the server's and the workload's
+ */
+struct alloctest_options {
+    server_options server_;
+    size_t clients_ = 32;
+    double warmup_ = 2.0;
+    double duration_ = 3.0;
+    double rate_ = 2000.0;
+    uint8_t capabilities_ = CAP_PRESENCE | CAP_COALESCE;
+};
+
+uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Headless clients on loopback sending a steady mix of BROADCASTs and
+ *        DIRECTMESSAGEs, one socket each
+*/
+class workload {
+public:
+    explicit workload(const alloctest_options& options) : options_(options) {
+        memset(&server_, 0, sizeof(server_));
+        server_.sin_family = AF_INET;
+        server_.sin_port = htons(options.server_.port_);
+        inet_pton(AF_INET, "127.0.0.1", &server_.sin_addr);
+    }
+
+    ~workload() {
+        for (int fd: fds_) {
+            close(fd);
+        }
+    }
+
+    /**
+     * @brief create the client sockets and join them all
+     * @return false if a socket could not be made or a client was not acknowledged
+    */
+    bool join() {
+        for (size_t i = 0; i < options_.clients_; i++) {
+            int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+            if (fd < 0) {
+                perror("socket");
+                return false;
+            }
+            fds_.push_back(fd);
+            sockaddr_in local{};
+            local.sin_family = AF_INET;
+            local.sin_addr = server_.sin_addr;
+            if (bind(fd, (sockaddr*)&local, sizeof(local)) < 0) {
+                perror("bind");
+                return false;
+            }
+            names_.push_back("at" + std::to_string(i));
+        }
+        joined_.assign(options_.clients_, false);
+
+        uint64_t deadline = now_ns() + ALLOCTEST_JOIN_MS * 1000000ULL;
+        size_t joined = 0;
+        while (joined < options_.clients_ && now_ns() < deadline) {
+            for (size_t i = 0; i < options_.clients_; i++) {
+                if (!joined_[i]) {
+                    send(i, chat::encode_join(frame_, names_[i], options_.capabilities_));
+                }
+            }
+            uint64_t retry = now_ns() + ALLOCTEST_JOIN_RETRY_MS * 1000000ULL;
+            while (now_ns() < retry) {
+                joined += drain();
+                usleep(1000);
+            }
+        }
+        if (joined < options_.clients_) {
+            fprintf(stderr, "Only %zu of %zu clients joined\n", joined, options_.clients_);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief send messages at the configured rate for seconds, receiving
+     *        everything the server sends back
+     * @return messages sent
+    */
+    uint64_t run(double seconds) {
+        uint64_t interval_ns = static_cast<uint64_t>(1e9 / options_.rate_);
+        uint64_t start = now_ns();
+        uint64_t end = start + static_cast<uint64_t>(seconds * 1e9);
+        uint64_t next = start;
+        uint64_t sent = 0;
+        while (next < end) {
+            size_t from = sequence_ % options_.clients_;
+            if (sequence_ % ALLOCTEST_BROADCAST_EVERY == 0) {
+                send(from, chat::encode_broadcast(frame_, names_[from], body_));
+            }
+            else {
+                size_t to = (sequence_ * 7 + 1) % options_.clients_;
+                send(from, chat::encode_dm(frame_, names_[to], body_));
+            }
+            sequence_++;
+            sent++;
+            next += interval_ns;
+            while (now_ns() < next) {
+                drain();
+            }
+        }
+        // let what is in flight arrive, so it is counted with this phase
+        uint64_t settle = now_ns() + 100000000ULL;
+        while (now_ns() < settle) {
+            drain();
+            usleep(1000);
+        }
+        return sent;
+    }
+
+    /**
+     * @brief ask the server to exit, repeated in case one is dropped
+    */
+    void exit_server() {
+        for (int i = 0; i < 3; i++) {
+            send(0, chat::encode_exit(frame_));
+            usleep(100000);
+            drain();
+        }
+    }
+
+    uint64_t deliveries() const { return deliveries_; }
+
+private:
+    void send(size_t c, size_t length) {
+        sendto(fds_[c], frame_, length, 0, (sockaddr*)&server_, sizeof(server_));
+    }
+
+    /**
+     * @brief receive whatever is waiting on every client socket
+     * @return clients newly acknowledged
+    */
+    size_t drain() {
+        size_t joined = 0;
+        for (size_t c = 0; c < fds_.size(); c++) {
+            for (;;) {
+                ssize_t n = recv(fds_[c], buffer_, sizeof(buffer_), 0);
+                if (n < 0) {
+                    break;
+                }
+                auto handle = [&](const char * data, size_t length) {
+                    char inflated[MAX_FRAME_LENGTH];
+                    if (chat::is_compressed(data, length)) {
+                        length = chat::inflate_frame(data, length, inflated);
+                        data = inflated;
+                    }
+                    chat::message_view msg;
+                    if (!chat::decode(data, length, msg)) {
+                        return;
+                    }
+                    if ((msg.type_ == chat::JACK || msg.type_ == chat::ERROR) && !joined_[c]) {
+                        joined_[c] = true;
+                        joined++;
+                    }
+                    else if (msg.type_ == chat::BROADCAST || msg.type_ == chat::DIRECTMESSAGE) {
+                        deliveries_++;
+                    }
+                };
+                if (!chat::is_bundle(buffer_, n)) {
+                    handle(buffer_, n);
+                }
+                else {
+                    chat::for_each_frame(buffer_, n, handle);
+                }
+            }
+        }
+        return joined;
+    }
+
+    alloctest_options options_;
+    sockaddr_in server_;
+    std::vector<int> fds_;
+    std::vector<std::string> names_;
+    std::vector<bool> joined_;
+    uint64_t sequence_ = 0;
+    uint64_t deliveries_ = 0;
+    std::string_view body_ = "allocation test message, long enough to be worth compressing in a chat";
+    char frame_[MAX_FRAME_LENGTH];
+    char buffer_[std::max({sizeof(chat::chat_message), size_t{MAX_FRAME_LENGTH}, size_t{MAX_BUNDLE_LENGTH}})];
+};
+
+void usage(const char * name) {
+    printf("USAGE: %s [--io uwe|mmsg|uring] [--batch <datagrams per wakeup>] [--workers <threads>]\n"
+           "       [--coalesce <us>] [--port <port>] [--clients <n>] [--warmup <seconds>]\n"
+           "       [--duration <seconds>] [--rate <messages per second>] [--compress]\n",
+           name);
+}
+
+}; // namespace
+
+/**
+ * @brief Allocation test for the server's steady state
+ *
+ * Runs the server on loopback in this process, with operator new counting
+ * every allocation made by its threads. Clients join and send BROADCASTs and
+ * DIRECTMESSAGEs for a warm-up phase, during which pools, queues and tables
+ * grow to the size the workload needs, then keep going for a measured phase.
+ * Exits with 1 if the server allocated at all during the measured phase.
+*/
+int main(int argc, char ** argv) {
+    driver = true;
+    alloctest_options options;
+
+    static struct option long_options[] = {
+        {"io",       required_argument, nullptr, 'i'},
+        {"batch",    required_argument, nullptr, 'b'},
+        {"workers",  required_argument, nullptr, 'w'},
+        {"coalesce", required_argument, nullptr, 'c'},
+        {"port",     required_argument, nullptr, 'P'},
+        {"clients",  required_argument, nullptr, 'n'},
+        {"warmup",   required_argument, nullptr, 'W'},
+        {"duration", required_argument, nullptr, 'd'},
+        {"rate",     required_argument, nullptr, 'r'},
+        {"compress", no_argument,       nullptr, 'Z'},
+        {nullptr, 0,                    nullptr, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "i:b:w:c:P:n:W:d:r:Z", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'i':
+                if (strcmp(optarg, "uwe") == 0) {
+                    options.server_.backend_ = IO_UWE;
+                }
+                else if (strcmp(optarg, "mmsg") == 0) {
+                    options.server_.backend_ = IO_MMSG;
+                }
+                else if (strcmp(optarg, "uring") == 0) {
+                    options.server_.backend_ = IO_URING;
+                }
+                else {
+                    printf("Unknown I/O backend: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                options.server_.batch_size_ = std::max<size_t>(strtoul(optarg, nullptr, 10), 1);
+                break;
+            case 'w':
+                options.server_.workers_ = std::max<size_t>(strtoul(optarg, nullptr, 10), 1);
+                break;
+            case 'c':
+                options.server_.coalesce_ = true;
+                options.server_.coalesce_us_ = strtoull(optarg, nullptr, 10);
+                break;
+            case 'P':
+                options.server_.port_ = static_cast<uint16_t>(strtoul(optarg, nullptr, 10));
+                break;
+            case 'n': options.clients_ = strtoul(optarg, nullptr, 10); break;
+            case 'W': options.warmup_ = strtod(optarg, nullptr); break;
+            case 'd': options.duration_ = strtod(optarg, nullptr); break;
+            case 'r': options.rate_ = strtod(optarg, nullptr); break;
+            case 'Z': options.capabilities_ |= CAP_COMPRESS; break;
+            default:
+                usage(argv[0]);
+                exit(0);
+        }
+    }
+
+    if (options.clients_ < 2 || options.rate_ <= 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    // the same fallbacks as chat_server's
+    if ((options.server_.workers_ > 1 || options.server_.coalesce_) && options.server_.backend_ == IO_UWE) {
+        options.server_.backend_ = IO_MMSG;
+    }
+
+    uwe::set_ipaddr("127.0.0.1");
+    std::thread server_thread{server, std::cref(options.server_)};
+
+    workload clients{options};
+    if (!clients.join()) {
+        clients.exit_server();
+        server_thread.join();
+        exit(1);
+    }
+
+    uint64_t start = allocations.load();
+    clients.run(options.warmup_);
+    uint64_t warm = allocations.load();
+    uint64_t delivered = clients.deliveries();
+    uint64_t sent = clients.run(options.duration_);
+    uint64_t measured = allocations.load() - warm;
+    delivered = clients.deliveries() - delivered;
+
+    clients.exit_server();
+    server_thread.join();
+
+    printf("allocations: %" PRIu64 " during warm-up, %" PRIu64 " during %" PRIu64
+        " messages measured, %" PRIu64 " deliveries\n",
+        warm - start, measured, sent, delivered);
+    if (delivered == 0) {
+        printf("FAIL: nothing was delivered during the measured phase\n");
+        return 1;
+    }
+    if (measured != 0) {
+        printf("FAIL: the server allocated during the measured phase\n");
+        return 1;
+    }
+    printf("PASS\n");
+    return 0;
+}
@@ -7,17 +7,68 @@
 
 #include <atomic>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
 
 // IOT socket api
 #include <iot/socket.hpp>
 
-#include <chat.hpp>
+#include <chat_ex2.hpp>
+#include <display_batch.hpp>
+#include <event_signal.hpp>
+#include <heartbeat.hpp>
+#include <reliable.hpp>
+#include <server_metrics.hpp>
+#include <spsc_ring.hpp>
 #include <gui.hpp>
 #include <colors.hpp>
 #include <util.hpp>
 
+// longest the main loop sleeps before checking the GUI channel, which has no
+// way to wake it
+#define GUI_POLL_MS 20
+
+// slots in the ring from the receiver thread to the main loop
+#define RECEIVE_RING_SLOTS 512
+// most received messages the main loop handles before looking at the GUI
+#define RECEIVE_BATCH 64
+
 namespace {
 std::atomic<bool> sent_leave{false};
+// wire format used for messages sent to the server
+chat::wire_format wire_format{chat::WIRE_COMPACT};
+
+// copies of packets the server has not acknowledged yet
+chat::packet_pool link_packets;
+// reliable link to the server, null unless --reliable, shared by the main,
+// receiver and retransmit threads
+std::unique_ptr<chat::reliable_peer> server_link;
+std::mutex link_mutex;
+chat::reliable_stats link_stats;
+// set once the server stops acknowledging
+std::atomic<bool> server_lost{false};
+// set while the receiver thread waits for the main loop to free ring slots
+std::atomic<bool> receiver_waiting{false};
+// set once the receiver thread has received its last message and is exiting
+std::atomic<bool> receiver_done{false};
+
+/**
+ * @brief Emit callback that sends packets for the reliable link to the server
+*/
+struct socket_emitter {
+    uwe::socket& sock_;
+    const sockaddr_in& server_address_;
+
+    void operator()(const char * header, size_t header_length, const char * payload, size_t length) {
+        char datagram[MAX_DATAGRAM_LENGTH];
+        memcpy(datagram, header, header_length);
+        memcpy(datagram + header_length, payload, length);
+        sock_.sendto(datagram, header_length + length, 0, (sockaddr*)&server_address_, sizeof(server_address_));
+    }
+};
 };
 
 //---------------------------------------------------------------------------------------
@@ -37,6 +88,12 @@ chat::chat_type to_type(std::string cmd) {
     case string_to_int("list"): return chat::LIST;
     case string_to_int("leave"): return chat::LEAVE;
     case string_to_int("exit"): return chat::EXIT;
+    case string_to_int("stats"): return chat::STATS;
+    case string_to_int("history"): return chat::HISTORY;
+    case string_to_int("makegroup"): return chat::MAKEGROUP;
+    case string_to_int("addmember"): return chat::ADDMEMBER;
+    case string_to_int("leavegroup"): return chat::LEAVEGROUP;
+    case string_to_int("group"): return chat::GROUPMESSAGE;
     default:
       return chat::UNKNOWN; 
   }
@@ -44,31 +101,333 @@ chat::chat_type to_type(std::string cmd) {
   return chat::UNKNOWN; // unknowntype
 }
 
+/**
+ * @brief Send a message to the server, using the client's wire format
+ * 
+ * @param sock socket for communicating with the server
+ * @param msg message to send
+ * @param server_address address of the server
+ * @return number of bytes sent or -1 on error
+*/
+int send_to_server(uwe::socket& sock, const chat::chat_message& msg, const sockaddr_in& server_address) {
+    char frame[MAX_FRAME_LENGTH];
+    const char * data = frame;
+    size_t len;
+    if (wire_format == chat::WIRE_LEGACY) {
+        data = reinterpret_cast<const char*>(&msg);
+        len = sizeof(chat::chat_message);
+    }
+    else {
+        len = chat::encode(msg, frame);
+    }
+
+    if (server_link) {
+        // sent now or once the window has room, and retransmitted until acknowledged
+        std::lock_guard<std::mutex> lock{link_mutex};
+        server_link->sender_.send(data, len, chat::monotonic_ns(), link_stats, socket_emitter{sock, server_address});
+        return len;
+    }
+    return sock.sendto(data, len, 0, (sockaddr*)&server_address, sizeof(server_address));
+}
+
+/**
+ * @brief Unwrap a datagram received from the server, if it is an envelope,
+ *        acknowledging it
+ * 
+ * @param sock socket for communicating with the server
+ * @param server_address address of the server
+ * @param data received bytes, set to the wrapped packet
+ * @param len number of bytes received, set to the length of the wrapped packet
+ * @return true if there is a packet to handle, false for ACKs and duplicates
+*/
+bool unwrap(uwe::socket& sock, const sockaddr_in& server_address, const char *& data, int& len) {
+    if (!server_link || !chat::is_reliable(data, len)) {
+        return true;
+    }
+    chat::reliable_envelope envelope;
+    if (!chat::parse_reliable(data, len, envelope)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock{link_mutex};
+    if (!server_link->receive(envelope, chat::monotonic_ns(), link_stats, socket_emitter{sock, server_address})) {
+        return false;
+    }
+    data = envelope.payload_;
+    len = static_cast<int>(envelope.length_);
+    return true;
+}
+
+/**
+ * @brief Start a thread that retransmits unacknowledged packets to the server
+ * 
+ * If the server stops acknowledging, server_lost is set and an EXIT is sent
+ * to the client's own socket, to wake whichever thread is waiting on it.
+ * 
+ * @param sock socket for communicating with the server
+ * @param server_address address of the server
+ * @param client_address address sock is bound to
+ * @param stop set to end the thread
+*/
+std::thread make_retransmitter(
+    uwe::socket& sock, const sockaddr_in& server_address, const sockaddr_in& client_address,
+    const std::atomic<bool>& stop) {
+    return std::thread{[&sock, &server_address, &client_address, &stop]() {
+        while (!stop) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(RELIABLE_TICK_MS));
+            std::lock_guard<std::mutex> lock{link_mutex};
+            if (!server_link->sender_.poll(chat::monotonic_ns(), link_stats, socket_emitter{sock, server_address})) {
+                DEBUG("Server not responding\n");
+                server_lost = true;
+                char frame[MAX_FRAME_LENGTH];
+                size_t len = chat::encode_exit(frame);
+                sock.sendto(frame, len, 0, (sockaddr*)&client_address, sizeof(client_address));
+                return;
+            }
+        }
+    }};
+}
+
 //----------------------------------------------------------------------------------------
 
-std::pair<std::thread, Channel<chat::chat_message>> make_receiver(uwe::socket* sock) {
-  auto [tx, rx] = make_channel<chat::chat_message>();
-  
-  std::thread receiver_thread{[](Channel<chat::chat_message> tx, uwe::socket* sock) { 
+/**
+ * @brief Online users shown in the GUI, kept up to date by PRESENCE deltas
+ *        and reconciled against full LIST snapshots
+*/
+class roster {
+public:
+    /**
+     * @brief apply a PRESENCE message
+     * 
+     * @param msg PRESENCE message from the server
+     * @param gui_tx channel to the GUI thread, or a display_batcher in front of it
+     * @return true if a version gap was found and a snapshot should be requested
+    */
+    template<typename Tx>
+    bool apply_presence(const chat::message_view& msg, Tx& gui_tx) {
+        char op;
+        uint64_t version;
+        if (!chat::parse_presence(msg.message_, op, version)) {
+            return false;
+        }
+
+        if (op == PRESENCE_SNAPSHOT) {
+            version_ = version;
+            awaiting_snapshot_ = false;
+            return false;
+        }
+
+        if (version <= version_) {
+            // already covered by a later snapshot
+            return false;
+        }
+
+        std::string username{msg.username_};
+        if (op == PRESENCE_ADDED) {
+            add(username, gui_tx);
+        }
+        else {
+            remove(username, gui_tx);
+        }
+
+        bool gap = version != version_ + 1;
+        version_ = version;
+        if (gap && !awaiting_snapshot_) {
+            awaiting_snapshot_ = true;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief apply one packet of a LIST snapshot, once the END user arrives the
+     *        GUI is brought in line with the snapshot
+     * 
+     * @param msg LIST message from the server
+     * @param gui_tx channel to the GUI thread, or a display_batcher in front of it
+    */
+    template<typename Tx>
+    void apply_list(const chat::message_view& msg, Tx& gui_tx) {
+        for (auto field: {msg.username_, msg.message_}) {
+            for (auto u: split(std::string{field}, ':')) {
+                if (u.compare("END") == 0) {
+                    reconcile(gui_tx);
+                    return;
+                }
+                if (!u.empty()) {
+                    snapshot_.insert(u);
+                }
+            }
+        }
+    }
+
+private:
+    template<typename Tx>
+    void add(const std::string& username, Tx& gui_tx) {
+        if (users_.insert(username).second) {
+            chat::display_command cmd{chat::GUI_USER_ADD, username};
+            gui_tx.send(cmd);
+        }
+    }
+
+    template<typename Tx>
+    void remove(const std::string& username, Tx& gui_tx) {
+        if (users_.erase(username) > 0) {
+            chat::display_command cmd{chat::GUI_USER_REMOVE, username};
+            gui_tx.send(cmd);
+        }
+    }
+
+    template<typename Tx>
+    void reconcile(Tx& gui_tx) {
+        std::set<std::string> gone;
+        for (const auto& u: users_) {
+            if (snapshot_.count(u) == 0) {
+                gone.insert(u);
+            }
+        }
+        for (const auto& u: gone) {
+            remove(u, gui_tx);
+        }
+        for (const auto& u: snapshot_) {
+            add(u, gui_tx);
+        }
+        snapshot_.clear();
+    }
+
+    std::set<std::string> users_;
+    std::set<std::string> snapshot_;
+    uint64_t version_ = 0;
+    bool awaiting_snapshot_ = true;
+};
+
+//----------------------------------------------------------------------------------------
+
+/**
+ * @struct received_datagram
+ * @brief A datagram from the server, received straight into a slot of the
+ *        receive ring and handled there by the main loop
+ * @var received_datagram::view_
+ *  Member 'view_' the decoded message, referring into buffer_
+ * @var received_datagram::received_ns_
+ *  Member 'received_ns_' monotonic time recvfrom returned it
+ * @var received_datagram::buffer_
+ *  Member 'buffer_' the received bytes
+ */
+struct received_datagram {
+    chat::message_view view_;
+    uint64_t received_ns_;
+    char buffer_[MAX_DATAGRAM_LENGTH];
+};
+
+typedef chat::spsc_ring<received_datagram> receive_ring;
+
+/**
+ * @brief Start a thread that receives messages from the server into ring
+ * 
+ * When the ring is full the thread stops reading the socket until the main
+ * loop frees a slot, so a flood backs up into the socket buffer rather than
+ * growing a queue.
+ * Bundles are unpacked into one slot per frame.
+ * 
+ * @param sock socket for communicating with the server
+ * @param server_address address of the server
+ * @param ring where received messages are published for the main loop
+ * @param wake signalled after publishing, and when the ring is full
+ * @param space signalled by the main loop when it frees slots while
+ *        receiver_waiting is set
+*/
+std::thread make_receiver(
+    uwe::socket* sock, const sockaddr_in* server_address, receive_ring* ring,
+    chat::event_signal* wake, chat::event_signal* space) {
+  return std::thread{[sock, server_address, ring, wake, space]() { 
+    // slot to receive into, waiting for the main loop to free one if the ring is full
+    auto claim = [ring, wake, space]() {
+        received_datagram * slot;
+        while ((slot = ring->claim()) == nullptr) {
+            DEBUG("Receive ring full, waiting for the main loop\n");
+            receiver_waiting = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            wake->notify();
+            while (ring->full()) {
+                space->wait(GUI_POLL_MS);
+            }
+            receiver_waiting = false;
+        }
+        return slot;
+    };
+
+    // decode a message held in slot and hand the slot to the main loop,
+    // returns true if it is time for the receiver thread to exit
+    bool done = false;
+    auto deliver = [ring, wake, &done](received_datagram * slot, const char * data, size_t len) {
+        // the view refers into the slot, so a compressed frame is inflated back into it
+        if (chat::is_compressed(data, len)) {
+            char inflated[MAX_FRAME_LENGTH];
+            len = chat::inflate_frame(data, len, inflated);
+            memcpy(slot->buffer_, inflated, len);
+            data = slot->buffer_;
+        }
+        // Check if message reception was successful, accepting either wire format
+        if (!chat::decode(data, len, slot->view_)) {
+            // Handle potential errors in message reception
+            DEBUG("Error: Unexpected packet length or failed to receive message from server\n");
+            return false;
+        }
+        chat::chat_type type = slot->view_.type_;
+
+        // Hand the slot to the main UI thread, and wake it if it is sleeping
+        ring->publish();
+        wake->notify();
+
+        // Check if it's time to exit the receiver thread
+        done = type == chat::EXIT || (type == chat::LACK && sent_leave);
+        return true;
+    };
+
     try {
-        for (;;) {
-            chat::chat_message msg;
-            
-            // Receive message from the server
-            int len = sock->recvfrom(reinterpret_cast<char*>(&msg), sizeof(chat::chat_message), 0, nullptr, nullptr);
-            
-            // Check if message reception was successful
-            if (len == sizeof(chat::chat_message)) {
-                // Send the received message over the channel (tx) to the main UI thread
-                tx.send(msg);
-
-                // Check if it's time to exit the receiver thread
-                if (msg.type_ == chat::EXIT || (msg.type_ == chat::LACK && sent_leave)) {
-                    break;
+        while (!done) {
+            received_datagram * slot = claim();
+
+            // Receive message from the server, into the slot
+            int len = sock->recvfrom(slot->buffer_, sizeof(slot->buffer_), 0, nullptr, nullptr);
+            slot->received_ns_ = chat::monotonic_ns();
+            const char * data = slot->buffer_;
+            if (len <= 0) {
+                DEBUG("Error: failed to receive message from server\n");
+                continue;
+            }
+            if (!unwrap(*sock, *server_address, data, len)) {
+                continue;
+            }
+
+            if (!chat::is_bundle(data, len)) {
+                deliver(slot, data, len);
+                continue;
+            }
+
+            // every frame of a bundle gets a slot of its own, so unpack from a copy
+            char bundle[MAX_BUNDLE_LENGTH];
+            if (static_cast<size_t>(len) > sizeof(bundle)) {
+                DEBUG("Error: bundle too long\n");
+                continue;
+            }
+            memcpy(bundle, data, len);
+            uint64_t received_ns = slot->received_ns_;
+            bool ok = chat::for_each_frame(bundle, len, [&](const char * frame, size_t length) {
+                if (done) {
+                    return;
                 }
-            } else {
-                // Handle potential errors in message reception
-                DEBUG("Error: Unexpected packet length or failed to receive message from server\n");
+                if (slot == nullptr) {
+                    slot = claim();
+                    slot->received_ns_ = received_ns;
+                }
+                memcpy(slot->buffer_, frame, length);
+                if (deliver(slot, slot->buffer_, length)) {
+                    slot = nullptr;
+                }
+            });
+            if (!ok) {
+                DEBUG("Error: malformed bundle from server\n");
             }
         }
     }
@@ -78,15 +437,40 @@ std::pair<std::thread, Channel<chat::chat_message>> make_receiver(uwe::socket* s
     catch(...) {
         DEBUG("Unknown exception caught in receiver thread\n");
     }
-  }, std::move(tx), sock};
-
-  return {std::move(receiver_thread), std::move(rx)};
+    receiver_done = true;
+    wake->notify();
+  }};
 }
 
 
 int main(int argc, char ** argv) {
-    if (argc != 4) {
-        printf("USAGE: %s <ipaddress> <port> <username>\n", argv[0]);
+    bool reliable = false;
+    std::string server_name = "192.168.1.7";
+    int server_port = SERVER_PORT;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--legacy") == 0) {
+            // talk the fixed size packet format, for servers that predate compact frames
+            wire_format = chat::WIRE_LEGACY;
+        }
+        else if (strcmp(argv[i], "--reliable") == 0) {
+            // retransmit until acknowledged, needs a server run with --reliable
+            reliable = true;
+        }
+        else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            // <ip>:<port> of the server, any node of a cluster will do
+            std::string server{argv[++i]};
+            size_t colon = server.rfind(':');
+            server_name = server.substr(0, colon);
+            if (colon != std::string::npos) {
+                server_port = std::atoi(server.c_str() + colon + 1);
+            }
+        }
+        else {
+            argc = 0;
+        }
+    }
+    if (argc < 4) {
+        printf("USAGE: %s <ipaddress> <port> <username> [--legacy] [--reliable] [--server <ip>:<port>]\n", argv[0]);
         exit(0);
     }
 
@@ -94,16 +478,12 @@ int main(int argc, char ** argv) {
     // Set client IP address
     uwe::set_ipaddr(argv[1]);
 
-    const char* server_name = "192.168.1.7";
-	
-	const int server_port = SERVER_PORT;
-
     sockaddr_in server_address;
 	memset(&server_address, 0, sizeof(server_address));
 	server_address.sin_family = AF_INET;
 
 	// creates binary representation of server name and stores it as sin_addr
-	inet_pton(AF_INET, server_name, &server_address.sin_addr);
+	inet_pton(AF_INET, server_name.c_str(), &server_address.sin_addr);
 
 	// htons: port in network order format
 	server_address.sin_port = htons(server_port);
@@ -123,28 +503,74 @@ int main(int argc, char ** argv) {
 
 	sock.bind((struct sockaddr *)&client_address, sizeof(client_address));
 
-    chat::chat_message msg = chat::join_msg(username);
+    // retransmits run from JOIN onwards, so a lost JOIN or JACK is recovered
+    std::atomic<bool> stop_retransmitter{false};
+    std::thread retransmitter;
+    if (reliable) {
+        server_link = std::make_unique<chat::reliable_peer>(link_packets, std::random_device{}());
+        retransmitter = make_retransmitter(sock, server_address, client_address, stop_retransmitter);
+    }
+
+    chat::chat_message msg = chat::join_msg(username, CAP_PRESENCE | CAP_COALESCE | CAP_COMPRESS);
 
     // send data
-	int len = sock.sendto(
-        reinterpret_cast<const char*>(&msg), sizeof(chat::chat_message), 0,
-	    (sockaddr*)&server_address, sizeof(server_address));
+	int len = send_to_server(sock, msg, server_address);
         
     DEBUG("Join message (%s) sent, waiting for JACK\n", username.c_str());
-    // wait for JACK
-    sock.recvfrom(reinterpret_cast<char*>(&msg), sizeof(chat::chat_message), 0, nullptr, nullptr);
-
-    if (msg.type_ == chat::JACK) {
+    // wait for JACK, skipping ACKs
+    char buffer[MAX_DATAGRAM_LENGTH];
+    const char * data;
+    do {
+        len = sock.recvfrom(buffer, sizeof(buffer), 0, nullptr, nullptr);
+        data = buffer;
+    } while (len > 0 && !unwrap(sock, server_address, data, len));
+
+    chat::message_view jack;
+    if (len > 0 && chat::decode_as<chat::JACK>(data, len, jack)) {
         DEBUG("Received jack\n");
 
         // create GUI thread and communication channels
         auto [gui_thread, gui_tx, gui_rx] = chat::make_gui();
-        auto [rec_thread, rec_rx] = make_receiver(&sock);
+        // messages from the receiver thread, which signals wake whenever it
+        // publishes one, and waits on space when the ring is full
+        receive_ring rec_ring{RECEIVE_RING_SLOTS};
+        chat::event_signal wake;
+        chat::event_signal space;
+        std::thread rec_thread = make_receiver(&sock, &server_address, &rec_ring, &wake, &space);
 
         // going to need recv thread for messages from server
 
+        // online users, as shown in the GUI
+        roster users;
+        // what the GUI is to show, handed over at most DISPLAY_FPS times a second
+        chat::display_batcher display;
+
+        // how often the main loop slept, how many of those sleeps ran to the
+        // GUI poll timeout, and time from recvfrom to handling a message
+        uint64_t sleeps = 0;
+        uint64_t timeouts = 0;
+        chat::histogram handle_ns;
+
+        // when the last HEARTBEAT was sent, so a quiet user is not taken for gone
+        uint64_t last_heartbeat = chat::monotonic_ns();
+
         bool exit_loop = false;
         for(;!exit_loop;) {
+            // sleep until the receiver has work, or it is time to look at the GUI,
+            // whose commands are left queued once LEAVE has been sent
+            if ((gui_rx.empty() || sent_leave) && rec_ring.empty()) {
+                sleeps++;
+                if (!wake.wait(display.wait_ms(chat::monotonic_ns(), GUI_POLL_MS))) {
+                    timeouts++;
+                }
+            }
+
+            uint64_t now = chat::monotonic_ns();
+            if (!sent_leave && now - last_heartbeat >= HEARTBEAT_INTERVAL_MS * 1000000ULL) {
+                send_to_server(sock, chat::heartbeat_msg(), server_address);
+                last_heartbeat = now;
+            }
+
             // check and see if any GUI messages to handle
             if (!gui_rx.empty() && !sent_leave) {
                 auto result = gui_rx.recv();
@@ -158,8 +584,7 @@ int main(int argc, char ** argv) {
                             // Construct an exit message
                             chat::chat_message exit_msg = chat::exit_msg(); // Assuming such a function exists
                             // Send the exit message to the server
-                            sock.sendto(reinterpret_cast<const char*>(&exit_msg), sizeof(chat::chat_message), 0,
-                                        (sockaddr*)&server_address, sizeof(server_address));
+                            send_to_server(sock, exit_msg, server_address);
                             // Optionally wait for server acknowledgment here
 
                             // Signal the receiver thread to stop
@@ -177,8 +602,7 @@ int main(int argc, char ** argv) {
                             chat::chat_message leave_msg = chat::leave_msg(); // Create a leave message
                             
                             // Send the leave message to the server
-                            int len = sock.sendto(reinterpret_cast<const char*>(&leave_msg), sizeof(chat::chat_message), 0,
-                                                (sockaddr*)&server_address, sizeof(server_address));
+                            int len = send_to_server(sock, leave_msg, server_address);
 
                             if (len < 0) {
                                 DEBUG("Failed to send LEAVE message\n");
@@ -198,7 +622,61 @@ int main(int argc, char ** argv) {
 
                             case chat::LIST: {
                                 DEBUG("Received LIST from GUI\n");
-                                // you need to fill in
+                                // ask for a full snapshot of online users
+                                chat::chat_message list_msg = chat::list_msg();
+                                send_to_server(sock, list_msg, server_address);
+                                break;
+                            }
+
+                            case chat::STATS: {
+                                DEBUG("Received STATS from GUI\n");
+                                // ask for the server's metrics
+                                chat::chat_message stats_msg = chat::stats_msg();
+                                send_to_server(sock, stats_msg, server_address);
+                                break;
+                            }
+
+                            case chat::HISTORY: {
+                                DEBUG("Received HISTORY from GUI\n");
+                                // "history:since <seq>" or "history:last <n>", then optionally ":<user>"
+                                chat::chat_message history_msg =
+                                    chat::history_msg(cmds.size() > 2 ? cmds[2] : "", cmds[1]);
+                                send_to_server(sock, history_msg, server_address);
+                                break;
+                            }
+
+                            case chat::MAKEGROUP: {
+                                DEBUG("Received MAKEGROUP from GUI\n");
+                                // "makegroup:<group>"
+                                send_to_server(sock, chat::makegroup_msg(cmds[1]), server_address);
+                                break;
+                            }
+
+                            case chat::ADDMEMBER: {
+                                DEBUG("Received ADDMEMBER from GUI\n");
+                                // "addmember:<group>:<user>"
+                                if (cmds.size() > 2) {
+                                    send_to_server(sock, chat::addmember_msg(cmds[1], cmds[2]), server_address);
+                                }
+                                break;
+                            }
+
+                            case chat::LEAVEGROUP: {
+                                DEBUG("Received LEAVEGROUP from GUI\n");
+                                // "leavegroup:<group>"
+                                send_to_server(sock, chat::leavegroup_msg(cmds[1]), server_address);
+                                break;
+                            }
+
+                            case chat::GROUPMESSAGE: {
+                                DEBUG("Received GROUPMESSAGE from GUI\n");
+                                // "group:<group>:<text>", the text may itself contain ':'
+                                auto text_pos = result->find(':', cmds[0].length() + 1 + cmds[1].length());
+                                if (text_pos != std::string::npos && text_pos + 1 < result->length()) {
+                                    chat::chat_message group_msg =
+                                        chat::groupmessage_msg(cmds[1], result->substr(text_pos + 1));
+                                    send_to_server(sock, group_msg, server_address);
+                                }
                                 break;
                             }
                             default: {
@@ -214,9 +692,7 @@ int main(int argc, char ** argv) {
                                     chat::chat_message dm_msg = chat::dm_msg(recipient, direct_message_text);
 
                                     // Send the direct message to the server
-                                    int len = sock.sendto(
-                                        reinterpret_cast<const char*>(&dm_msg), sizeof(chat::chat_message), 0,
-                                        (sockaddr*)&server_address, sizeof(server_address));
+                                    int len = send_to_server(sock, dm_msg, server_address);
 
                                     if (len < 0) {
                                         DEBUG("Failed to send DM to %s\n", recipient.c_str());
@@ -234,93 +710,182 @@ int main(int argc, char ** argv) {
                         // message to broadcast to everyone online
                         chat::chat_message msg = chat::broadcast_msg(username, *result);
                         // send data
-                        int len = sock.sendto(
-                            reinterpret_cast<const char*>(&msg), sizeof(chat::chat_message), 0,
-                            (sockaddr*)&server_address, sizeof(server_address));
+                        int len = send_to_server(sock, msg, server_address);
                     }
                 }
             }
-            //check to see if any messages received from the server
-            if (!rec_rx.empty() && !exit_loop) {
-                auto result = rec_rx.recv();
-                if (result) {
-                    switch ((*result).type_) {
-                        case chat::LEAVE: {
-                            chat::display_command cmd{chat::GUI_USER_REMOVE};
-                            cmd.text_ = std::string{(char*)(*result).username_};
-                            gui_tx.send(cmd);
-                            break;
-                        }
-                        case chat::EXIT: {
-                            DEBUG("Received EXIT\n");
+            //check to see if any messages received from the server, handling a
+            //batch of them where the receiver thread left them in the ring
+            received_datagram * batch;
+            size_t received = exit_loop ? 0 : rec_ring.peek(batch, RECEIVE_BATCH);
+            for (size_t i = 0; i < received && !exit_loop; i++) {
+                const chat::message_view& view = batch[i].view_;
+                handle_ns.record(chat::monotonic_ns() - batch[i].received_ns_);
+                switch (view.type_) {
+                    case chat::LEAVE: {
+                        chat::display_command cmd{chat::GUI_USER_REMOVE};
+                        cmd.text_ = std::string{view.username_};
+                        display.send(cmd);
+                        break;
+                    }
+                    case chat::EXIT: {
+                        DEBUG("Received EXIT\n");
+                        exit_loop = true;
+                        break;
+                    }
+                    case chat::LACK: {
+                        DEBUG("Received LACK\n");
+                        if (sent_leave) {
                             exit_loop = true;
                             break;
                         }
-                        case chat::LACK: {
-                            DEBUG("Received LACK\n");
-                            if (sent_leave) {
-                                exit_loop = true;
-                                break;
-                            }
+                    }
+                    case chat::BROADCAST: {
+                        std::string msg{view.username_};
+                        msg.append(": ");
+                        msg.append(view.message_);
+                        chat::display_command cmd{chat::GUI_CONSOLE, msg};
+                        display.send(cmd);
+                        break;
+                    }
+                    case chat::DIRECTMESSAGE: {
+                        //DEBUG("dm is sent");
+                        std::string msg{"dm("};
+                        msg.append(view.username_);
+                        msg.append("): ");
+                        msg.append(view.message_);
+                        chat::display_command cmd{chat::GUI_CONSOLE, msg};
+                        display.send(cmd);
+                        break;
+                    }
+                    case chat::LIST: {
+                        users.apply_list(view, display);
+                        break;
+                    }
+                    case chat::PRESENCE: {
+                        // a missed delta means our list is stale, so ask for a snapshot
+                        if (users.apply_presence(view, display)) {
+                            DEBUG("Roster version gap, requesting LIST\n");
+                            chat::chat_message list_msg = chat::list_msg();
+                            send_to_server(sock, list_msg, server_address);
                         }
-                        case chat::BROADCAST: {
-                            std::string msg{(char*)(*result).username_};
-                            msg.append(": ");
-                            msg.append((char*)(*result).message_);
+                        break;
+                    }
+                    case chat::STATS: {
+                        if (view.username_ != "END") {
+                            std::string msg{"stats("};
+                            msg.append(view.username_);
+                            msg.append("): ");
+                            msg.append(view.message_);
                             chat::display_command cmd{chat::GUI_CONSOLE, msg};
-                            gui_tx.send(cmd);
-                            break;
+                            display.send(cmd);
                         }
-                        case chat::DIRECTMESSAGE: {
-                            //DEBUG("dm is sent");
-                            std::string msg{"dm("};
-                            msg.append((char*)(*result).username_);
+                        break;
+                    }
+                    case chat::HISTORY: {
+                        if (view.username_ != "END") {
+                            std::string msg{"history("};
+                            msg.append(view.username_);
                             msg.append("): ");
-                            msg.append((char*)(*result).message_);
+                            msg.append(view.message_);
                             chat::display_command cmd{chat::GUI_CONSOLE, msg};
-                            gui_tx.send(cmd);
-                            break;
+                            display.send(cmd);
                         }
-                        case chat::LIST: {
-                            bool end = false;
-                            auto users = split(std::string{(char*)(*result).username_}, ':');
-                            for (auto u: users) {
-                                if (u.compare("END") == 0) {   
-                                    end = true;
-                                    break;
-                                }
-                                chat::display_command cmd{chat::GUI_USER_ADD, u};
-                                gui_tx.send(cmd);
-                            }
-
-                            if (!end) {
-                                auto users = split(std::string{(char*)(*result).message_}, ':');
-                                for (auto u: users) {
-                                    if (u.compare("END") == 0) {
-                                        break;
-                                    }
-                                }
-                            }
-
-                            break;
+                        break;
+                    }
+                    case chat::MAKEGROUP:
+                    case chat::LEAVEGROUP: {
+                        std::string msg{"group("};
+                        msg.append(view.username_);
+                        msg.append(view.type_ == chat::MAKEGROUP ? "): created" : "): left");
+                        chat::display_command cmd{chat::GUI_CONSOLE, msg};
+                        display.send(cmd);
+                        break;
+                    }
+                    case chat::ADDMEMBER: {
+                        // our own request names who was added, a notice names who added us
+                        std::string msg{"group("};
+                        msg.append(view.username_);
+                        msg.append("): ");
+                        if (view.message_ == username) {
+                            msg.append("joined");
                         }
-                        case chat::ERROR: {
-                            break;
+                        else {
+                            msg.append(view.message_);
+                            msg.append(" added");
                         }
-                        default: {
+                        chat::display_command cmd{chat::GUI_CONSOLE, msg};
+                        display.send(cmd);
+                        break;
+                    }
+                    case chat::GROUPMESSAGE: {
+                        std::string msg{"group("};
+                        msg.append(view.username_);
+                        msg.append(") ");
+                        msg.append(view.message_);
+                        chat::display_command cmd{chat::GUI_CONSOLE, msg};
+                        display.send(cmd);
+                        break;
+                    }
+                    case chat::ERROR: {
+                        break;
+                    }
+                    default: {
 
-                        }
                     }
                 }
             }
+            if (received > 0) {
+                rec_ring.release(received);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (receiver_waiting) {
+                    space.notify();
+                }
+            }
+            display.flush(gui_tx, chat::monotonic_ns());
         }
 
+        if (server_lost) {
+            DEBUG("Server stopped acknowledging\n");
+        }
         DEBUG("Exited loop\n");
-        // send message to GUI to exit
+        // show what is left, then tell the GUI to exit
+        display.flush(gui_tx, chat::monotonic_ns(), true);
         chat::display_command cmd{chat::GUI_EXIT};
         gui_tx.send(cmd);
         gui_thread.join();
+
+        // the receiver may be waiting for a free slot to receive the server's
+        // EXIT or LACK into, so keep emptying the ring until it is done
+        while (!receiver_done) {
+            received_datagram * rest;
+            size_t left = rec_ring.peek(rest, RECEIVE_BATCH);
+            if (left > 0) {
+                rec_ring.release(left);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (receiver_waiting) {
+                    space.notify();
+                }
+            }
+            else {
+                wake.wait(GUI_POLL_MS);
+            }
+        }
         rec_thread.join();
+
+        chat::histogram_snapshot latency;
+        latency.add(handle_ns);
+        printf("main loop: %llu sleeps, %llu GUI poll timeouts, %llu receive ring overflows\n",
+            (unsigned long long)sleeps, (unsigned long long)timeouts,
+            (unsigned long long)rec_ring.overflows());
+        printf("receive to handle us: %llu messages p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+            (unsigned long long)latency.total(),
+            latency.percentile(0.5) / 1000.0, latency.percentile(0.99) / 1000.0,
+            latency.percentile(0.999) / 1000.0, latency.max() / 1000.0);
+        const chat::display_stats& shown = display.stats();
+        printf("display: %llu frames, %llu lines shown, %llu dropped, %llu user list updates\n",
+            (unsigned long long)shown.frames_, (unsigned long long)shown.lines_,
+            (unsigned long long)shown.dropped_, (unsigned long long)shown.user_updates_);
         
         // so done...
         DEBUG("Time to rest\n");
@@ -329,5 +894,10 @@ int main(int argc, char ** argv) {
         DEBUG("Received invalid jack\n");
     }
 
+    if (retransmitter.joinable()) {
+        stop_retransmitter = true;
+        retransmitter.join();
+    }
+
     return 0;
 }
\ No newline at end of file
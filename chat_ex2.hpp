@@ -1,11 +1,17 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include <string>
+#include <string_view>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <arpa/inet.h>
 
+#include <compress.hpp>
+
 #define MAX_USERNAME_LENGTH 64
 #define MAX_MESSAGE_LENGTH 1024
 
@@ -14,6 +20,32 @@
 
 namespace chat { 
 
+// Every message type, in the order of their values on the wire, with the
+// layout of a well formed message:
+//
+//   X(enumerator, handler, STATS name, username, shortest message, longest message)
+//
+// The server handles each type with handle_<handler>, so adding a type is a
+// line here and its handler.
+#define CHAT_MESSAGE_TYPES(X) \
+    X(JOIN,          join,          "join",       FIELD_REQUIRED, 0, 1) \
+    X(JACK,          jack,          "jack",       FIELD_NONE,     0, 0) \
+    X(BROADCAST,     broadcast,     "broadcast",  FIELD_OPTIONAL, 0, MAX_MESSAGE_LENGTH - 1) \
+    X(DIRECTMESSAGE, directmessage, "dm",         FIELD_OPTIONAL, 0, MAX_MESSAGE_LENGTH - 1) \
+    X(LIST,          list,          "list",       FIELD_OPTIONAL, 0, MAX_MESSAGE_LENGTH - 1) \
+    X(LEAVE,         leave,         "leave",      FIELD_NONE,     0, 0) \
+    X(LACK,          lack,          "lack",       FIELD_NONE,     0, 0) \
+    X(EXIT,          exit,          "exit",       FIELD_NONE,     0, 0) \
+    X(ERROR,         error,         "error",      FIELD_NONE,     2, 2) \
+    X(PRESENCE,      presence,      "presence",   FIELD_OPTIONAL, 2, MAX_MESSAGE_LENGTH - 1) \
+    X(STATS,         stats,         "stats",      FIELD_OPTIONAL, 0, MAX_MESSAGE_LENGTH - 1) \
+    X(HISTORY,       history,       "history",    FIELD_OPTIONAL, 0, MAX_MESSAGE_LENGTH - 1) \
+    X(MAKEGROUP,     makegroup,     "makegroup",  FIELD_REQUIRED, 0, 0) \
+    X(ADDMEMBER,     addmember,     "addmember",  FIELD_REQUIRED, 0, MAX_MESSAGE_LENGTH - 1) \
+    X(LEAVEGROUP,    leavegroup,    "leavegroup", FIELD_REQUIRED, 0, 0) \
+    X(GROUPMESSAGE,  groupmessage,  "group",      FIELD_REQUIRED, 0, MAX_MESSAGE_LENGTH - 1) \
+    X(HEARTBEAT,     heartbeat,     "heartbeat",  FIELD_NONE,     0, 0)
+
 /**
  * @brief Chat protocol command types 
  * @var chat_type::JOIN
@@ -37,29 +69,109 @@ namespace chat {
  * Server sends to all online users informing them to terminate
  * @var chat_type::ERROR
  * Server sends to client if an error has occured
+ * @var chat_type::PRESENCE
+ * Server sends to clients that joined with CAP_PRESENCE when a user joins or leaves,
+ * or to mark the end of a LIST snapshot, tagged with the roster version
+ * @var chat_type::STATS
+ * Client requests the server's metrics
+ * Server sends one section of metrics per message (terminated with section END)
+ * @var chat_type::HISTORY
+ * Client requests logged messages, "since <seq>" or "last <n>", optionally only from one user
+ * Server sends one logged message per message (terminated with user END and the next sequence)
+ * @var chat_type::MAKEGROUP
+ * Client creates a group, becoming its first member
+ * Server sends back in reply once the group is created
+ * @var chat_type::ADDMEMBER
+ * Client adds an online user to a group it is a member of
+ * Server sends back in reply, and to the added user with the name of who added them
+ * @var chat_type::LEAVEGROUP
+ * Client leaves a group, the group is removed once empty
+ * Server sends back in reply
+ * @var chat_type::GROUPMESSAGE
+ * Client sends message to every other member of a group
+ * Server sends to the members, prefixed with the sender's name
+ * @var chat_type::HEARTBEAT
+ * Client sends periodically, so the server knows it is still there
  * 
 */
 enum chat_type {
-    JOIN = 0,
-    JACK,
-    BROADCAST,
-    DIRECTMESSAGE,
-    LIST,
-    LEAVE,
-    LACK,
-    EXIT,
-    ERROR,
+#define CHAT_ENUMERATOR(type, handler, name, username, shortest, longest) type,
+    CHAT_MESSAGE_TYPES(CHAT_ENUMERATOR)
+#undef CHAT_ENUMERATOR
     UNKNOWN,
 };
 
+/**
+ * @brief what a message carries in its username field
+*/
+enum field_rule {
+    FIELD_NONE,         // always empty
+    FIELD_OPTIONAL,     // may be empty
+    FIELD_REQUIRED,     // never empty
+};
+
+/**
+ * @struct message_layout
+ * @brief Layout of a well formed message of one type
+ * @var message_layout::name_
+ *  Member 'name_' lower case name, as used in STATS sections
+ * @var message_layout::username_
+ *  Member 'username_' whether the username field is used
+ * @var message_layout::shortest_
+ *  Member 'shortest_' fewest message bytes
+ * @var message_layout::longest_
+ *  Member 'longest_' most message bytes
+ */
+struct message_layout {
+    const char * name_;
+    field_rule username_;
+    uint16_t shortest_;
+    uint16_t longest_;
+};
+
+/**
+ * @brief layout of every message type, indexed by chat_type
+*/
+inline constexpr message_layout message_layouts[UNKNOWN] = {
+#define CHAT_LAYOUT(type, handler, name, username, shortest, longest) {name, username, shortest, longest},
+    CHAT_MESSAGE_TYPES(CHAT_LAYOUT)
+#undef CHAT_LAYOUT
+};
+
 /** @brief check if type is indeed a valid chat_type.
  * @param type the command type to check
  * @return true if a valid type, otherwise false
 */
-inline bool is_valid_type(chat_type type) {
-    return type >= JOIN && type <= ERROR;   
+inline constexpr bool is_valid_type(chat_type type) {
+    return type >= JOIN && type < UNKNOWN;   
 }
 
+/**
+ * @brief name of a chat_type, as used in STATS sections
+ * @param type the command type
+ * @return lower case name, "unknown" if not a valid type
+*/
+inline constexpr const char * type_name(chat_type type) {
+    return is_valid_type(type) ? message_layouts[type].name_ : "unknown";
+}
+
+// Capabilities a client advertises in the first byte of its JOIN message
+
+// Client applies PRESENCE deltas instead of needing a full LIST on every change
+#define CAP_PRESENCE 0x01
+// Client unpacks bundles of several compact frames sent in one datagram
+#define CAP_COALESCE 0x02
+// Client inflates compact frames whose message body is compressed
+#define CAP_COMPRESS 0x04
+
+// Number of capability bits defined above
+#define CAPABILITY_BITS 3
+
+// PRESENCE operations, first byte of the message, followed by the roster version
+#define PRESENCE_ADDED    '+'
+#define PRESENCE_REMOVED  '-'
+#define PRESENCE_SNAPSHOT '='
+
 /** 
  * @struct chat_message
  * @brief Representation of chat protocol message
@@ -76,20 +188,42 @@ struct chat_message {
     int8_t message_[MAX_MESSAGE_LENGTH];
 };
 
+/**
+ * @brief Copy a string into a message field, truncating so it is always NUL terminated
+ * @param field to copy into
+ * @param size of field in bytes
+ * @param value to copy
+*/
+inline void set_field(int8_t * field, size_t size, std::string_view value) {
+    size_t length = value.length() < size ? value.length() : size - 1;
+    memcpy(field, value.data(), length);
+    field[length] = '\0';
+}
+
 /**
  * @brief Create a JOIN message
  * @param username to be stored in the message
+ * @param capabilities CAP_* flags supported by the client
  * @return the chat message
 */
-inline chat_message join_msg(std::string username) {
+inline chat_message join_msg(std::string_view username, uint8_t capabilities = 0) {
     chat_message msg;
     msg.type_ = JOIN;
-    memcpy(&msg.username_[0], username.c_str(), username.length());
-    msg.username_[username.length()] = '\0';
-    msg.message_[0] = '\0';
+    set_field(&msg.username_[0], MAX_USERNAME_LENGTH, username);
+    msg.message_[0] = capabilities;
+    msg.message_[1] = '\0';
     return msg;
 }
 
+/**
+ * @brief Capabilities advertised by a JOIN message
+ * @param msg JOIN message
+ * @return CAP_* flags, 0 for clients that predate capabilities
+*/
+inline uint8_t join_capabilities(const chat_message& msg) {
+    return static_cast<uint8_t>(msg.message_[0]);
+}
+
 /**
  * @brief Create a JACK message
 
@@ -105,12 +239,10 @@ inline chat_message jack_msg() {
  * @param message to be stored in the message
  * @return the chat message
 */
-inline chat_message broadcast_msg(std::string username, std::string message) {
+inline chat_message broadcast_msg(std::string_view username, std::string_view message) {
     chat_message msg{BROADCAST, '\0', '\0'};
-    memcpy(&msg.username_[0], username.c_str(), username.length());
-    msg.username_[username.length()] = '\0';
-    memcpy(&msg.message_[0], message.c_str(), message.length());
-    msg.message_[message.length()] = '\0';
+    set_field(&msg.username_[0], MAX_USERNAME_LENGTH, username);
+    set_field(&msg.message_[0], MAX_MESSAGE_LENGTH, message);
     return msg;
 }
 
@@ -120,12 +252,10 @@ inline chat_message broadcast_msg(std::string username, std::string message) {
  * @param message to be stored in the message
  * @return the chat message
 */
-inline chat_message dm_msg(std::string username, std::string message) {
+inline chat_message dm_msg(std::string_view username, std::string_view message) {
     chat_message msg{DIRECTMESSAGE, '\0', '\0'};
-    memcpy(&msg.username_[0], username.c_str(), username.length());
-    msg.username_[username.length()] = '\0';
-    memcpy(&msg.message_[0], message.c_str(), message.length());
-    msg.message_[message.length()] = '\0';
+    set_field(&msg.username_[0], MAX_USERNAME_LENGTH, username);
+    set_field(&msg.message_[0], MAX_MESSAGE_LENGTH, message);
     return msg;
 }
 
@@ -135,12 +265,10 @@ inline chat_message dm_msg(std::string username, std::string message) {
  * @param message to be stored in the message
  * @return the chat message
 */
-inline chat_message list_msg(std::string username = "", std::string message = "") {
+inline chat_message list_msg(std::string_view username = "", std::string_view message = "") {
     chat_message msg{LIST, '\0', '\0'};
-    memcpy(&msg.username_[0], username.c_str(), username.length());
-    msg.username_[username.length()] = '\0';
-    memcpy(&msg.message_[0], message.c_str(), message.length());
-    msg.message_[message.length()] = '\0';
+    set_field(&msg.username_[0], MAX_USERNAME_LENGTH, username);
+    set_field(&msg.message_[0], MAX_MESSAGE_LENGTH, message);
     return msg;
 }
 
@@ -179,14 +307,738 @@ inline chat_message error_msg(uint16_t err) {
     return msg;
 }
 
+/**
+ * @brief Create a PRESENCE message
+ * @param op PRESENCE_ADDED, PRESENCE_REMOVED or PRESENCE_SNAPSHOT
+ * @param username user that joined or left, empty for PRESENCE_SNAPSHOT
+ * @param version roster version after the change
+ * @return the chat message
+*/
+inline chat_message presence_msg(char op, std::string_view username, uint64_t version) {
+    chat_message msg{PRESENCE, '\0', '\0'};
+    set_field(&msg.username_[0], MAX_USERNAME_LENGTH, username);
+    snprintf(reinterpret_cast<char*>(&msg.message_[0]), MAX_MESSAGE_LENGTH,
+        "%c%llu", op, static_cast<unsigned long long>(version));
+    return msg;
+}
+
+/**
+ * @brief Create a STATS message
+ * @param section name of the metrics in message, empty when requesting
+ * @param message metrics as space separated name=value pairs
+ * @return the chat message
+*/
+inline chat_message stats_msg(std::string_view section = "", std::string_view message = "") {
+    chat_message msg{STATS, '\0', '\0'};
+    set_field(&msg.username_[0], MAX_USERNAME_LENGTH, section);
+    set_field(&msg.message_[0], MAX_MESSAGE_LENGTH, message);
+    return msg;
+}
+
+/**
+ * @brief Create a HISTORY message
+ * @param username user whose messages are wanted, empty for everyone's, or
+ *        sender of a logged message in a reply
+ * @param message query, "since <seq>" or "last <n>", or "#<seq> text" in a reply
+ * @return the chat message
+*/
+inline chat_message history_msg(std::string_view username = "", std::string_view message = "") {
+    chat_message msg{HISTORY, '\0', '\0'};
+    set_field(&msg.username_[0], MAX_USERNAME_LENGTH, username);
+    set_field(&msg.message_[0], MAX_MESSAGE_LENGTH, message);
+    return msg;
+}
+
+/**
+ * @brief Create a MAKEGROUP message
+ * @param group name of the group to create
+ * @return the chat message
+*/
+inline chat_message makegroup_msg(std::string_view group) {
+    chat_message msg{MAKEGROUP, '\0', '\0'};
+    set_field(&msg.username_[0], MAX_USERNAME_LENGTH, group);
+    return msg;
+}
+
+/**
+ * @brief Create an ADDMEMBER message
+ * @param group name of the group
+ * @param username user to add, or in a notice to the added user who added them
+ * @return the chat message
+*/
+inline chat_message addmember_msg(std::string_view group, std::string_view username) {
+    chat_message msg{ADDMEMBER, '\0', '\0'};
+    set_field(&msg.username_[0], MAX_USERNAME_LENGTH, group);
+    set_field(&msg.message_[0], MAX_MESSAGE_LENGTH, username);
+    return msg;
+}
+
+/**
+ * @brief Create a LEAVEGROUP message
+ * @param group name of the group to leave
+ * @return the chat message
+*/
+inline chat_message leavegroup_msg(std::string_view group) {
+    chat_message msg{LEAVEGROUP, '\0', '\0'};
+    set_field(&msg.username_[0], MAX_USERNAME_LENGTH, group);
+    return msg;
+}
+
+/**
+ * @brief Create a GROUPMESSAGE message
+ * @param group name of the group
+ * @param message to be stored in the message, "sender: text" when sent by the server
+ * @return the chat message
+*/
+inline chat_message groupmessage_msg(std::string_view group, std::string_view message) {
+    chat_message msg{GROUPMESSAGE, '\0', '\0'};
+    set_field(&msg.username_[0], MAX_USERNAME_LENGTH, group);
+    set_field(&msg.message_[0], MAX_MESSAGE_LENGTH, message);
+    return msg;
+}
+
+/**
+ * @brief Create a HEARTBEAT message
+ * @return the chat message
+*/
+inline chat_message heartbeat_msg() {
+    return chat_message{HEARTBEAT, '\0', '\0'};
+}
+
+/**
+ * @brief Read the operation and roster version from a PRESENCE message body
+ * @param body PRESENCE message body, not NUL terminated
+ * @param op set to the operation
+ * @param version set to the roster version
+ * @return true if the body is well formed, otherwise false
+*/
+inline bool parse_presence(std::string_view body, char& op, uint64_t& version) {
+    if (body.length() < 2) {
+        return false;
+    }
+    op = body[0];
+    if (op != PRESENCE_ADDED && op != PRESENCE_REMOVED && op != PRESENCE_SNAPSHOT) {
+        return false;
+    }
+    version = 0;
+    for (char c: body.substr(1)) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        version = version * 10 + (c - '0');
+    }
+    return true;
+}
+
+/**
+ * @brief Read the operation and roster version from a PRESENCE message
+ * @param msg PRESENCE message
+ * @param op set to the operation
+ * @param version set to the roster version
+ * @return true if the message is well formed, otherwise false
+*/
+inline bool parse_presence(const chat_message& msg, char& op, uint64_t& version) {
+    const char * body = reinterpret_cast<const char*>(&msg.message_[0]);
+    return parse_presence(std::string_view{body, strnlen(body, MAX_MESSAGE_LENGTH)}, op, version);
+}
+
 /**
  * @brief Print a chat message to stdout
  * @param message to be printed
 */
 void print_message(chat_message message);
 
+//---------------------------------------------------------------------------------------
+// Compact wire format
+//
+// A compact frame only carries the bytes actually used by a message:
+//
+//   +-------+---------+------+----------+------------------+----------+---------+
+//   | magic | version | type | username | message length   | username | message |
+//   |  0xC7 |    1    |  u8  | len (u8) | (u16, net order) |  bytes   |  bytes  |
+//   +-------+---------+------+----------+------------------+----------+---------+
+//
+// Strings are not NUL terminated on the wire. A legacy packet is always exactly
+// sizeof(chat_message) bytes and its first byte is a valid chat_type, which can
+// never equal WIRE_MAGIC, so both encodings can be told apart on receipt.
+//
+// Servers may send clients that joined with CAP_COMPRESS frames with
+// WIRE_COMPRESSED set in the version byte, whose message bytes are an LZ
+// block (see compress.hpp) that inflates to the real message.
+//---------------------------------------------------------------------------------------
+
+#define WIRE_MAGIC          0xC7
+#define WIRE_VERSION        1
+#define WIRE_COMPRESSED     0x80
+#define WIRE_HEADER_LENGTH  6
+#define MAX_FRAME_LENGTH    (WIRE_HEADER_LENGTH + MAX_USERNAME_LENGTH + MAX_MESSAGE_LENGTH)
+
+// Shortest message body worth compressing
+#define COMPRESS_MIN_LENGTH 64
+
+/**
+ * @brief Encoding used on the wire for a given peer
+ * @var wire_format::WIRE_LEGACY
+ * Fixed size chat_message struct
+ * @var wire_format::WIRE_COMPACT
+ * Versioned, length prefixed frame
+*/
+enum wire_format {
+    WIRE_LEGACY = 0,
+    WIRE_COMPACT,
+};
+
+/**
+ * @brief Write a compact frame into buffer
+ * @param buffer to write into, must hold at least MAX_FRAME_LENGTH bytes
+ * @param type chat command
+ * @param username pointer to username bytes
+ * @param username_length number of username bytes, truncated to MAX_USERNAME_LENGTH-1
+ * @param message pointer to message bytes
+ * @param message_length number of message bytes, truncated to MAX_MESSAGE_LENGTH-1
+ * @return number of bytes written
+*/
+inline size_t encode_frame(
+    char * buffer, chat_type type,
+    const char * username, size_t username_length,
+    const char * message, size_t message_length) {
+    if (username_length > MAX_USERNAME_LENGTH - 1) {
+        username_length = MAX_USERNAME_LENGTH - 1;
+    }
+    if (message_length > MAX_MESSAGE_LENGTH - 1) {
+        message_length = MAX_MESSAGE_LENGTH - 1;
+    }
+    buffer[0] = (char)WIRE_MAGIC;
+    buffer[1] = WIRE_VERSION;
+    buffer[2] = (char)type;
+    buffer[3] = (char)username_length;
+    buffer[4] = (char)((message_length >> 8) & 0xFF);
+    buffer[5] = (char)(message_length & 0xFF);
+    memcpy(buffer + WIRE_HEADER_LENGTH, username, username_length);
+    memcpy(buffer + WIRE_HEADER_LENGTH + username_length, message, message_length);
+    return WIRE_HEADER_LENGTH + username_length + message_length;
+}
+
+/**
+ * @brief Write a compact frame of a type fixed at compile time
+ *
+ * Fields the type's message_layout leaves empty are never written, and the
+ * type and its layout are constants, so each call compiles to the copies
+ * the frame needs.
+ *
+ * @param buffer to write into, must hold at least MAX_FRAME_LENGTH bytes
+ * @param username username bytes, truncated to MAX_USERNAME_LENGTH-1
+ * @param message message bytes, truncated to the layout's longest message
+ * @return number of bytes written
+*/
+template<chat_type T>
+inline size_t encode_as(char * buffer, std::string_view username = {}, std::string_view message = {}) {
+    static_assert(is_valid_type(T), "not a message type");
+    constexpr message_layout layout = message_layouts[T];
+    if constexpr (layout.username_ == FIELD_NONE) {
+        username = {};
+    }
+    message = message.substr(0, layout.longest_);
+    return encode_frame(buffer, T, username.data(), username.length(), message.data(), message.length());
+}
+
+/**
+ * @brief Encode a JOIN frame
+ * @param buffer to write into
+ * @param username of joining user
+ * @param capabilities CAP_* flags supported by the client
+ * @return number of bytes written
+*/
+inline size_t encode_join(char * buffer, std::string_view username, uint8_t capabilities = 0) {
+    char caps = static_cast<char>(capabilities);
+    return encode_as<JOIN>(buffer, username, std::string_view{&caps, capabilities ? size_t{1} : 0});
+}
+
+/**
+ * @brief Encode a JACK frame
+ * @param buffer to write into
+ * @return number of bytes written
+*/
+inline size_t encode_jack(char * buffer) {
+    return encode_as<JACK>(buffer);
+}
+
+/**
+ * @brief Encode a BROADCAST frame
+ * @param buffer to write into
+ * @param username of sender
+ * @param message body
+ * @return number of bytes written
+*/
+inline size_t encode_broadcast(char * buffer, std::string_view username, std::string_view message) {
+    return encode_as<BROADCAST>(buffer, username, message);
+}
+
+/**
+ * @brief Encode a DIRECTMESSAGE frame
+ * @param buffer to write into
+ * @param username recipient (client to server) or sender (server to client)
+ * @param message body
+ * @return number of bytes written
+*/
+inline size_t encode_dm(char * buffer, std::string_view username, std::string_view message) {
+    return encode_as<DIRECTMESSAGE>(buffer, username, message);
+}
+
+/**
+ * @brief Encode a LIST frame
+ * @param buffer to write into
+ * @param username ':' separated list of users
+ * @param message ':' separated continuation of users
+ * @return number of bytes written
+*/
+inline size_t encode_list(char * buffer, std::string_view username = "", std::string_view message = "") {
+    return encode_as<LIST>(buffer, username, message);
+}
+
+/**
+ * @brief Encode a LEAVE frame
+ * @param buffer to write into
+ * @return number of bytes written
+*/
+inline size_t encode_leave(char * buffer) {
+    return encode_as<LEAVE>(buffer);
+}
+
+/**
+ * @brief Encode a LACK frame
+ * @param buffer to write into
+ * @return number of bytes written
+*/
+inline size_t encode_lack(char * buffer) {
+    return encode_as<LACK>(buffer);
+}
+
+/**
+ * @brief Encode a EXIT frame
+ * @param buffer to write into
+ * @return number of bytes written
+*/
+inline size_t encode_exit(char * buffer) {
+    return encode_as<EXIT>(buffer);
+}
+
+/**
+ * @brief Encode a ERROR frame
+ * @param buffer to write into
+ * @param err code
+ * @return number of bytes written
+*/
+inline size_t encode_error(char * buffer, uint16_t err) {
+    uint16_t code = htons(err);
+    return encode_as<ERROR>(buffer, {}, std::string_view{reinterpret_cast<const char*>(&code), sizeof(code)});
+}
+
+/**
+ * @brief Encode a PRESENCE frame
+ * @param buffer to write into
+ * @param op PRESENCE_ADDED, PRESENCE_REMOVED or PRESENCE_SNAPSHOT
+ * @param username user that joined or left, empty for PRESENCE_SNAPSHOT
+ * @param version roster version after the change
+ * @return number of bytes written
+*/
+inline size_t encode_presence(char * buffer, char op, std::string_view username, uint64_t version) {
+    char body[24];
+    int length = snprintf(body, sizeof(body), "%c%llu", op, static_cast<unsigned long long>(version));
+    return encode_as<PRESENCE>(buffer, username, std::string_view{body, static_cast<size_t>(length)});
+}
+
+/**
+ * @brief Encode a STATS frame
+ * @param buffer to write into
+ * @param section name of the metrics in message, empty when requesting
+ * @param message metrics as space separated name=value pairs
+ * @return number of bytes written
+*/
+inline size_t encode_stats(char * buffer, std::string_view section = "", std::string_view message = "") {
+    return encode_as<STATS>(buffer, section, message);
+}
+
+/**
+ * @brief Encode a HISTORY frame
+ * @param buffer to write into
+ * @param username user whose messages are wanted, or sender of a logged message
+ * @param message query, or logged message
+ * @return number of bytes written
+*/
+inline size_t encode_history(char * buffer, std::string_view username = "", std::string_view message = "") {
+    return encode_as<HISTORY>(buffer, username, message);
+}
+
+/**
+ * @brief Encode a legacy chat message as a compact frame
+ * @param msg message to encode
+ * @param buffer to write into
+ * @return number of bytes written
+*/
+inline size_t encode(const chat_message& msg, char * buffer) {
+    auto type = static_cast<chat_type>(msg.type_);
+    const char * username = reinterpret_cast<const char*>(&msg.username_[0]);
+    const char * message = reinterpret_cast<const char*>(&msg.message_[0]);
+    size_t message_length = type == ERROR ? sizeof(uint16_t) : strnlen(message, MAX_MESSAGE_LENGTH);
+    return encode_frame(
+        buffer, type, username, strnlen(username, MAX_USERNAME_LENGTH), message, message_length);
+}
+
+/**
+ * @brief check username and message lengths are valid for a given type
+ * @param type chat command
+ * @param username_length length of username field
+ * @param message_length length of message field
+ * @return true if the lengths fit the type's message_layout, otherwise false
+*/
+inline constexpr bool valid_frame_lengths(chat_type type, size_t username_length, size_t message_length) {
+    if (!is_valid_type(type)) {
+        return false;
+    }
+    const message_layout& layout = message_layouts[type];
+    return (layout.username_ != FIELD_NONE || username_length == 0) &&
+        (layout.username_ != FIELD_REQUIRED || username_length > 0) &&
+        message_length >= layout.shortest_ && message_length <= layout.longest_;
+}
+
+/**
+ * @struct message_view
+ * @brief A received message, referring directly into the receive buffer
+ * @var message_view::type_
+ *  Member 'type_' contains the chat command
+ * @var message_view::username_
+ *  Member 'username_' the messages associated username, not NUL terminated
+ * @var message_view::message_
+ *  Member 'message_' the message body, not NUL terminated
+ */
+struct message_view {
+    chat_type type_;
+    std::string_view username_;
+    std::string_view message_;
+};
+
+/**
+ * @brief Decode a received packet, in either wire format, without copying it
+ * 
+ * Field lengths are checked against the packet length and the protocol
+ * limits, so the views never reach past the received bytes.
+ * 
+ * @param buffer received bytes, must outlive view
+ * @param length number of bytes received
+ * @param view decoded message
+ * @param format set to the wire format the packet was encoded with, if not null
+ * @return true if packet was well formed, otherwise false
+*/
+inline bool decode(const char * buffer, size_t length, message_view& view, wire_format * format = nullptr) {
+    if (length == 0) {
+        return false;
+    }
+
+    if (static_cast<uint8_t>(buffer[0]) != WIRE_MAGIC) {
+        auto type = static_cast<chat_type>(static_cast<uint8_t>(buffer[0]));
+        if (length != sizeof(chat_message) || !is_valid_type(type)) {
+            return false;
+        }
+        const char * username = buffer + offsetof(chat_message, username_);
+        const char * message = buffer + offsetof(chat_message, message_);
+        view.type_ = type;
+        view.username_ = std::string_view{username, strnlen(username, MAX_USERNAME_LENGTH - 1)};
+        view.message_ = std::string_view{
+            message, type == ERROR ? sizeof(uint16_t) : strnlen(message, MAX_MESSAGE_LENGTH - 1)};
+        // the same layout rules as a compact frame of the type
+        if (!valid_frame_lengths(type, view.username_.length(), view.message_.length())) {
+            return false;
+        }
+        if (format) {
+            *format = WIRE_LEGACY;
+        }
+        return true;
+    }
+
+    if (length < WIRE_HEADER_LENGTH || buffer[1] != WIRE_VERSION) {
+        return false;
+    }
+
+    auto type = static_cast<chat_type>(static_cast<uint8_t>(buffer[2]));
+    size_t username_length = static_cast<uint8_t>(buffer[3]);
+    size_t message_length =
+        (static_cast<uint8_t>(buffer[4]) << 8) | static_cast<uint8_t>(buffer[5]);
+
+    if (!is_valid_type(type) ||
+        username_length > MAX_USERNAME_LENGTH - 1 ||
+        message_length > MAX_MESSAGE_LENGTH - 1 ||
+        WIRE_HEADER_LENGTH + username_length + message_length != length ||
+        !valid_frame_lengths(type, username_length, message_length)) {
+        return false;
+    }
+
+    view.type_ = type;
+    view.username_ = std::string_view{buffer + WIRE_HEADER_LENGTH, username_length};
+    view.message_ = std::string_view{buffer + WIRE_HEADER_LENGTH + username_length, message_length};
+    if (format) {
+        *format = WIRE_COMPACT;
+    }
+    return true;
+}
+
+/**
+ * @brief Decode a received packet, in either wire format, into a chat message
+ * 
+ * The resulting username and message fields are always NUL terminated.
+ * 
+ * @param buffer received bytes
+ * @param length number of bytes received
+ * @param msg decoded message
+ * @param format set to the wire format the packet was encoded with, if not null
+ * @return true if packet was well formed, otherwise false
+*/
+inline bool decode(const char * buffer, size_t length, chat_message& msg, wire_format * format = nullptr) {
+    message_view view;
+    if (!decode(buffer, length, view, format)) {
+        return false;
+    }
+
+    msg.type_ = view.type_;
+    set_field(&msg.username_[0], MAX_USERNAME_LENGTH, view.username_);
+    if (view.type_ == ERROR) {
+        // legacy error codes are stored in an int
+        memset(&msg.message_[0], 0, sizeof(int));
+        memcpy(&msg.message_[0], view.message_.data(), sizeof(uint16_t));
+    }
+    else {
+        set_field(&msg.message_[0], MAX_MESSAGE_LENGTH, view.message_);
+    }
+    return true;
+}
+
+/**
+ * @brief Read the type of a packet, in either wire format, without checking
+ *        that the rest of it is well formed
+ * @param buffer received or encoded bytes
+ * @param length number of bytes
+ * @return the packet's type, or UNKNOWN if it cannot be read
+*/
+inline chat_type frame_type(const char * buffer, size_t length) {
+    size_t offset = length > 0 && static_cast<uint8_t>(buffer[0]) == WIRE_MAGIC ? 2 : 0;
+    if (length <= offset) {
+        return UNKNOWN;
+    }
+    auto type = static_cast<chat_type>(static_cast<uint8_t>(buffer[offset]));
+    return is_valid_type(type) ? type : UNKNOWN;
+}
+
+/**
+ * @brief Decode a received packet expected to be of a type fixed at compile time
+ * @param buffer received bytes, must outlive view
+ * @param length number of bytes received
+ * @param view decoded message
+ * @return true if packet was well formed and of type T, otherwise false
+*/
+template<chat_type T>
+inline bool decode_as(const char * buffer, size_t length, message_view& view) {
+    static_assert(is_valid_type(T), "not a message type");
+    return frame_type(buffer, length) == T && decode(buffer, length, view);
+}
+
+/**
+ * @brief check if a received datagram is a frame with a compressed message
+*/
+inline bool is_compressed(const char * buffer, size_t length) {
+    return length >= WIRE_HEADER_LENGTH &&
+        static_cast<uint8_t>(buffer[0]) == WIRE_MAGIC &&
+        static_cast<uint8_t>(buffer[1]) == (WIRE_VERSION | WIRE_COMPRESSED);
+}
+
+/**
+ * @brief Compress the message of a compact frame, if that pays off
+ * @param frame well formed compact frame
+ * @param length number of bytes in frame
+ * @param buffer to write the compressed frame into, at least MAX_FRAME_LENGTH bytes
+ * @return length of the compressed frame, or 0 if the message is shorter than
+ *         COMPRESS_MIN_LENGTH or would not shrink by at least an eighth
+*/
+inline size_t compress_frame(const char * frame, size_t length, char * buffer) {
+    size_t username_length = static_cast<uint8_t>(frame[3]);
+    size_t message_length = length - WIRE_HEADER_LENGTH - username_length;
+    if (message_length < COMPRESS_MIN_LENGTH) {
+        return 0;
+    }
+    size_t header_length = WIRE_HEADER_LENGTH + username_length;
+    size_t compressed = lz_compress(
+        frame + header_length, message_length, buffer + header_length, message_length - message_length / 8);
+    if (compressed == 0) {
+        return 0;
+    }
+    memcpy(buffer, frame, header_length);
+    buffer[1] = static_cast<char>(WIRE_VERSION | WIRE_COMPRESSED);
+    buffer[4] = static_cast<char>((compressed >> 8) & 0xFF);
+    buffer[5] = static_cast<char>(compressed & 0xFF);
+    return header_length + compressed;
+}
+
+/**
+ * @brief Rewrite a frame with a compressed message as a plain compact frame
+ * @param frame received bytes, see is_compressed
+ * @param length number of bytes received
+ * @param buffer to write the plain frame into, at least MAX_FRAME_LENGTH bytes
+ * @return length of the plain frame, or 0 if frame was malformed
+*/
+inline size_t inflate_frame(const char * frame, size_t length, char * buffer) {
+    // checks the length covers the header before it is read
+    if (!is_compressed(frame, length)) {
+        return 0;
+    }
+    size_t username_length = static_cast<uint8_t>(frame[3]);
+    size_t message_length =
+        (static_cast<uint8_t>(frame[4]) << 8) | static_cast<uint8_t>(frame[5]);
+    size_t header_length = WIRE_HEADER_LENGTH + username_length;
+    size_t inflated;
+    if (username_length > MAX_USERNAME_LENGTH - 1 ||
+        header_length + message_length != length ||
+        !lz_decompress(frame + header_length, message_length, buffer + header_length,
+            MAX_MESSAGE_LENGTH - 1, inflated)) {
+        return 0;
+    }
+    memcpy(buffer, frame, header_length);
+    buffer[1] = WIRE_VERSION;
+    buffer[4] = static_cast<char>((inflated >> 8) & 0xFF);
+    buffer[5] = static_cast<char>(inflated & 0xFF);
+    return header_length + inflated;
+}
+
+//---------------------------------------------------------------------------------------
+// Bundles
+//
+// Servers may pack several compact frames bound for a client that joined with
+// CAP_COALESCE into one datagram:
+//
+//   +-------+-------+------------------+---------+------------------+---------+
+//   | magic | count | frame length     | frame   | frame length     | frame   | ...
+//   |  0xC9 |  u8   | (u16, net order) |  bytes  | (u16, net order) |  bytes  |
+//   +-------+-------+------------------+---------+------------------+---------+
+//---------------------------------------------------------------------------------------
+
+#define BUNDLE_MAGIC          0xC9
+#define BUNDLE_HEADER_LENGTH  2
+#define BUNDLE_LENGTH_PREFIX  2
+// Longest bundle, sized so it fits a 1500 byte Ethernet MTU after the IP, UDP
+// and reliable delivery headers
+#define MAX_BUNDLE_LENGTH     1400
+
+/**
+ * @brief check if a received datagram is a bundle
+*/
+inline bool is_bundle(const char * buffer, size_t length) {
+    return length > 0 && static_cast<uint8_t>(buffer[0]) == BUNDLE_MAGIC;
+}
+
+/**
+ * @brief Visit each frame of a bundle, in order, once the whole bundle has
+ *        been checked to be well formed
+ * @param buffer received bytes
+ * @param length number of bytes received
+ * @param visit called with (const char * frame, size_t length) for each frame
+ * @return true if the bundle was well formed, otherwise false and nothing is visited
+*/
+template<typename Visit>
+bool for_each_frame(const char * buffer, size_t length, Visit visit) {
+    if (length < BUNDLE_HEADER_LENGTH || !is_bundle(buffer, length)) {
+        return false;
+    }
+    size_t count = static_cast<uint8_t>(buffer[1]);
+    size_t offset = BUNDLE_HEADER_LENGTH;
+    for (size_t i = 0; i < count; i++) {
+        if (length - offset < BUNDLE_LENGTH_PREFIX) {
+            return false;
+        }
+        size_t frame_length =
+            (static_cast<uint8_t>(buffer[offset]) << 8) | static_cast<uint8_t>(buffer[offset + 1]);
+        offset += BUNDLE_LENGTH_PREFIX;
+        if (length - offset < frame_length) {
+            return false;
+        }
+        offset += frame_length;
+    }
+    if (offset != length) {
+        return false;
+    }
+
+    offset = BUNDLE_HEADER_LENGTH;
+    for (size_t i = 0; i < count; i++) {
+        size_t frame_length =
+            (static_cast<uint8_t>(buffer[offset]) << 8) | static_cast<uint8_t>(buffer[offset + 1]);
+        offset += BUNDLE_LENGTH_PREFIX;
+        visit(buffer + offset, frame_length);
+        offset += frame_length;
+    }
+    return true;
+}
+
+/**
+ * @brief A chat message together with its compact encoding, so a message sent
+ *        to many peers is only encoded once, whatever format each peer uses
+ *
+ * The compressed frame is made the first time a peer with CAP_COMPRESS asks
+ * for it, and then shared by every such peer.
+*/
+class encoded_message {
+public:
+    explicit encoded_message(const chat_message& msg) :
+        msg_{msg},
+        length_{encode(msg, &frame_[0])} {
+    }
+
+    // msg is referred to, not copied, so it must outlive the encoding
+    explicit encoded_message(const chat_message&&) = delete;
+
+    /**
+     * @brief bytes to send to a peer using format and capabilities
+    */
+    const char * data(wire_format format, uint8_t capabilities = 0) const {
+        if (format == WIRE_LEGACY) {
+            return reinterpret_cast<const char*>(&msg_);
+        }
+        return compressed(capabilities) ? &compressed_[0] : &frame_[0];
+    }
+
+    /**
+     * @brief number of bytes to send to a peer using format and capabilities
+    */
+    size_t size(wire_format format, uint8_t capabilities = 0) const {
+        if (format == WIRE_LEGACY) {
+            return sizeof(chat_message);
+        }
+        return compressed(capabilities) ? compressed_length_ : length_;
+    }
+
+private:
+    /**
+     * @brief true if a peer with capabilities gets the compressed frame
+    */
+    bool compressed(uint8_t capabilities) const {
+        if ((capabilities & CAP_COMPRESS) == 0) {
+            return false;
+        }
+        if (!tried_) {
+            compressed_length_ = compress_frame(&frame_[0], length_, &compressed_[0]);
+            tried_ = true;
+        }
+        return compressed_length_ != 0;
+    }
+
+    const chat_message& msg_;
+    char frame_[MAX_FRAME_LENGTH];
+    size_t length_;
+    mutable bool tried_ = false;
+    mutable size_t compressed_length_ = 0;
+    mutable char compressed_[MAX_FRAME_LENGTH];
+};
+
 #define ERR_USER_ALREADY_ONLINE 0
 #define ERR_UNKNOWN_USERNAME    1
 #define ERR_UNEXPECTED_MSG      2
+#define ERR_GROUP_EXISTS        3
+#define ERR_NOT_IN_GROUP        4
 
 }; // namespace chat
\ No newline at end of file
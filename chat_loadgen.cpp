@@ -0,0 +1,663 @@
+#include <algorithm>
+#include <random>
+#include <string_view>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <chat_ex2.hpp>
+
+// Prefix of the timestamp carried in BROADCAST and DIRECTMESSAGE bodies
+#define LOADGEN_TAG '@'
+
+// Time allowed for in flight messages to arrive once sending stops
+#define DRAIN_MS 1000
+
+// JOINs outstanding at once while ramping up, each one fans out to every
+// online user so sending them open loop soon overflows the server's socket
+#define JOIN_WINDOW 32
+
+// JOINs not acknowledged after this long are sent again
+#define JOIN_RETRY_MS 250
+
+// Give up ramping up after this long, and run with whoever joined
+#define RAMP_TIMEOUT_MS 60000
+
+namespace {
+
+/**
+ * @brief Operations a simulated client can perform, in the order of their
+ *        weights in --mix
+*/
+enum operation {
+    OP_JOIN = 0,
+    OP_BROADCAST,
+    OP_DM,
+    OP_LIST,
+    OP_LEAVE,
+    OP_COUNT
+};
+
+const char * operation_names[OP_COUNT] = { "join", "broadcast", "dm", "list", "leave" };
+
+/**
+ * @brief Life cycle of a simulated client, it only takes part in the mix once
+ *        the server has acknowledged its JOIN
+*/
+enum client_state {
+    OFFLINE,
+    JOINING,
+    ONLINE,
+    LEAVING
+};
+
+/**
+ * @struct client
+ * @brief A headless client with its own UDP socket, and so its own IP:PORT
+ * @var client::fd_
+ *  Member 'fd_' non blocking socket connected to nothing, used with sendto
+ * @var client::state_
+ *  Member 'state_' where the client is in its life cycle
+ * @var client::joined_ns_
+ *  Member 'joined_ns_' when the client last sent JOIN
+ * @var client::name_
+ *  Member 'name_' username the client joins with
+ */
+struct client {
+    int fd_;
+    client_state state_;
+    uint64_t joined_ns_;
+    char name_[16];
+};
+
+/**
+ * @struct loadgen_options
+ * @brief Command line configuration
+ */
+struct loadgen_options {
+    const char * server_ = "127.0.0.1";
+    uint16_t port_ = SERVER_PORT;
+    size_t clients_ = 1000;
+    double duration_ = 10.0;
+    double rate_ = 10000.0;
+    size_t size_ = 32;
+    unsigned weights_[OP_COUNT] = { 1, 5, 88, 5, 1 };
+    const char * label_ = "";
+    bool exit_server_ = false;
+    uint8_t capabilities_ = CAP_PRESENCE;
+};
+
+/**
+ * @struct loadgen_stats
+ * @brief Results of a run
+ */
+struct loadgen_stats {
+    uint64_t sent_[OP_COUNT] = {};
+    uint64_t send_failures_ = 0;
+    uint64_t datagrams_ = 0;
+    uint64_t bytes_ = 0;
+    uint64_t received_[chat::UNKNOWN] = {};
+    uint64_t malformed_ = 0;
+    uint64_t deliveries_ = 0;
+    std::vector<uint64_t> latencies_ns_;
+};
+
+uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Clients in one state, with O(1) random pick, insert and remove
+*/
+class client_set {
+public:
+    explicit client_set(size_t capacity) : position_(capacity, NONE) {}
+
+    size_t size() const { return members_.size(); }
+
+    void insert(uint32_t c) {
+        position_[c] = members_.size();
+        members_.push_back(c);
+    }
+
+    void erase(uint32_t c) {
+        size_t p = position_[c];
+        members_[p] = members_.back();
+        position_[members_[p]] = p;
+        members_.pop_back();
+        position_[c] = NONE;
+    }
+
+    template<typename Random>
+    uint32_t pick(Random& random) const {
+        return members_[std::uniform_int_distribution<size_t>{0, members_.size() - 1}(random)];
+    }
+
+private:
+    static constexpr size_t NONE = ~size_t{0};
+    std::vector<uint32_t> members_;
+    std::vector<size_t> position_;
+};
+
+/**
+ * @brief Raise the open file limit so a socket per client fits
+ * @return false if the limit cannot cover clients sockets
+*/
+bool reserve_descriptors(size_t clients) {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return false;
+    }
+    rlim_t wanted = clients + 64;
+    if (limit.rlim_cur >= wanted) {
+        return true;
+    }
+    limit.rlim_cur = limit.rlim_max == RLIM_INFINITY || limit.rlim_max >= wanted ? wanted : limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    return limit.rlim_cur >= wanted;
+}
+
+/**
+ * @brief Parse --mix join=W,broadcast=W,dm=W,list=W,leave=W, unnamed weights
+ *        are left as they are
+ * @return false if an operation name is unknown
+*/
+bool parse_mix(const char * mix, unsigned * weights) {
+    std::string_view rest{mix};
+    while (!rest.empty()) {
+        auto comma = rest.find(',');
+        auto item = rest.substr(0, comma);
+        rest = comma == std::string_view::npos ? std::string_view{} : rest.substr(comma + 1);
+
+        auto equals = item.find('=');
+        if (equals == std::string_view::npos) {
+            return false;
+        }
+        auto name = item.substr(0, equals);
+        int op = 0;
+        while (op < OP_COUNT && name != operation_names[op]) {
+            op++;
+        }
+        if (op == OP_COUNT) {
+            return false;
+        }
+        weights[op] = strtoul(std::string{item.substr(equals + 1)}.c_str(), nullptr, 10);
+    }
+    return true;
+}
+
+/**
+ * @brief Runs the simulated clients against a server and collects results
+*/
+class loadgen {
+public:
+    explicit loadgen(const loadgen_options& options) :
+        options_(options),
+        offline_(options.clients_),
+        online_(options.clients_),
+        random_(std::random_device{}()) {
+        memset(&server_, 0, sizeof(server_));
+        server_.sin_family = AF_INET;
+        server_.sin_port = htons(options.port_);
+        inet_pton(AF_INET, options.server_, &server_.sin_addr);
+    }
+
+    ~loadgen() {
+        for (auto& c: clients_) {
+            close(c.fd_);
+        }
+        if (epoll_ >= 0) {
+            close(epoll_);
+        }
+    }
+
+    /**
+     * @brief create one socket per client, bound to an ephemeral loopback port
+     * @return false if sockets could not be created
+    */
+    bool open() {
+        epoll_ = epoll_create1(0);
+        if (epoll_ < 0) {
+            perror("epoll_create1");
+            return false;
+        }
+        clients_.resize(options_.clients_);
+        for (uint32_t i = 0; i < clients_.size(); i++) {
+            client& c = clients_[i];
+            c.fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+            if (c.fd_ < 0) {
+                perror("socket");
+                clients_.resize(i);
+                return false;
+            }
+            sockaddr_in local{};
+            local.sin_family = AF_INET;
+            local.sin_addr = server_.sin_addr;
+            if (bind(c.fd_, (sockaddr*)&local, sizeof(local)) < 0) {
+                perror("bind");
+                clients_.resize(i + 1);
+                return false;
+            }
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.u32 = i;
+            epoll_ctl(epoll_, EPOLL_CTL_ADD, c.fd_, &event);
+
+            c.state_ = OFFLINE;
+            snprintf(c.name_, sizeof(c.name_), "lg%u", i);
+            offline_.insert(i);
+        }
+        return true;
+    }
+
+    /**
+     * @brief join every client, then run the mix for the configured duration
+    */
+    void run() {
+        ramp_up();
+        uint64_t interval_ns = static_cast<uint64_t>(1e9 / options_.rate_);
+
+        // measured phase
+        stats_ = loadgen_stats{};
+        unsigned total_weight = 0;
+        for (unsigned w: options_.weights_) {
+            total_weight += w;
+        }
+        start_ns_ = now_ns();
+        uint64_t end = start_ns_ + static_cast<uint64_t>(options_.duration_ * 1e9);
+        uint64_t next = start_ns_;
+        while (total_weight > 0 && next < end) {
+            perform(choose(total_weight));
+            next += interval_ns;
+            poll_until(next);
+        }
+        send_end_ns_ = now_ns();
+        poll_until(send_end_ns_ + DRAIN_MS * 1000000ULL);
+        end_ns_ = now_ns();
+
+        // keep what was measured, ramping down is not part of the results
+        results_ = std::move(stats_);
+        stats_ = loadgen_stats{};
+
+        // leave quietly, paced so the server's receive queue does not
+        // overflow, so it can be reused, then optionally stop it
+        next = now_ns();
+        for (uint32_t i = 0; i < clients_.size(); i++) {
+            if (clients_[i].state_ == ONLINE || clients_[i].state_ == JOINING) {
+                send(i, chat::encode_leave(frame_));
+                next += interval_ns;
+                poll_until(next);
+            }
+        }
+        if (options_.exit_server_ && !clients_.empty()) {
+            // the server may still be working through a backlog, so repeat
+            // EXIT in case the first is dropped
+            for (int i = 0; i < 3; i++) {
+                poll_until(now_ns() + DRAIN_MS * 1000000ULL / 10);
+                send(0, chat::encode_exit(frame_));
+            }
+        }
+    }
+
+    /**
+     * @brief print the results as a single JSON object
+    */
+    void report(FILE * out) {
+        auto& latencies = results_.latencies_ns_;
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) -> double {
+            if (latencies.empty()) {
+                return 0.0;
+            }
+            size_t i = static_cast<size_t>(p * (latencies.size() - 1) + 0.5);
+            return latencies[i] / 1000.0;
+        };
+
+        double send_seconds = (send_end_ns_ - start_ns_) / 1e9;
+        double seconds = (end_ns_ - start_ns_) / 1e9;
+        uint64_t sent = 0;
+        for (uint64_t n: results_.sent_) {
+            sent += n;
+        }
+        uint64_t received = 0;
+        for (uint64_t n: results_.received_) {
+            received += n;
+        }
+
+        fprintf(out, "{\"label\":\"%s\",\"clients\":%zu,\"duration_s\":%.3f,\"target_rate\":%.1f,"
+            "\"message_size\":%zu,",
+            options_.label_, clients_.size(), send_seconds, options_.rate_, options_.size_);
+        fprintf(out, "\"sent\":{");
+        for (int op = 0; op < OP_COUNT; op++) {
+            fprintf(out, "%s\"%s\":%" PRIu64, op ? "," : "", operation_names[op], results_.sent_[op]);
+        }
+        fprintf(out, "},\"send_failures\":%" PRIu64 ",", results_.send_failures_);
+        fprintf(out, "\"received\":{\"jack\":%" PRIu64 ",\"broadcast\":%" PRIu64 ",\"dm\":%" PRIu64
+            ",\"list\":%" PRIu64 ",\"lack\":%" PRIu64 ",\"error\":%" PRIu64 ",\"presence\":%" PRIu64
+            ",\"malformed\":%" PRIu64 "},",
+            results_.received_[chat::JACK], results_.received_[chat::BROADCAST],
+            results_.received_[chat::DIRECTMESSAGE], results_.received_[chat::LIST],
+            results_.received_[chat::LACK], results_.received_[chat::ERROR],
+            results_.received_[chat::PRESENCE], results_.malformed_);
+        fprintf(out, "\"messages_per_s\":%.1f,\"deliveries\":%" PRIu64 ",\"deliveries_per_s\":%.1f,"
+            "\"received_per_s\":%.1f,\"datagrams_received_per_s\":%.1f,\"bytes_received_per_s\":%.1f,",
+            send_seconds > 0 ? sent / send_seconds : 0.0, results_.deliveries_,
+            seconds > 0 ? results_.deliveries_ / seconds : 0.0,
+            seconds > 0 ? received / seconds : 0.0,
+            seconds > 0 ? results_.datagrams_ / seconds : 0.0,
+            seconds > 0 ? results_.bytes_ / seconds : 0.0);
+        fprintf(out, "\"latency_us\":{\"samples\":%zu,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+            latencies.size(), percentile(0.5), percentile(0.99), percentile(0.999),
+            latencies.empty() ? 0.0 : latencies.back() / 1000.0);
+    }
+
+private:
+    /**
+     * @brief join every client, keeping at most JOIN_WINDOW JOINs outstanding
+    */
+    void ramp_up() {
+        uint64_t deadline = now_ns() + RAMP_TIMEOUT_MS * 1000000ULL;
+        uint64_t next_retry = now_ns() + JOIN_RETRY_MS * 1000000ULL;
+        while (online_.size() < clients_.size() && now_ns() < deadline) {
+            while (joining_ < JOIN_WINDOW && offline_.size() > 0) {
+                join(offline_.pick(random_));
+            }
+            poll_until(now_ns() + 1000000ULL);
+
+            uint64_t now = now_ns();
+            if (now >= next_retry) {
+                for (uint32_t i = 0; i < clients_.size(); i++) {
+                    if (clients_[i].state_ == JOINING &&
+                        now - clients_[i].joined_ns_ >= JOIN_RETRY_MS * 1000000ULL) {
+                        clients_[i].joined_ns_ = now;
+                        send(i, chat::encode_join(frame_, clients_[i].name_, options_.capabilities_));
+                    }
+                }
+                next_retry = now + JOIN_RETRY_MS * 1000000ULL;
+            }
+        }
+        if (online_.size() < clients_.size()) {
+            fprintf(stderr, "Only %zu of %zu clients joined\n", online_.size(), clients_.size());
+        }
+        poll_until(now_ns() + DRAIN_MS * 1000000ULL / 10);
+    }
+
+    operation choose(unsigned total_weight) {
+        unsigned r = std::uniform_int_distribution<unsigned>{0, total_weight - 1}(random_);
+        int op = 0;
+        while (r >= options_.weights_[op]) {
+            r -= options_.weights_[op];
+            op++;
+        }
+        return static_cast<operation>(op);
+    }
+
+    void perform(operation op) {
+        if (op == OP_JOIN) {
+            if (offline_.size() > 0) {
+                join(offline_.pick(random_));
+            }
+            return;
+        }
+        if (online_.size() == 0) {
+            return;
+        }
+        uint32_t c = online_.pick(random_);
+        switch (op) {
+            case OP_BROADCAST:
+                send(c, chat::encode_broadcast(frame_, clients_[c].name_, body()), OP_BROADCAST);
+                break;
+            case OP_DM: {
+                uint32_t to = online_.pick(random_);
+                send(c, chat::encode_dm(frame_, clients_[to].name_, body()), OP_DM);
+                break;
+            }
+            case OP_LIST:
+                send(c, chat::encode_list(frame_), OP_LIST);
+                break;
+            case OP_LEAVE:
+                online_.erase(c);
+                clients_[c].state_ = LEAVING;
+                send(c, chat::encode_leave(frame_), OP_LEAVE);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void join(uint32_t c) {
+        offline_.erase(c);
+        clients_[c].state_ = JOINING;
+        clients_[c].joined_ns_ = now_ns();
+        joining_++;
+        send(c, chat::encode_join(frame_, clients_[c].name_, options_.capabilities_), OP_JOIN);
+    }
+
+    /**
+     * @brief message body carrying the send time, padded to the configured size
+    */
+    std::string_view body() {
+        int n = snprintf(body_, sizeof(body_), "%c%" PRIu64 " ", LOADGEN_TAG, now_ns());
+        size_t length = options_.size_ > static_cast<size_t>(n) ? options_.size_ : n;
+        if (length > MAX_MESSAGE_LENGTH - 1) {
+            length = MAX_MESSAGE_LENGTH - 1;
+        }
+        memset(body_ + n, 'x', length - n);
+        return std::string_view{body_, length};
+    }
+
+    void send(uint32_t c, size_t length, int op = -1) {
+        ssize_t n = sendto(clients_[c].fd_, frame_, length, 0, (sockaddr*)&server_, sizeof(server_));
+        if (n < 0) {
+            stats_.send_failures_++;
+        }
+        else if (op >= 0) {
+            stats_.sent_[op]++;
+        }
+    }
+
+    /**
+     * @brief receive on every ready client socket until deadline
+    */
+    void poll_until(uint64_t deadline) {
+        epoll_event events[256];
+        for (;;) {
+            uint64_t now = now_ns();
+            int timeout_ms = now >= deadline ? 0 : static_cast<int>((deadline - now) / 1000000);
+            int n = epoll_wait(epoll_, events, 256, timeout_ms);
+            for (int i = 0; i < n; i++) {
+                drain(events[i].data.u32);
+            }
+            if (n < 256 && now_ns() >= deadline) {
+                return;
+            }
+        }
+    }
+
+    void drain(uint32_t c) {
+        char buffer[std::max({sizeof(chat::chat_message), size_t{MAX_FRAME_LENGTH}, size_t{MAX_BUNDLE_LENGTH}})];
+        for (;;) {
+            ssize_t n = recv(clients_[c].fd_, buffer, sizeof(buffer), 0);
+            if (n < 0) {
+                return;
+            }
+            uint64_t received_ns = now_ns();
+            stats_.datagrams_++;
+            stats_.bytes_ += n;
+
+            if (!chat::is_bundle(buffer, n)) {
+                handle(c, buffer, n, received_ns);
+            }
+            else if (!chat::for_each_frame(buffer, n, [this, c, received_ns](const char * frame, size_t length) {
+                    handle(c, frame, length, received_ns);
+                })) {
+                stats_.malformed_++;
+            }
+        }
+    }
+
+    void handle(uint32_t c, const char * data, size_t length, uint64_t received_ns) {
+        char inflated[MAX_FRAME_LENGTH];
+        if (chat::is_compressed(data, length)) {
+            length = chat::inflate_frame(data, length, inflated);
+            data = inflated;
+        }
+        chat::message_view msg;
+        if (!chat::decode(data, length, msg)) {
+            stats_.malformed_++;
+            return;
+        }
+        stats_.received_[msg.type_]++;
+
+        switch (msg.type_) {
+            case chat::JACK:
+                online(c);
+                break;
+            case chat::LACK:
+                if (clients_[c].state_ == LEAVING) {
+                    clients_[c].state_ = OFFLINE;
+                    offline_.insert(c);
+                }
+                break;
+            case chat::ERROR:
+                // a repeated JOIN whose first JACK was lost, so the
+                // server already has the client online
+                online(c);
+                break;
+            case chat::BROADCAST:
+            case chat::DIRECTMESSAGE:
+                if (!msg.message_.empty() && msg.message_[0] == LOADGEN_TAG) {
+                    char stamp[24] = {};
+                    msg.message_.copy(stamp, sizeof(stamp) - 1, 1);
+                    uint64_t sent_ns = strtoull(stamp, nullptr, 10);
+                    stats_.deliveries_++;
+                    if (sent_ns >= start_ns_ && received_ns >= sent_ns) {
+                        stats_.latencies_ns_.push_back(received_ns - sent_ns);
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    void online(uint32_t c) {
+        if (clients_[c].state_ == JOINING) {
+            clients_[c].state_ = ONLINE;
+            online_.insert(c);
+            joining_--;
+        }
+    }
+
+    loadgen_options options_;
+    sockaddr_in server_;
+    std::vector<client> clients_;
+    client_set offline_;
+    client_set online_;
+    size_t joining_ = 0;
+    int epoll_ = -1;
+    std::mt19937_64 random_;
+    loadgen_stats stats_;
+    loadgen_stats results_;
+    uint64_t start_ns_ = 0;
+    uint64_t send_end_ns_ = 0;
+    uint64_t end_ns_ = 0;
+    char frame_[MAX_FRAME_LENGTH];
+    char body_[MAX_MESSAGE_LENGTH];
+};
+
+void usage(const char * name) {
+    printf("USAGE: %s [--server <ip>] [--port <port>] [--clients <n>] [--duration <seconds>]\n"
+           "       [--rate <messages per second>] [--size <message bytes>]\n"
+           "       [--mix join=W,broadcast=W,dm=W,list=W,leave=W] [--label <text>] [--exit-server]\n"
+           "       [--coalesce] [--compress]\n",
+           name);
+}
+
+}; // namespace
+
+/**
+ * @brief Load generator for the chat server
+ *
+ * Simulates many headless clients over loopback, each with its own socket,
+ * and prints a single line of JSON with throughput and delivery latency, so
+ * results can be compared between releases. Latency is measured from the
+ * timestamp each BROADCAST and DIRECTMESSAGE carries in its body to its
+ * arrival at every recipient.
+*/
+int main(int argc, char ** argv) {
+    loadgen_options options;
+
+    static struct option long_options[] = {
+        {"server",      required_argument, nullptr, 's'},
+        {"port",        required_argument, nullptr, 'p'},
+        {"clients",     required_argument, nullptr, 'c'},
+        {"duration",    required_argument, nullptr, 'd'},
+        {"rate",        required_argument, nullptr, 'r'},
+        {"size",        required_argument, nullptr, 'z'},
+        {"mix",         required_argument, nullptr, 'm'},
+        {"label",       required_argument, nullptr, 'l'},
+        {"exit-server", no_argument,       nullptr, 'x'},
+        {"coalesce",    no_argument,       nullptr, 'k'},
+        {"compress",    no_argument,       nullptr, 'Z'},
+        {nullptr, 0,                       nullptr, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:p:c:d:r:z:m:l:xkZ", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 's': options.server_ = optarg; break;
+            case 'p': options.port_ = static_cast<uint16_t>(strtoul(optarg, nullptr, 10)); break;
+            case 'c': options.clients_ = strtoul(optarg, nullptr, 10); break;
+            case 'd': options.duration_ = strtod(optarg, nullptr); break;
+            case 'r': options.rate_ = strtod(optarg, nullptr); break;
+            case 'z': options.size_ = strtoul(optarg, nullptr, 10); break;
+            case 'm':
+                if (!parse_mix(optarg, options.weights_)) {
+                    printf("Bad --mix: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'l': options.label_ = optarg; break;
+            case 'x': options.exit_server_ = true; break;
+            case 'k': options.capabilities_ |= CAP_COALESCE; break;
+            case 'Z': options.capabilities_ |= CAP_COMPRESS; break;
+            default:
+                usage(argv[0]);
+                exit(0);
+        }
+    }
+
+    if (options.clients_ == 0 || options.rate_ <= 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (!reserve_descriptors(options.clients_)) {
+        fprintf(stderr, "Not enough file descriptors for %zu clients, raise ulimit -n\n", options.clients_);
+        exit(1);
+    }
+
+    loadgen generator{options};
+    if (!generator.open()) {
+        exit(1);
+    }
+    generator.run();
+    generator.report(stdout);
+
+    return 0;
+}
@@ -0,0 +1,462 @@
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <capture.hpp>
+#include <chat_ex2.hpp>
+
+// Time allowed for responses to arrive once the last datagram has been sent
+#define DRAIN_MS 1000
+
+// Datagrams sent between checks for responses when replaying at full speed
+#define POLL_EVERY 32
+
+namespace {
+
+/**
+ * @struct endpoint
+ * @brief A client seen in the capture, replayed from a socket of its own
+ * @var endpoint::address_
+ *  Member 'address_' the client's address in the capture
+ * @var endpoint::fd_
+ *  Member 'fd_' non blocking socket the client's datagrams are replayed from
+ * @var endpoint::expected_
+ *  Member 'expected_' responses the server sent the client in the capture,
+ *  less those received so far, by normalised message
+ */
+struct endpoint {
+    sockaddr_in address_;
+    int fd_;
+    std::unordered_map<std::string, int64_t> expected_;
+};
+
+/**
+ * @struct replay_datagram
+ * @brief A datagram to send to the server
+ * @var replay_datagram::ns_
+ *  Member 'ns_' time since the capture started
+ * @var replay_datagram::endpoint_
+ *  Member 'endpoint_' index of the client that sent it
+ * @var replay_datagram::bytes_
+ *  Member 'bytes_' the datagram
+ */
+struct replay_datagram {
+    uint64_t ns_;
+    uint32_t endpoint_;
+    std::string bytes_;
+};
+
+/**
+ * @struct replay_options
+ * @brief Command line configuration
+ */
+struct replay_options {
+    const char * server_ = "127.0.0.1";
+    uint16_t port_ = SERVER_PORT;
+    const char * capture_ = nullptr;
+    double speed_ = 1.0;
+    bool max_speed_ = false;
+    const char * label_ = "";
+    bool exit_server_ = false;
+};
+
+uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t key(const sockaddr_in& address) {
+    return (static_cast<uint64_t>(address.sin_addr.s_addr) << 16) | address.sin_port;
+}
+
+/**
+ * @brief Raise the open file limit so a socket per endpoint fits
+ * @return false if the limit cannot cover endpoints sockets
+*/
+bool reserve_descriptors(size_t endpoints) {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return false;
+    }
+    rlim_t wanted = endpoints + 64;
+    if (limit.rlim_cur >= wanted) {
+        return true;
+    }
+    limit.rlim_cur = limit.rlim_max == RLIM_INFINITY || limit.rlim_max >= wanted ? wanted : limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    return limit.rlim_cur >= wanted;
+}
+
+/**
+ * @brief Replays a capture against a server and compares its responses
+ *
+ * Responses are compared per client as a multiset of decoded messages, so
+ * the interleaving of different clients' traffic, which depends on timing,
+ * is not counted as divergence, but any message missing, extra or changed
+ * is, by type.
+*/
+class replayer {
+public:
+    explicit replayer(const replay_options& options) : options_(options) {
+        memset(&server_, 0, sizeof(server_));
+        server_.sin_family = AF_INET;
+        server_.sin_port = htons(options.port_);
+        inet_pton(AF_INET, options.server_, &server_.sin_addr);
+    }
+
+    ~replayer() {
+        for (auto& e: endpoints_) {
+            if (e.fd_ >= 0) {
+                close(e.fd_);
+            }
+        }
+        if (epoll_ >= 0) {
+            close(epoll_);
+        }
+    }
+
+    /**
+     * @brief read the capture, keeping the datagrams to send and the
+     *        responses expected by each client that sent any
+     * @return false if the capture could not be read
+    */
+    bool load() {
+        chat::capture_reader reader;
+        try {
+            reader.open(options_.capture_);
+        }
+        catch (std::system_error& ex) {
+            fprintf(stderr, "%s\n", ex.what());
+            return false;
+        }
+
+        std::unordered_map<uint64_t, uint32_t> index;
+        std::vector<std::pair<uint64_t, std::string>> responses;
+        chat::capture_record record;
+        while (reader.next(record)) {
+            records_++;
+            if (record.direction_ == chat::CAPTURE_FROM_SERVER) {
+                for_each_message(record.data_, record.length_, [&](const std::string& m) {
+                    responses.emplace_back(key(record.address_), m);
+                });
+                continue;
+            }
+            auto [it, added] = index.try_emplace(key(record.address_), static_cast<uint32_t>(endpoints_.size()));
+            if (added) {
+                endpoints_.push_back(endpoint{record.address_, -1, {}});
+            }
+            datagrams_.push_back(replay_datagram{record.ns_, it->second, std::string{record.data_, record.length_}});
+        }
+
+        // workers write their batches whole, so records are only in time order per worker
+        std::stable_sort(datagrams_.begin(), datagrams_.end(),
+            [](const replay_datagram& a, const replay_datagram& b) { return a.ns_ < b.ns_; });
+
+        // responses to clients that never sent anything cannot be replayed
+        for (const auto& [k, m]: responses) {
+            auto it = index.find(k);
+            if (it == index.end()) {
+                unreplayable_++;
+                continue;
+            }
+            endpoints_[it->second].expected_[m]++;
+            expected_++;
+        }
+        return true;
+    }
+
+    /**
+     * @brief create one socket per endpoint, bound to an ephemeral port
+     * @return false if sockets could not be created
+    */
+    bool open() {
+        if (!reserve_descriptors(endpoints_.size())) {
+            fprintf(stderr, "Not enough file descriptors for %zu endpoints, raise ulimit -n\n", endpoints_.size());
+            return false;
+        }
+        epoll_ = epoll_create1(0);
+        if (epoll_ < 0) {
+            perror("epoll_create1");
+            return false;
+        }
+        for (uint32_t i = 0; i < endpoints_.size(); i++) {
+            endpoint& e = endpoints_[i];
+            e.fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+            if (e.fd_ < 0) {
+                perror("socket");
+                return false;
+            }
+            sockaddr_in local{};
+            local.sin_family = AF_INET;
+            local.sin_addr = server_.sin_addr;
+            if (bind(e.fd_, (sockaddr*)&local, sizeof(local)) < 0) {
+                perror("bind");
+                return false;
+            }
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.u32 = i;
+            epoll_ctl(epoll_, EPOLL_CTL_ADD, e.fd_, &event);
+        }
+        return true;
+    }
+
+    /**
+     * @brief send every captured datagram, paced as captured or as fast as
+     *        possible, then wait for the responses
+    */
+    void run() {
+        start_ns_ = now_ns();
+        uint64_t first_ns = datagrams_.empty() ? 0 : datagrams_.front().ns_;
+        for (size_t i = 0; i < datagrams_.size(); i++) {
+            const replay_datagram& d = datagrams_[i];
+            if (!options_.max_speed_) {
+                poll_until(start_ns_ + static_cast<uint64_t>((d.ns_ - first_ns) / options_.speed_));
+            }
+            else if (i % POLL_EVERY == 0) {
+                poll_until(0);
+            }
+            send(d.endpoint_, d.bytes_.data(), d.bytes_.size());
+        }
+        send_end_ns_ = now_ns();
+        poll_until(send_end_ns_ + DRAIN_MS * 1000000ULL);
+        end_ns_ = now_ns();
+
+        if (options_.exit_server_ && !endpoints_.empty()) {
+            char frame[MAX_FRAME_LENGTH];
+            send(0, frame, chat::encode_exit(frame));
+        }
+    }
+
+    /**
+     * @brief print the results as a single JSON object
+    */
+    void report(FILE * out) {
+        // whatever is left expected was never received, anything below zero
+        // was received but not expected
+        uint64_t missing = 0;
+        uint64_t unexpected = 0;
+        uint64_t missing_by_type[chat::UNKNOWN + 1] = {};
+        uint64_t unexpected_by_type[chat::UNKNOWN + 1] = {};
+        for (const auto& e: endpoints_) {
+            for (const auto& [m, count]: e.expected_) {
+                auto type = static_cast<chat::chat_type>(static_cast<uint8_t>(m[0]));
+                if (count > 0) {
+                    missing += count;
+                    missing_by_type[type] += count;
+                }
+                else if (count < 0) {
+                    unexpected += -count;
+                    unexpected_by_type[type] += -count;
+                }
+            }
+        }
+
+        double send_seconds = (send_end_ns_ - start_ns_) / 1e9;
+        double seconds = (end_ns_ - start_ns_) / 1e9;
+        fprintf(out, "{\"label\":\"%s\",\"capture\":\"%s\",\"pacing\":\"%s\",\"speed\":%.1f,"
+            "\"records\":%" PRIu64 ",\"endpoints\":%zu,",
+            options_.label_, options_.capture_, options_.max_speed_ ? "max" : "captured",
+            options_.max_speed_ ? 0.0 : options_.speed_, records_, endpoints_.size());
+        fprintf(out, "\"sent\":%" PRIu64 ",\"send_failures\":%" PRIu64 ",\"duration_s\":%.3f,"
+            "\"messages_per_s\":%.1f,\"received_per_s\":%.1f,",
+            sent_, send_failures_, send_seconds,
+            send_seconds > 0 ? sent_ / send_seconds : 0.0,
+            seconds > 0 ? received_ / seconds : 0.0);
+        fprintf(out, "\"expected\":%" PRIu64 ",\"received\":%" PRIu64 ",\"matched\":%" PRIu64
+            ",\"missing\":%" PRIu64 ",\"unexpected\":%" PRIu64 ",\"unreplayable\":%" PRIu64
+            ",\"malformed\":%" PRIu64 ",\"divergence\":{",
+            expected_, received_, expected_ - missing, missing, unexpected, unreplayable_, malformed_);
+        bool first = true;
+        for (int type = 0; type <= chat::UNKNOWN; type++) {
+            if (missing_by_type[type] == 0 && unexpected_by_type[type] == 0) {
+                continue;
+            }
+            fprintf(out, "%s\"%s\":{\"missing\":%" PRIu64 ",\"unexpected\":%" PRIu64 "}",
+                first ? "" : ",", chat::type_name(static_cast<chat::chat_type>(type)),
+                missing_by_type[type], unexpected_by_type[type]);
+            first = false;
+        }
+        fprintf(out, "}}\n");
+    }
+
+private:
+    /**
+     * @brief visit each message of a datagram from the server, unpacking
+     *        bundles and inflating compressed frames, as a string of its
+     *        type, username and message
+     * @return false if the datagram was malformed
+    */
+    template<typename Visit>
+    static bool for_each_message(const char * data, size_t length, Visit visit) {
+        auto one = [&visit](const char * frame, size_t frame_length) {
+            char inflated[MAX_FRAME_LENGTH];
+            if (chat::is_compressed(frame, frame_length)) {
+                frame_length = chat::inflate_frame(frame, frame_length, inflated);
+                frame = inflated;
+            }
+            chat::message_view view;
+            if (!chat::decode(frame, frame_length, view)) {
+                return false;
+            }
+            std::string m;
+            m.reserve(2 + view.username_.size() + view.message_.size());
+            m.push_back(static_cast<char>(view.type_));
+            m.append(view.username_);
+            m.push_back('\0');
+            m.append(view.message_);
+            visit(m);
+            return true;
+        };
+        if (!chat::is_bundle(data, length)) {
+            return one(data, length);
+        }
+        bool ok = true;
+        if (!chat::for_each_frame(data, length, [&](const char * frame, size_t frame_length) {
+                ok = one(frame, frame_length) && ok;
+            })) {
+            return false;
+        }
+        return ok;
+    }
+
+    void send(uint32_t e, const char * data, size_t length) {
+        ssize_t n = sendto(endpoints_[e].fd_, data, length, 0, (sockaddr*)&server_, sizeof(server_));
+        if (n < 0) {
+            send_failures_++;
+        }
+        else {
+            sent_++;
+        }
+    }
+
+    /**
+     * @brief handle responses until deadline, or only those already waiting
+     *        if deadline has passed
+    */
+    void poll_until(uint64_t deadline) {
+        epoll_event events[256];
+        for (;;) {
+            uint64_t now = now_ns();
+            int timeout_ms = deadline > now ? static_cast<int>((deadline - now + 999999) / 1000000) : 0;
+            int n = epoll_wait(epoll_, events, 256, timeout_ms);
+            for (int i = 0; i < n; i++) {
+                drain(events[i].data.u32);
+            }
+            if (n < 256 && now_ns() >= deadline) {
+                return;
+            }
+        }
+    }
+
+    void drain(uint32_t e) {
+        char buffer[std::max({sizeof(chat::chat_message), size_t{MAX_FRAME_LENGTH}, size_t{MAX_BUNDLE_LENGTH}})];
+        for (;;) {
+            ssize_t n = recv(endpoints_[e].fd_, buffer, sizeof(buffer), 0);
+            if (n < 0) {
+                return;
+            }
+            auto& expected = endpoints_[e].expected_;
+            if (!for_each_message(buffer, n, [this, &expected](const std::string& m) {
+                    received_++;
+                    expected[m]--;
+                })) {
+                malformed_++;
+            }
+        }
+    }
+
+    replay_options options_;
+    sockaddr_in server_;
+    std::vector<endpoint> endpoints_;
+    std::vector<replay_datagram> datagrams_;
+    int epoll_ = -1;
+    uint64_t records_ = 0;
+    uint64_t expected_ = 0;
+    uint64_t unreplayable_ = 0;
+    uint64_t sent_ = 0;
+    uint64_t send_failures_ = 0;
+    uint64_t received_ = 0;
+    uint64_t malformed_ = 0;
+    uint64_t start_ns_ = 0;
+    uint64_t send_end_ns_ = 0;
+    uint64_t end_ns_ = 0;
+};
+
+void usage(const char * name) {
+    printf("USAGE: %s --capture <file> [--server <ip>] [--port <port>] [--speed <factor>] [--max-speed]\n"
+           "       [--label <text>] [--exit-server]\n",
+           name);
+}
+
+}; // namespace
+
+/**
+ * @brief Replays traffic recorded by chat_server --record against a server
+ *
+ * Each client in the capture is played from a socket of its own, at the
+ * captured pacing, scaled by --speed, or as fast as possible, and the server's responses are
+ * compared with the captured ones. Prints a single line of JSON with
+ * throughput and divergence, so a capture of real traffic serves as a
+ * repeatable performance and regression test.
+*/
+int main(int argc, char ** argv) {
+    replay_options options;
+
+    static struct option long_options[] = {
+        {"capture",     required_argument, nullptr, 'f'},
+        {"server",      required_argument, nullptr, 's'},
+        {"port",        required_argument, nullptr, 'p'},
+        {"speed",       required_argument, nullptr, 'v'},
+        {"max-speed",   no_argument,       nullptr, 'm'},
+        {"label",       required_argument, nullptr, 'l'},
+        {"exit-server", no_argument,       nullptr, 'x'},
+        {nullptr, 0,                       nullptr, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "f:s:p:v:ml:x", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'f': options.capture_ = optarg; break;
+            case 's': options.server_ = optarg; break;
+            case 'p': options.port_ = static_cast<uint16_t>(strtoul(optarg, nullptr, 10)); break;
+            case 'v': options.speed_ = strtod(optarg, nullptr); break;
+            case 'm': options.max_speed_ = true; break;
+            case 'l': options.label_ = optarg; break;
+            case 'x': options.exit_server_ = true; break;
+            default:
+                usage(argv[0]);
+                exit(0);
+        }
+    }
+
+    if (options.capture_ == nullptr || options.speed_ <= 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    replayer replay{options};
+    if (!replay.load() || !replay.open()) {
+        exit(1);
+    }
+    replay.run();
+    replay.report(stdout);
+
+    return 0;
+}
@@ -1,25 +1,137 @@
-#include <map>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
 // IOT socket api
 #include <iot/socket.hpp>
 
 #include <arpa/inet.h>
+#include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#include <chat.hpp>
+#include <chat_ex2.hpp>
+#include <server_io.hpp>
+#include <server_metrics.hpp>
+#include <reliable.hpp>
+#include <capture.hpp>
+#include <coalesce.hpp>
+#include <federation.hpp>
+#include <history.hpp>
+#include <message_log.hpp>
+#include <rooms.hpp>
+#include <send_queue.hpp>
+#include <heartbeat.hpp>
+#include <uring_socket.hpp>
+#include <user_registry.hpp>
 
 #define USER_ALL "__ALL"
 #define USER_END "END"
 
+using chat::client_endpoint;
+
+/**
+ * @brief current online clients, indexed by username and by IP:PORT
+*/
+typedef chat::user_registry online_users;
+
+/**
+ * @brief server wide metrics, one shard per worker, sized before workers start
+*/
+chat::server_metrics metrics;
+
+/**
+ * @brief recent broadcasts, replayed to users as they join, sized before
+ *        workers start and empty unless --history is given
+*/
+chat::message_history history;
+
+/**
+ * @brief durable log of every routed message, opened before workers start
+ *        and closed unless --log is given
+*/
+chat::message_log chat_log;
+
+/**
+ * @brief groups of online users, guarded by the same lock as the online users
+*/
+chat::room_registry rooms;
+
+/**
+ * @brief timers evicting clients that go silent, guarded by the same lock as
+ *        the online users and disabled unless --idle-timeout is given
+*/
+chat::idle_monitor idle;
+
+/**
+ * @brief capture of every datagram to and from clients, opened before workers
+ *        start and closed unless --record is given
+*/
+chat::capture_writer capture;
+
 /**
- * @brief map of current online clients
+ * @brief other nodes of the cluster and the users on them, guarded by the
+ *        same lock as the online users and empty unless --peer is given
 */
-typedef std::map<std::string, sockaddr_in *> online_users;
+chat::federation cluster;
+
+// Most logged messages sent in reply to one HISTORY request
+#define LOG_MAX_REPLY 100
 
 void handle_list(
-    online_users& online_users, std::string username, std::string,
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop);
+    online_users& online_users, std::string_view username, std::string_view,
+    client_endpoint& client, chat::outbox& out, bool& exit_loop);
+void send_snapshot(online_users& online_users, const client_endpoint& client, chat::outbox& out);
+void send_list_all(online_users& online_users, chat::outbox& out);
+void send_presence(
+    online_users& online_users, char op, std::string_view username,
+    const sockaddr_in * except, chat::outbox& out);
+
+/**
+ * @brief Queue an encoded message for a client, using the client's wire format
+ *
+ * @param msg encoded message to send
+ * @param client to send message to
+ * @param out queue of datagrams to send to clients
+*/
+void send_to(const chat::encoded_message& msg, const client_endpoint& client, chat::outbox& out) {
+    out.send(
+        msg.data(client.format_, client.capabilities_), msg.size(client.format_, client.capabilities_),
+        client.address_);
+}
+
+/**
+ * @brief Queue a message for a client, using the client's wire format, and
+ *        compressed if the client takes that and it pays off
+ *
+ * @param msg to send
+ * @param client to send message to
+ * @param out queue of datagrams to send to clients
+*/
+void send_to(const chat::chat_message& msg, const client_endpoint& client, chat::outbox& out) {
+    if (client.format_ == chat::WIRE_LEGACY) {
+        out.send(reinterpret_cast<const char*>(&msg), sizeof(chat::chat_message), client.address_);
+        return;
+    }
+    char frame[MAX_FRAME_LENGTH];
+    size_t len = chat::encode(msg, frame);
+    if (client.capabilities_ & CAP_COMPRESS) {
+        char compressed[MAX_FRAME_LENGTH];
+        size_t compressed_len = chat::compress_frame(frame, len, compressed);
+        if (compressed_len != 0) {
+            out.send(compressed, compressed_len, client.address_);
+            return;
+        }
+    }
+    out.send(frame, len, client.address_);
+}
 
 /**
  * @brief Send a given message to all clients
@@ -27,19 +139,68 @@ void handle_list(
  * @param msg to send
  * @param username used if  not to send to that particular user
  * @param online_users current online users
- * @param sock socket for communicting with client 
+ * @param out queue of datagrams to send to clients
  * @param send_to_username determines also to send to username
 */
 void send_all(
-    chat::chat_message& msg, std::string username, online_users& online_users, 
-    uwe::socket& sock, bool send_to_username = true) {
-    for (const auto user: online_users) {    
-        if ((send_to_username && user.first.compare(username) == 0) || user.first.compare(username) != 0) { 
-            int len = sock.sendto(
-                reinterpret_cast<const char*>(&msg), sizeof(chat::chat_message), 0,
-                (sockaddr*)user.second, sizeof(struct sockaddr_in));
+    chat::chat_message& msg, std::string_view username, online_users& online_users, 
+    chat::outbox& out, bool send_to_username = true) {
+    chat::encoded_message encoded{msg};
+    const chat::user_record * except = send_to_username ? nullptr : online_users.find(username);
+    online_users.destinations().send(
+        encoded, out, except != nullptr ? &except->endpoint_.address_ : nullptr);
+}
+
+/**
+ * @brief Roster version shown to clients, which also moves when users join
+ *        or leave other nodes
+ * @param online_users current online users
+*/
+uint64_t roster_version(online_users& online_users) {
+    return online_users.version() + cluster.version();
+}
+
+/**
+ * @brief Queue a federation datagram for one peer
+ * @param node index of the peer
+ * @param kind a federation_kind
+ * @param count users on this node, for HELLO
+ * @param name user joined or left, or sender of a forwarded message
+ * @param target recipient of a forwarded direct message
+ * @param text forwarded message
+ * @param out queue of datagrams to send
+*/
+void send_to_node(
+    size_t node, chat::federation_kind kind, uint32_t count, std::string_view name,
+    std::string_view target, std::string_view text, chat::outbox& out) {
+    char buffer[FEDERATION_MAX_LENGTH];
+    size_t length = chat::encode_federation(buffer, kind, cluster.epoch(), count, name, target, text);
+    out.send(buffer, length, cluster.node(node).address_);
+}
+
+/**
+ * @brief Queue a federation datagram, encoded once, for every peer that is up
+ * @param kind a federation_kind
+ * @param name user joined or left, or sender of a forwarded message
+ * @param text forwarded message
+ * @param out queue of datagrams to send
+ * @return number of peers it was queued for
+*/
+size_t send_to_nodes(chat::federation_kind kind, std::string_view name, std::string_view text, chat::outbox& out) {
+    if (!cluster.enabled()) {
+        return 0;
+    }
+    char buffer[FEDERATION_MAX_LENGTH];
+    size_t length = chat::encode_federation(buffer, kind, cluster.epoch(), 0, name, {}, text);
+    size_t sent = 0;
+    for (size_t i = 0; i < cluster.size(); i++) {
+        // peers not heard from get the whole directory once they are
+        if (cluster.node(i).epoch_ != 0) {
+            out.send(buffer, length, cluster.node(i).address_);
+            sent++;
         }
-    }   
+    }
+    return sent;
 }
 
 /**
@@ -48,55 +209,43 @@ void send_all(
  * Note: there should not be any incoming errors messages!
  * 
  * @param err code for error
- * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
-void handle_error(uint16_t err, struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+void handle_error(uint16_t err, client_endpoint& client, chat::outbox& out, bool& exit_loop) {
     auto msg = chat::error_msg(err);
-    int len = sock.sendto(
-        reinterpret_cast<const char*>(&msg), sizeof(chat::chat_message), 0,
-        (sockaddr*)&client_address, sizeof(struct sockaddr_in));
+    send_to(msg, client, out);
 }
 
 /**
  * @brief handle broadcast message
  * 
- * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param online_users registry of usernames and their corresponding IP:PORT address
  * @param username part of chat protocol packet
  * @param msg part of chat protocol packet
- * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 void handle_broadcast(
-    online_users& online_users, std::string username, std::string msg,
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& online_users, std::string_view username, std::string_view msg,
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
     
     DEBUG("Received broadcast\n");
 
-    // Prepare the broadcast message outside the loop to avoid re-creating it
+    // Encode the broadcast message once, for every recipient
     auto m = chat::broadcast_msg(username, msg);
-
-    // Iterate through the list of online users to send the message to each user
-    for (const auto& [user_name, user_address] : online_users) {
-        // Skip sending the message to the user who sent it
-        if (client_address.sin_addr.s_addr == user_address->sin_addr.s_addr &&
-            client_address.sin_port == user_address->sin_port) {
-            DEBUG("Not sending message to self: %s\n", username.c_str());
-            continue; // Skip to the next user
-        }
-
-        // Send the broadcast message
-        int len = sock.sendto(
-            reinterpret_cast<const char*>(&m), sizeof(chat::chat_message), 0,
-            (sockaddr*)user_address, sizeof(struct sockaddr_in));
-
-        // Check if sending was successful
-        if (len < 0) {
-            // Handle send error, e.g., by logging or taking corrective action
-            DEBUG("Failed to send message to %s\n", user_name.c_str());
-        }
+    chat::encoded_message encoded{m};
+
+    // Queue it for every online user except the sender, send failures are
+    // counted by the I/O backend
+    online_users.destinations().send(encoded, out, &client.address_);
+    // and once to every other node, which fans it out to its own users
+    cluster.stats().broadcasts_out_ += send_to_nodes(chat::FEDERATION_BROADCAST, username, msg, out);
+    history.append(username, msg);
+    if (chat_log.is_open()) {
+        chat_log.append(chat::BROADCAST, username, "", msg);
     }
 }
 
@@ -104,11 +253,11 @@ void handle_broadcast(
 /**
  * @brief handle join messageß
  * 
- * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param online_users registry of usernames and their corresponding IP:PORT address
  * @param username part of chat protocol packet
  * @param msg part of chat protocol packet
- * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 // void handle_join(
@@ -140,74 +289,98 @@ void handle_broadcast(
 //     }
 // }
 void handle_join(
-    online_users& users, std::string username, std::string,
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
-    if (users.find(username) != users.end()) {
-        handle_error(ERR_USER_ALREADY_ONLINE, client_address, sock, exit_loop);
+    online_users& users, std::string_view username, std::string_view capabilities,
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
+    client.capabilities_ = capabilities.empty() ? 0 : static_cast<uint8_t>(capabilities[0]);
+
+    // the same name, here or on another node, or another name from the same
+    // IP:PORT, is already online
+    if (cluster.owner(username) >= 0 || !users.insert(username, client)) {
+        handle_error(ERR_USER_ALREADY_ONLINE, client, out, exit_loop);
     } else {
-        auto* addr = new sockaddr_in(client_address);
-        users[username] = addr;
+        idle.add(client.address_, chat::monotonic_ns());
         auto msg = chat::jack_msg();
-        sock.sendto(reinterpret_cast<const char*>(&msg), sizeof(msg), 0, (sockaddr*)&client_address, sizeof(client_address));
-        for (const auto& user : users) {
-            if (user.first != username) {
-                auto brdcst = chat::broadcast_msg("Server", username + " has joined the chat.");
-                sock.sendto(reinterpret_cast<const char*>(&brdcst), sizeof(brdcst), 0, (sockaddr*)user.second, sizeof(sockaddr_in));
-            }
+        send_to(msg, client, out);
+        // tell everyone else, encoding the notice once
+        char notice[MAX_MESSAGE_LENGTH];
+        snprintf(notice, sizeof(notice), "%.*s has joined the chat.",
+            static_cast<int>(username.length()), username.data());
+        auto brdcst = chat::broadcast_msg("Server", notice);
+        chat::encoded_message encoded{brdcst};
+        users.destinations().send(encoded, out, &client.address_);
+        send_to_nodes(chat::FEDERATION_JOINED, username, "", out);
+
+        // clients that apply deltas just hear about the new user, everyone
+        // else gets the whole list again
+        send_presence(users, PRESENCE_ADDED, username, &client.address_, out);
+        handle_list(users, USER_ALL, "", client, out, exit_loop);
+        if (client.capabilities_ & CAP_PRESENCE) {
+            send_snapshot(users, client, out);
         }
-        handle_list(users, USER_ALL, "", client_address, sock, exit_loop);
+
+        // catch the new user up on what was said before they joined
+        history.replay(history.capacity(), [&client, &out](std::string_view from, std::string_view text) {
+            send_to(chat::broadcast_msg(from, text), client, out);
+        });
     }
 }
 
 /*
  * @brief handle jack message
  * 
- * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param online_users registry of usernames and their corresponding IP:PORT address
  * @param username part of chat protocol packet
  * @param msg part of chat protocol packet
- * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 void handle_jack(
-    online_users& online_users, std::string username, std::string, 
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& online_users, std::string_view username, std::string_view, 
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
     DEBUG("Received jack\n");
-    handle_error(ERR_UNEXPECTED_MSG, client_address, sock, exit_loop);
+    handle_error(ERR_UNEXPECTED_MSG, client, out, exit_loop);
 }
 
 /**
  * @brief handle direct message
  * 
- * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param online_users registry of usernames and their corresponding IP:PORT address
  * @param username part of chat protocol packet
  * @param msg part of chat protocol packet
- * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 void handle_directmessage(
-    online_users& online_users, std::string recipient, std::string message,
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
-    DEBUG("Received direct message to %s\n", recipient.c_str());
+    online_users& online_users, std::string_view recipient, std::string_view message,
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
+    DEBUG("Received direct message to %.*s\n", static_cast<int>(recipient.length()), recipient.data());
 
     // Find the recipient in the map of online users
-    auto recipient_it = online_users.find(recipient);
-    if (recipient_it != online_users.end()) {
+    auto recipient_user = online_users.find(recipient);
+    if (recipient_user != nullptr) {
         DEBUG("Found user for direct message\n");
+        // Identify the sender by address, so the recipient sees who it is from
+        auto sender = online_users.find(client.address_);
         // Create the direct message
-        auto d = chat::dm_msg(recipient, message);
-        // Send the direct message
-        int len = sock.sendto(
-            reinterpret_cast<const char*>(&d), sizeof(chat::chat_message), 0,
-            (sockaddr*)recipient_it->second, sizeof(struct sockaddr_in));
-
-        if (len < 0) {
-            DEBUG("Failed to send direct message to %s\n", recipient.c_str());
-            // Optionally handle the send error (e.g., by logging or retrying)
+        auto d = chat::dm_msg(sender != nullptr ? sender->name() : recipient, message);
+        // Queue the direct message, send failures are counted by the I/O backend
+        send_to(d, recipient_user->endpoint_, out);
+        if (chat_log.is_open() && sender != nullptr) {
+            chat_log.append(chat::DIRECTMESSAGE, sender->name(), recipient_user->name(), message);
+        }
+    } else if (int node = cluster.owner(recipient); node >= 0) {
+        // one hop, straight to the node the recipient is on
+        auto sender = online_users.find(client.address_);
+        std::string_view from = sender != nullptr ? sender->name() : recipient;
+        send_to_node(node, chat::FEDERATION_DM, 0, from, recipient, message, out);
+        cluster.stats().dms_out_++;
+        if (chat_log.is_open() && sender != nullptr) {
+            chat_log.append(chat::DIRECTMESSAGE, sender->name(), recipient, message);
         }
     } else {
-        DEBUG("Recipient %s not found\n", recipient.c_str());
+        DEBUG("Recipient %.*s not found\n", static_cast<int>(recipient.length()), recipient.data());
         // Optionally handle the case when the recipient is not found
     }
 }
@@ -216,20 +389,14 @@ void handle_directmessage(
 
 
 /**
- * @brief handle list message
+ * @brief Pack the usernames of all online users, on this node and the
+ *        others, into LIST messages
  * 
- * @param online_users map of usernames to their corresponding IP:PORT address
- * @param username part of chat protocol packet
- * @param msg part of chat protocol packet
- * @param client_address address of client to send message to
- * @param sock socket for communicting with client
- * @parm exit_loop set to true if event loop is to terminate
+ * @param online_users registry of usernames and their corresponding IP:PORT address
+ * @param send called with each LIST message, the last one terminated with user END
 */
-void handle_list(
-    online_users& online_users, std::string username, std::string,
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
-    DEBUG("Received list\n");
-
+template<typename Send>
+void pack_list(online_users& online_users, Send send) {
     int username_size = MAX_USERNAME_LENGTH;
     int message_size  = MAX_MESSAGE_LENGTH;
 
@@ -241,13 +408,15 @@ void handle_list(
     bool using_username = true;
     bool full = false;
 
-    for (const auto user: online_users) {
+    auto add = [&](std::string_view name) {
+        int name_length = static_cast<int>(name.length());
         if (using_username) {
-            if (username_size - (user.first.length()+1) >= 0) {
-                memcpy(username_ptr, user.first.c_str(), user.first.length());
-                *(username_ptr+user.first.length()) = ':';
-                username_ptr = username_ptr+user.first.length()+1;
-                username_size = username_size - (user.first.length()+1);
+            // keep one byte spare for the terminating '\0'
+            if (username_size - (name_length+1) > 0) {
+                memcpy(username_ptr, name.data(), name_length);
+                *(username_ptr+name_length) = ':';
+                username_ptr = username_ptr+name_length+1;
+                username_size = username_size - (name_length+1);
                 username_data[MAX_USERNAME_LENGTH - username_size] = '\0';
             }
             else {
@@ -257,11 +426,11 @@ void handle_list(
 
         // otherwise we fill the message field
         if(!using_username) {
-            if (message_size - (user.first.length()+1) >= 0) {
-                memcpy(message_ptr, user.first.c_str(), user.first.length());
-                *(message_ptr+user.first.length()) = ':';
-                message_ptr = message_ptr+user.first.length()+1;
-                message_size = message_size - (user.first.length()+1);
+            if (message_size - (name_length+1) > 0) {
+                memcpy(message_ptr, name.data(), name_length);
+                *(message_ptr+name_length) = ':';
+                message_ptr = message_ptr+name_length+1;
+                message_size = message_size - (name_length+1);
             }
             else {
                 // we are full and we need to send packet and start again
@@ -271,15 +440,7 @@ void handle_list(
                 message_data[MAX_MESSAGE_LENGTH - message_size] = '\0';
                 memcpy(msg.message_, &message_data[0], MAX_MESSAGE_LENGTH - message_size );
 
-                // 
-                if (username.compare("__ALL") == 0) {
-                    send_all(msg, "__ALL", online_users, sock);
-                }
-                else {
-                    int len = sock.sendto(
-                        reinterpret_cast<const char*>(&msg), sizeof(chat::chat_message), 0,
-                        (sockaddr*)&client_address, sizeof(struct sockaddr_in));
-                }
+                send(msg);
 
                 username_size = MAX_USERNAME_LENGTH;
                 message_size  = MAX_MESSAGE_LENGTH;
@@ -290,7 +451,16 @@ void handle_list(
                 using_username = false;
             }
         }
+    };
+    for (const auto& user: online_users) {
+        add(user.name());
     }
+    // users on other nodes, unless a user here has the same name
+    cluster.for_each_user([&](std::string_view name) {
+        if (online_users.find(name) == nullptr) {
+            add(name);
+        }
+    });
 
     if (using_username) {
         if (username_size >= 4) { 
@@ -315,64 +485,135 @@ void handle_list(
     message_data[MAX_MESSAGE_LENGTH - message_size] = '\0';
     memcpy(msg.message_, &message_data[0], MAX_MESSAGE_LENGTH - message_size );
 
-    if (username.compare("__ALL") == 0) {
-        send_all(msg, "__ALL", online_users, sock);
+    send(msg);
+}
+
+
+/**
+ * @brief Send a full roster snapshot to one client
+ * 
+ * Clients that apply PRESENCE deltas are also told the roster version the
+ * snapshot corresponds to, so they can spot later gaps.
+ * 
+ * @param online_users registry of usernames and their corresponding IP:PORT address
+ * @param client address of client to send snapshot to
+ * @param out queue of datagrams to send to clients
+*/
+void send_snapshot(online_users& online_users, const client_endpoint& client, chat::outbox& out) {
+    pack_list(online_users, [&](chat::chat_message& msg) {
+        send_to(msg, client, out);
+    });
+    if (client.capabilities_ & CAP_PRESENCE) {
+        auto marker = chat::presence_msg(PRESENCE_SNAPSHOT, "", roster_version(online_users));
+        send_to(marker, client, out);
+    }
+}
+
+/**
+ * @brief Tell clients that apply PRESENCE deltas that a user joined or left
+ * 
+ * @param online_users registry of usernames, already updated
+ * @param op PRESENCE_ADDED or PRESENCE_REMOVED
+ * @param username user that joined or left
+ * @param except if not null, address not to send to
+ * @param out queue of datagrams to send to clients
+*/
+void send_presence(
+    online_users& online_users, char op, std::string_view username,
+    const sockaddr_in * except, chat::outbox& out) {
+    auto delta = chat::presence_msg(op, username, roster_version(online_users));
+    chat::encoded_message encoded{delta};
+    online_users.destinations().send(encoded, out, except, CAP_PRESENCE);
+}
+
+/**
+ * @brief Send the whole list to every client that does not apply PRESENCE deltas
+ * 
+ * @param online_users registry of usernames and their corresponding IP:PORT address
+ * @param out queue of datagrams to send to clients
+*/
+void send_list_all(online_users& online_users, chat::outbox& out) {
+    pack_list(online_users, [&](chat::chat_message& msg) {
+        chat::encoded_message encoded{msg};
+        online_users.destinations().send(encoded, out, nullptr, 0, CAP_PRESENCE);
+    });
+}
+
+/**
+ * @brief handle list message
+ * 
+ * @param online_users registry of usernames and their corresponding IP:PORT address
+ * @param username part of chat protocol packet, USER_ALL to send to every client
+ *                 that does not apply PRESENCE deltas
+ * @param msg part of chat protocol packet
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_list(
+    online_users& online_users, std::string_view username, std::string_view,
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
+    DEBUG("Received list\n");
+
+    if (username == USER_ALL) {
+        send_list_all(online_users, out);
     }
     else {
-        int len = sock.sendto(
-            reinterpret_cast<const char*>(&msg), sizeof(chat::chat_message), 0,
-            (sockaddr*)&client_address, sizeof(struct sockaddr_in));
+        // reply with the capabilities the client joined with
+        auto user = online_users.find(client.address_);
+        send_snapshot(online_users, user != nullptr ? user->endpoint_ : client, out);
     }
 }
 
 /**
  * @brief handle leave message
  * 
- * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param online_users registry of usernames and their corresponding IP:PORT address
  * @param username part of chat protocol packet
  * @param msg part of chat protocol packet
- * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 void handle_leave(
-    online_users& online_users, std::string username, std::string,
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& online_users, std::string_view username, std::string_view,
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
 
     DEBUG("Received leave\n");
 
-    // Attempt to identify the username based on the client's socket address
-    for (const auto& user : online_users) {
-        if (strcmp(inet_ntoa(client_address.sin_addr), inet_ntoa(user.second->sin_addr)) == 0 &&
-            client_address.sin_port == user.second->sin_port) {
-            username = user.first;
-            break; // Stop the search once the user is found
-        }
+    // Identify the username based on the client's socket address, copied out
+    // as the registry reuses the record once the user is erased
+    char name[MAX_USERNAME_LENGTH];
+    if (auto user = online_users.find(client.address_); user != nullptr) {
+        memcpy(name, user->name().data(), user->name().length());
+        username = std::string_view{name, user->name().length()};
     }
     
     if (username.empty()) {
         // This condition should not happen if the user was correctly identified
         DEBUG("Error: User not found.");
-        handle_error(ERR_UNKNOWN_USERNAME, client_address, sock, exit_loop);
+        handle_error(ERR_UNKNOWN_USERNAME, client, out, exit_loop);
     } else {
         // Log the username of the user leaving
-        DEBUG("%s is leaving the server\n", username.c_str());
+        DEBUG("%.*s is leaving the server\n", static_cast<int>(username.length()), username.data());
 
         // Broadcast message to other users about this user leaving
-        auto brdcast = chat::broadcast_msg("Server", username + " has left the chat.");
-        send_all(brdcast, username, online_users, sock);
-
-        // Clean up: Remove the user from the online_users map
-        auto search = online_users.find(username);
-        if (search != online_users.end()) {
-            delete search->second; // Assuming dynamic allocation of sockaddr_in
-            online_users.erase(search);
-        }
+        char notice[MAX_MESSAGE_LENGTH];
+        snprintf(notice, sizeof(notice), "%.*s has left the chat.",
+            static_cast<int>(username.length()), username.data());
+        auto brdcast = chat::broadcast_msg("Server", notice);
+        send_all(brdcast, username, online_users, out);
+
+        // Clean up: Remove the user from their groups and the online users
+        rooms.remove_all(username);
+        idle.remove(client.address_);
+        online_users.erase(username);
+        send_presence(online_users, PRESENCE_REMOVED, username, nullptr, out);
+        send_to_nodes(chat::FEDERATION_LEFT, username, "", out);
 
         // Acknowledge the user's leave request
         auto ack_msg = chat::lack_msg();
-        sock.sendto(reinterpret_cast<const char*>(&ack_msg), sizeof(chat::chat_message), 0,
-                    (sockaddr*)&client_address, sizeof(struct sockaddr_in));
+        send_to(ack_msg, client, out);
     }
 }
 
@@ -380,97 +621,1032 @@ void handle_leave(
 /**
  * @brief handle lack message
  * 
- * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param online_users registry of usernames and their corresponding IP:PORT address
  * @param username part of chat protocol packet
  * @param msg part of chat protocol packet
- * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 void handle_lack(
-    online_users& online_users, std::string username, std::string,
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& online_users, std::string_view username, std::string_view,
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
     DEBUG("Received lack\n");
-    handle_error(ERR_UNEXPECTED_MSG, client_address, sock, exit_loop);
+    handle_error(ERR_UNEXPECTED_MSG, client, out, exit_loop);
+}
+
+/**
+ * @brief handle presence message, only ever sent by the server
+ * 
+ * @param online_users registry of usernames and their corresponding IP:PORT address
+ * @param username part of chat protocol packet
+ * @param msg part of chat protocol packet
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_presence(
+    online_users& online_users, std::string_view username, std::string_view,
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
+    DEBUG("Received presence\n");
+    handle_error(ERR_UNEXPECTED_MSG, client, out, exit_loop);
 }
 
 /**
  * @brief handle exit message
  * 
- * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param online_users registry of usernames and their corresponding IP:PORT address
  * @param username part of chat protocol packet
  * @param msg part of chat protocol packet
- * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 void handle_exit(
-    online_users& online_users, std::string username, std::string, 
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& online_users, std::string_view username, std::string_view, 
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
     
     DEBUG("Received exit\n");
 
-    // Iterate over the online_users map to send an exit message to each user
-    for (auto& user_entry : online_users) {
-        std::string user_name = user_entry.first;
-        sockaddr_in* user_addr = user_entry.second;
+    // Create the exit message packet
+    chat::chat_message exit_message = chat::exit_msg();
+    chat::encoded_message encoded{exit_message};
 
-        // Create the exit message packet
-        chat::chat_message exit_message = chat::exit_msg();
+    // Queue the exit message for every online user
+    online_users.destinations().send(encoded, out);
+    DEBUG("Exit message queued for %zu users\n", online_users.size());
+    // the other nodes forget this one's users rather than wait for it to time out
+    send_to_nodes(chat::FEDERATION_GOODBYE, "", "", out);
 
-        // Send the exit message to the user
-        int len = sock.sendto(
-            reinterpret_cast<const char*>(&exit_message), sizeof(chat::chat_message), 0,
-            (sockaddr*)user_addr, sizeof(struct sockaddr_in));
-
-        if (len == sizeof(chat::chat_message)) {
-            DEBUG("Exit message sent to %s\n", user_name.c_str());
-        } else {
-            DEBUG("Failed to send exit message to %s\n", user_name.c_str());
-            // Handle the failure to send the message (e.g., error message or other actions)
-        }
-        // Clear up memory for the user
-        delete user_addr;
-    }
-    // Clear the online_users map
+    // Clear the groups and online users
+    rooms.clear();
+    idle.clear();
     online_users.clear();
     // Set exit_loop to true to indicate that the event loop should terminate
     exit_loop = true;
 }
 
 
+/**
+ * @brief handle stats message, replying with one STATS message per chat_type
+ *        seen so far, then the fan-out sizes, then section END
+ * 
+ * @param online_users registry of usernames and their corresponding IP:PORT address
+ * @param username part of chat protocol packet
+ * @param msg part of chat protocol packet
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_stats(
+    online_users& online_users, std::string_view username, std::string_view,
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
+    DEBUG("Received stats\n");
+
+    char body[MAX_MESSAGE_LENGTH];
+    for (size_t i = 0; i <= chat::UNKNOWN; i++) {
+        auto type = static_cast<chat::chat_type>(i);
+        unsigned long long packets_in = metrics.total(i, &chat::type_counters::packets_in_);
+        unsigned long long packets_out = metrics.total(i, &chat::type_counters::packets_out_);
+        unsigned long long malformed = metrics.total(i, &chat::type_counters::malformed_);
+        if (packets_in == 0 && packets_out == 0 && malformed == 0) {
+            continue;
+        }
+
+        int length = snprintf(body, sizeof(body),
+            "packets_in=%llu bytes_in=%llu packets_out=%llu bytes_out=%llu send_failures=%llu malformed=%llu",
+            packets_in, (unsigned long long)metrics.total(i, &chat::type_counters::bytes_in_),
+            packets_out, (unsigned long long)metrics.total(i, &chat::type_counters::bytes_out_),
+            (unsigned long long)metrics.total(i, &chat::type_counters::send_failures_), malformed);
+        if (type != chat::UNKNOWN) {
+            auto handler_ns = metrics.handler_ns(type);
+            snprintf(body + length, sizeof(body) - length,
+                " handler_ns_count=%llu handler_ns_p50=%llu handler_ns_p99=%llu"
+                " handler_ns_p999=%llu handler_ns_max=%llu",
+                (unsigned long long)handler_ns.total(), (unsigned long long)handler_ns.percentile(0.5),
+                (unsigned long long)handler_ns.percentile(0.99), (unsigned long long)handler_ns.percentile(0.999),
+                (unsigned long long)handler_ns.max());
+        }
+        send_to(chat::stats_msg(chat::type_name(type), body), client, out);
+    }
+
+    auto fanout = metrics.fanout();
+    snprintf(body, sizeof(body), "count=%llu p50=%llu p99=%llu p999=%llu max=%llu",
+        (unsigned long long)fanout.total(), (unsigned long long)fanout.percentile(0.5),
+        (unsigned long long)fanout.percentile(0.99), (unsigned long long)fanout.percentile(0.999),
+        (unsigned long long)fanout.max());
+    send_to(chat::stats_msg("fanout", body), client, out);
+    send_to(chat::stats_msg(USER_END), client, out);
+}
+
+/**
+ * @brief handle history message, replying with logged messages oldest first
+ *
+ * The query is "since <seq>" or "last <n>", and username, if given, only
+ * wants messages from that user. Direct messages are only sent to their
+ * sender or recipient. Replies are terminated with user END and the sequence
+ * number to ask for next.
+ *
+ * @param online_users registry of usernames and their corresponding IP:PORT address
+ * @param username part of chat protocol packet
+ * @param msg part of chat protocol packet
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_history(
+    online_users& online_users, std::string_view username, std::string_view msg,
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
+    DEBUG("Received history\n");
+
+    if (!chat_log.is_open()) {
+        send_to(chat::history_msg(USER_END), client, out);
+        return;
+    }
+
+    auto requester = online_users.find(client.address_);
+    std::string_view self = requester != nullptr ? requester->name() : std::string_view{};
+    auto allowed = [self](const chat::log_entry& e) {
+        return e.type_ == chat::BROADCAST ||
+            (!self.empty() && (e.sender_ == self || e.recipient_ == self));
+    };
+    // everything before next_seq was looked at, unless a reply fills up
+    uint64_t next = chat_log.next_seq();
+    uint64_t last_sent = 0;
+    auto reply = [&client, &out, &last_sent](const chat::log_entry& e) {
+        char body[MAX_MESSAGE_LENGTH];
+        if (e.type_ == chat::DIRECTMESSAGE) {
+            snprintf(body, sizeof(body), "#%llu @%.*s %.*s", (unsigned long long)e.seq_,
+                static_cast<int>(e.recipient_.length()), e.recipient_.data(),
+                static_cast<int>(e.message_.length()), e.message_.data());
+        }
+        else {
+            snprintf(body, sizeof(body), "#%llu %.*s", (unsigned long long)e.seq_,
+                static_cast<int>(e.message_.length()), e.message_.data());
+        }
+        send_to(chat::history_msg(e.sender_, body), client, out);
+        last_sent = e.seq_;
+    };
+
+    // msg is not NUL terminated, so parse the number in place
+    size_t space = msg.find(' ');
+    std::string_view op = msg.substr(0, space);
+    std::string_view number{space != std::string_view::npos ? msg.substr(space + 1) : std::string_view{}};
+    uint64_t value = 0;
+    std::from_chars(number.data(), number.data() + number.length(), value);
+    if (op == "since") {
+        if (chat_log.since(value, LOG_MAX_REPLY, username, allowed, reply) == LOG_MAX_REPLY) {
+            next = last_sent + 1;
+        }
+    }
+    else if (op == "last") {
+        chat_log.last(std::min<uint64_t>(value, LOG_MAX_REPLY), username, allowed, reply);
+    }
+    send_to(chat::history_msg(USER_END, std::to_string(next)), client, out);
+}
+
+/**
+ * @brief handle makegroup message, creating a group with the sender as its
+ *        first member
+ * 
+ * @param online_users registry of usernames and their corresponding IP:PORT address
+ * @param group part of chat protocol packet
+ * @param msg part of chat protocol packet
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_makegroup(
+    online_users& online_users, std::string_view group, std::string_view,
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
+    DEBUG("Received makegroup %.*s\n", static_cast<int>(group.length()), group.data());
+
+    auto user = online_users.find(client.address_);
+    if (user == nullptr) {
+        handle_error(ERR_UNKNOWN_USERNAME, client, out, exit_loop);
+    }
+    else if (!rooms.create(group, *user)) {
+        handle_error(ERR_GROUP_EXISTS, client, out, exit_loop);
+    }
+    else {
+        send_to(chat::makegroup_msg(group), client, out);
+    }
+}
+
+/**
+ * @brief handle addmember message, adding an online user to a group the
+ *        sender is a member of
+ * 
+ * @param online_users registry of usernames and their corresponding IP:PORT address
+ * @param group part of chat protocol packet
+ * @param username part of chat protocol packet, the user to add
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_addmember(
+    online_users& online_users, std::string_view group, std::string_view username,
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
+    DEBUG("Received addmember %.*s to %.*s\n", static_cast<int>(username.length()), username.data(),
+        static_cast<int>(group.length()), group.data());
+
+    auto sender = online_users.find(client.address_);
+    auto user = online_users.find(username);
+    if (sender == nullptr || !rooms.is_member(group, sender->name())) {
+        handle_error(ERR_NOT_IN_GROUP, client, out, exit_loop);
+    }
+    else if (user == nullptr) {
+        handle_error(ERR_UNKNOWN_USERNAME, client, out, exit_loop);
+    }
+    else {
+        // adding an existing member again is not an error
+        if (rooms.add(group, *user)) {
+            send_to(chat::addmember_msg(group, sender->name()), user->endpoint_, out);
+        }
+        send_to(chat::addmember_msg(group, username), client, out);
+    }
+}
+
+/**
+ * @brief handle leavegroup message, removing the sender from a group, and the
+ *        group once empty
+ * 
+ * @param online_users registry of usernames and their corresponding IP:PORT address
+ * @param group part of chat protocol packet
+ * @param msg part of chat protocol packet
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_leavegroup(
+    online_users& online_users, std::string_view group, std::string_view,
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
+    DEBUG("Received leavegroup %.*s\n", static_cast<int>(group.length()), group.data());
+
+    auto user = online_users.find(client.address_);
+    if (user == nullptr || !rooms.remove(group, user->name())) {
+        handle_error(ERR_NOT_IN_GROUP, client, out, exit_loop);
+    }
+    else {
+        send_to(chat::leavegroup_msg(group), client, out);
+    }
+}
+
+/**
+ * @brief handle group message, sending it to every other member of the group
+ * 
+ * @param online_users registry of usernames and their corresponding IP:PORT address
+ * @param group part of chat protocol packet
+ * @param message part of chat protocol packet
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_groupmessage(
+    online_users& online_users, std::string_view group, std::string_view message,
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
+    DEBUG("Received group message to %.*s\n", static_cast<int>(group.length()), group.data());
+
+    auto sender = online_users.find(client.address_);
+    auto room = rooms.find(group);
+    if (sender == nullptr || room == nullptr || !rooms.is_member(group, sender->name())) {
+        handle_error(ERR_NOT_IN_GROUP, client, out, exit_loop);
+        return;
+    }
+
+    // Encode the message once, for every member but the sender
+    char body[MAX_MESSAGE_LENGTH];
+    snprintf(body, sizeof(body), "%.*s: %.*s",
+        static_cast<int>(sender->name().length()), sender->name().data(),
+        static_cast<int>(message.length()), message.data());
+    auto m = chat::groupmessage_msg(group, body);
+    chat::encoded_message encoded{m};
+    room->destinations().send(encoded, out, &client.address_);
+}
+
+/**
+ * @brief handle heartbeat message, which only shows the client is still
+ *        there, as every message from a client does
+ * 
+ * @param online_users registry of usernames and their corresponding IP:PORT address
+ * @param username part of chat protocol packet
+ * @param msg part of chat protocol packet
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void handle_heartbeat(
+    online_users& online_users, std::string_view, std::string_view,
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
+    DEBUG("Received heartbeat\n");
+}
+
 /**
  * @brief
  * 
- * @param online_users map of usernames to their corresponding IP:PORT address
+ * @param online_users registry of usernames and their corresponding IP:PORT address
  * @param username part of chat protocol packet
  * @param msg part of chat protocol packet
- * @param client_address address of client to send message to
- * @param sock socket for communicting with client
+ * @param client address of client to send message to
+ * @param out queue of datagrams to send to clients
  * @parm exit_loop set to true if event loop is to terminate
 */
 void handle_error(
-    online_users& online_users, std::string username, std::string, 
-    struct sockaddr_in& client_address, uwe::socket& sock, bool& exit_loop) {
+    online_users& online_users, std::string_view username, std::string_view, 
+    client_endpoint& client, chat::outbox& out, bool& exit_loop) {
      DEBUG("Received error\n");
 }
 
 /**
- * @brief function table, mapping command type to handler.
+ * @brief I/O backends the server can run on
 */
-void (*handle_messages[9])(online_users&, std::string, std::string, struct sockaddr_in&, uwe::socket&, bool& exit_loop) = {
-    handle_join, handle_jack, handle_broadcast, handle_directmessage,
-    handle_list, handle_leave, handle_lack, handle_exit, handle_error
+enum io_backend {
+    IO_UWE = 0,
+    IO_MMSG,
+    IO_URING,
 };
 
+/**
+ * @struct server_options
+ * @brief Runtime configuration of the server
+ * @var server_options::backend_
+ *  Member 'backend_' datagram I/O backend to use
+ * @var server_options::batch_size_
+ *  Member 'batch_size_' maximum number of datagrams received per wakeup
+ * @var server_options::workers_
+ *  Member 'workers_' number of worker threads, each with its own SO_REUSEPORT socket
+ * @var server_options::reliable_
+ *  Member 'reliable_' accept reliable delivery envelopes, and use them with clients that send them
+ * @var server_options::coalesce_
+ *  Member 'coalesce_' bundle frames bound for the same client that joined with CAP_COALESCE
+ * @var server_options::coalesce_us_
+ *  Member 'coalesce_us_' longest a frame waits to be bundled with others, in microseconds
+ * @var server_options::queue_limit_
+ *  Member 'queue_limit_' most datagrams queued for one client while the socket is full
+ * @var server_options::disconnect_slow_
+ *  Member 'disconnect_slow_' disconnect clients whose queue is full, rather than drop their datagrams
+ * @var server_options::port_
+ *  Member 'port_' UDP port to bind to, each node of a cluster on one host needs its own
+ */
+struct server_options {
+    io_backend backend_ = IO_UWE;
+    size_t batch_size_ = DEFAULT_BATCH_SIZE;
+    size_t workers_ = 1;
+    bool reliable_ = false;
+    bool coalesce_ = false;
+    uint64_t coalesce_us_ = 0;
+    size_t queue_limit_ = SEND_QUEUE_LIMIT;
+    bool disconnect_slow_ = false;
+    uint16_t port_ = SERVER_PORT;
+};
+
+// How often idle workers check whether another worker has handled EXIT
+#define WORKER_WAKEUP_MS 100
+
+/**
+ * @struct server_state
+ * @brief State shared by all worker threads
+ * @var server_state::mutex_
+ *  Member 'mutex_' held shared by handlers that only read users_, exclusive by those that modify it
+ * @var server_state::users_
+ *  Member 'users_' current online users
+ * @var server_state::exit_
+ *  Member 'exit_' set once any worker has handled EXIT
+ * @var server_state::reliable_
+ *  Member 'reliable_' reliable links to clients and other nodes, null unless enabled
+ */
+struct server_state {
+    std::shared_mutex mutex_;
+    online_users users_;
+    std::atomic<bool> exit_{false};
+    std::unique_ptr<chat::reliable_peers> reliable_;
+};
+
+/**
+ * @brief true if handling a message of type T modifies the online users or
+ *        their groups, so its handler needs the lock exclusively
+*/
+template<chat::chat_type T>
+constexpr bool modifies_users =
+    T == chat::JOIN || T == chat::LEAVE || T == chat::EXIT ||
+    T == chat::MAKEGROUP || T == chat::ADDMEMBER || T == chat::LEAVEGROUP;
+
+/**
+ * @brief Run the handler of a message of type T, under the lock it needs
+ * @param state shared server state
+ * @param client address of the client the message came from
+ * @param now current monotonic time
+ * @param handle called with the online users
+*/
+template<chat::chat_type T, typename Handle>
+inline void handle_locked(server_state& state, const client_endpoint& client, uint64_t now, Handle handle) {
+    if constexpr (modifies_users<T>) {
+        std::unique_lock<std::shared_mutex> lock{state.mutex_};
+        idle.touch(client.address_, now);
+        handle(state.users_);
+    }
+    else {
+        std::shared_lock<std::shared_mutex> lock{state.mutex_};
+        idle.touch(client.address_, now);
+        handle(state.users_);
+    }
+}
+
+/**
+ * @brief Hand a message to the handler for its type
+ *
+ * The switch is generated from CHAT_MESSAGE_TYPES, each case calling
+ * handle_<handler> directly under the lock its type needs.
+ *
+ * @param type of the message, a valid chat_type
+ * @param state shared server state
+ * @param username part of chat protocol packet
+ * @param msg part of chat protocol packet
+ * @param client address of client the message came from
+ * @param out queue of datagrams to send to clients
+ * @param now current monotonic time
+ * @parm exit_loop set to true if event loop is to terminate
+*/
+void dispatch(
+    chat::chat_type type, server_state& state, std::string_view username, std::string_view msg,
+    client_endpoint& client, chat::outbox& out, uint64_t now, bool& exit_loop) {
+    switch (type) {
+#define CHAT_DISPATCH(type, handler, name, username_field, shortest, longest) \
+        case chat::type: \
+            handle_locked<chat::type>(state, client, now, [&](online_users& users) { \
+                handle_##handler(users, username, msg, client, out, exit_loop); \
+            }); \
+            break;
+        CHAT_MESSAGE_TYPES(CHAT_DISPATCH)
+#undef CHAT_DISPATCH
+        default:
+            break;
+    }
+}
+
+/**
+ * @brief Remove a client the server gave up on, as if it had sent LEAVE
+ * @param online_users registry of usernames and their corresponding IP:PORT address
+ * @param address of the client
+ * @param out queue of datagrams to send to clients
+*/
+void disconnect(online_users& online_users, const sockaddr_in& address, chat::outbox& out) {
+    const chat::user_record * user = online_users.find(address);
+    if (user == nullptr) {
+        return;
+    }
+    DEBUG("Disconnecting %.*s\n", static_cast<int>(user->name().length()), user->name().data());
+    client_endpoint client = user->endpoint_;
+    bool exit_loop = false;
+    handle_leave(online_users, "", "", client, out, exit_loop);
+}
+
+/**
+ * @brief Tell local users that a user on another node joined or left
+ * @param online_users registry of usernames, the directory already updated
+ * @param op PRESENCE_ADDED or PRESENCE_REMOVED
+ * @param username user that joined or left
+ * @param out queue of datagrams to send to clients
+*/
+void announce_remote(online_users& online_users, char op, std::string_view username, chat::outbox& out) {
+    char notice[MAX_MESSAGE_LENGTH];
+    snprintf(notice, sizeof(notice), op == PRESENCE_ADDED ? "%.*s has joined the chat." : "%.*s has left the chat.",
+        static_cast<int>(username.length()), username.data());
+    auto brdcst = chat::broadcast_msg("Server", notice);
+    chat::encoded_message encoded{brdcst};
+    online_users.destinations().send(encoded, out);
+    send_presence(online_users, op, username, nullptr, out);
+    send_list_all(online_users, out);
+}
+
+/**
+ * @brief Forget every user on a peer, telling local users they went offline
+ * @param online_users registry of usernames and their corresponding IP:PORT address
+ * @param node index of the peer
+ * @param out queue of datagrams to send to clients
+*/
+void forget_node(online_users& online_users, size_t node, chat::outbox& out) {
+    size_t removed = 0;
+    cluster.clear_node(node, [&](std::string_view username) {
+        // a user here with the same name stays online
+        if (online_users.find(username) == nullptr) {
+            send_presence(online_users, PRESENCE_REMOVED, username, nullptr, out);
+            removed++;
+        }
+    });
+    if (removed > 0) {
+        send_list_all(online_users, out);
+    }
+}
+
+/**
+ * @brief Send a peer a HELLO and the names of every user on this node
+ * @param online_users registry of usernames and their corresponding IP:PORT address
+ * @param node index of the peer
+ * @param out queue of datagrams to send
+*/
+void send_directory(online_users& online_users, size_t node, chat::outbox& out) {
+    send_to_node(node, chat::FEDERATION_HELLO, static_cast<uint32_t>(online_users.size()), "", "", "", out);
+    const sockaddr_in& address = cluster.node(node).address_;
+    chat::pack_snapshot(cluster.epoch(),
+        [&online_users](auto add) {
+            for (const auto& user: online_users) {
+                add(user.name());
+            }
+        },
+        [&out, &address](const char * data, size_t length) {
+            out.send(data, length, address);
+        });
+}
+
+/**
+ * @brief Deliver a broadcast or direct message forwarded by another node
+ * @param online_users registry of usernames and their corresponding IP:PORT address
+ * @param m forwarded message
+ * @param out queue of datagrams to send to clients
+*/
+void deliver_forwarded(online_users& online_users, const chat::federation_message& m, chat::outbox& out) {
+    if (m.kind_ == chat::FEDERATION_BROADCAST) {
+        auto b = chat::broadcast_msg(m.name_, m.text_);
+        chat::encoded_message encoded{b};
+        online_users.destinations().send(encoded, out);
+        cluster.stats().broadcasts_in_++;
+        history.append(m.name_, m.text_);
+        if (chat_log.is_open()) {
+            chat_log.append(chat::BROADCAST, m.name_, "", m.text_);
+        }
+    }
+    else if (auto recipient = online_users.find(m.target_); recipient != nullptr) {
+        // the recipient may have left while the message was on its way
+        send_to(chat::dm_msg(m.name_, m.text_), recipient->endpoint_, out);
+        cluster.stats().dms_in_++;
+        if (chat_log.is_open()) {
+            chat_log.append(chat::DIRECTMESSAGE, m.name_, recipient->name(), m.text_);
+        }
+    }
+}
+
+/**
+ * @brief Handle a datagram from another node
+ *
+ * Forwarded messages from a peer that is up only need the lock shared,
+ * anything that changes the directory needs it exclusively.
+ *
+ * @param state shared server state
+ * @param data received bytes, unwrapped from their reliable envelope
+ * @param length number of bytes
+ * @param from address the datagram came from
+ * @param out queue of datagrams to send
+ * @param now current monotonic time
+ * @return false if it did not come from a peer or is malformed
+*/
+bool handle_federation(
+    server_state& state, const char * data, size_t length, const sockaddr_in& from,
+    chat::outbox& out, uint64_t now) {
+    int node = cluster.find_node(from);
+    chat::federation_message m;
+    if (node < 0 || !chat::parse_federation(data, length, m)) {
+        return false;
+    }
+    cluster.heard(node, now);
+
+    bool forwarded = m.kind_ == chat::FEDERATION_BROADCAST || m.kind_ == chat::FEDERATION_DM;
+    if (forwarded) {
+        // the epoch is checked under the lock too, so the peer cannot be
+        // forgotten or restart between the check and the delivery
+        std::shared_lock<std::shared_mutex> lock{state.mutex_};
+        if (cluster.current(node, m.epoch_)) {
+            deliver_forwarded(state.users_, m, out);
+            return true;
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> lock{state.mutex_};
+    online_users& users = state.users_;
+    chat::federation_node& peer = cluster.node(node);
+    bool introduced = false;
+    if (!cluster.current(node, m.epoch_)) {
+        // only a HELLO or SNAPSHOT says the peer has started or restarted,
+        // anything else from another epoch is left over from an earlier run
+        bool starts = m.kind_ == chat::FEDERATION_HELLO || m.kind_ == chat::FEDERATION_SNAPSHOT;
+        if (!starts || !cluster.starts_run(node, m.epoch_)) {
+            DEBUG("Dropped a message from node %d's stale epoch %u\n", node, m.epoch_);
+            return true;
+        }
+        // whatever it had is gone, and it knows nothing of this node's users
+        DEBUG("Node %d is up with epoch %u\n", node, m.epoch_);
+        forget_node(users, node, out);
+        cluster.up(node, m.epoch_);
+        send_directory(users, node, out);
+        introduced = true;
+    }
+
+    if (m.kind_ == chat::FEDERATION_GOODBYE) {
+        DEBUG("Node %d is shutting down\n", node);
+        forget_node(users, node, out);
+        cluster.down(node, true);
+        return true;
+    }
+
+    switch (m.kind_) {
+        case chat::FEDERATION_HELLO:
+            // two disagreements in a row, as one may just be crossing a JOINED or LEFT
+            if (m.count_ == peer.users_) {
+                peer.mismatches_ = 0;
+            }
+            else if (++peer.mismatches_ >= 2) {
+                cluster.stats().resyncs_++;
+                forget_node(users, node, out);
+                send_to_node(node, chat::FEDERATION_RESYNC, 0, "", "", "", out);
+            }
+            break;
+        case chat::FEDERATION_SNAPSHOT: {
+            size_t added = 0;
+            std::string_view names = m.text_;
+            for (size_t end; (end = names.find('\0')) != std::string_view::npos; names.remove_prefix(end + 1)) {
+                std::string_view username = names.substr(0, std::min<size_t>(end, MAX_USERNAME_LENGTH));
+                if (!username.empty() && cluster.insert(username, node) && users.find(username) == nullptr) {
+                    send_presence(users, PRESENCE_ADDED, username, nullptr, out);
+                    added++;
+                }
+            }
+            if (added > 0) {
+                send_list_all(users, out);
+            }
+            break;
+        }
+        case chat::FEDERATION_JOINED:
+            if (cluster.insert(m.name_, node) && users.find(m.name_) == nullptr) {
+                announce_remote(users, PRESENCE_ADDED, m.name_, out);
+            }
+            break;
+        case chat::FEDERATION_LEFT:
+            if (cluster.erase(m.name_, node) && users.find(m.name_) == nullptr) {
+                announce_remote(users, PRESENCE_REMOVED, m.name_, out);
+            }
+            break;
+        case chat::FEDERATION_RESYNC:
+            if (!introduced) {
+                send_directory(users, node, out);
+            }
+            break;
+        case chat::FEDERATION_BROADCAST:
+        case chat::FEDERATION_DM:
+            deliver_forwarded(users, m, out);
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
+/**
+ * @brief Send every peer a HELLO, and take peers that have gone silent to
+ *        be down, under the exclusive lock
+ * @param state shared server state
+ * @param out queue of datagrams to send
+ * @param now current monotonic time
+*/
+void hello_round(server_state& state, chat::outbox& out, uint64_t now) {
+    for (size_t i = 0; i < cluster.size(); i++) {
+        chat::federation_node& peer = cluster.node(i);
+        // a link is given up on while its node is down, so open it again
+        state.reliable_->connect(peer.address_, now);
+        uint64_t heard = peer.last_heard_ns_.load(std::memory_order_relaxed);
+        if (peer.epoch_ != 0 && now - heard >= FEDERATION_TIMEOUT_MS * 1000000ULL) {
+            DEBUG("Node %zu went silent\n", i);
+            cluster.stats().nodes_lost_++;
+            forget_node(state.users_, i, out);
+            cluster.down(i, false);
+        }
+        send_to_node(i, chat::FEDERATION_HELLO, static_cast<uint32_t>(state.users_.size()), "", "", "", out);
+    }
+}
+
+/**
+ * @brief Send a batch without blocking, queuing per client whatever the socket
+ *        cannot take yet, then empty the outbox
+ * @param sock socket to send on
+ * @param queues clients' queued datagrams
+ * @param out datagrams to send, cleared once sent or queued
+ * @param shard metrics of this worker
+*/
+void send_or_queue(
+    chat::datagram_socket& sock, chat::send_queues& queues, chat::outbox& out, chat::metrics_shard& shard) {
+    // clients with a backlog get theirs in order, behind it
+    queues.divert(out);
+    sock.send(out);
+    for (size_t i: sock.failed()) {
+        shard.send_failed(chat::frame_type(out.data(i), out.length(i)));
+    }
+    queues.defer(out, sock.blocked_from());
+    out.clear();
+}
+
+/**
+ * @brief Send queued datagrams, round robin over clients, until the queues
+ *        are empty or the socket's send buffer is full again
+ * @param sock socket to send on
+ * @param queues clients' queued datagrams
+ * @param out empty outbox to send from, left empty
+ * @param batch_size most datagrams per send
+*/
+void drain_queues(chat::datagram_socket& sock, chat::send_queues& queues, chat::outbox& out, size_t batch_size) {
+    while (!queues.empty()) {
+        queues.fill(out, batch_size);
+        sock.send(out);
+        size_t filled = out.size();
+        size_t sent = sock.blocked_from();
+        queues.sent(sent);
+        out.clear();
+        if (sent < filled) {
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Count, capture, coalesce and wrap what handlers queued, then send it
+ * @param sock socket to send on
+ * @param state shared server state
+ * @param queues clients' queued datagrams
+ * @param out datagrams queued by handlers, cleared once sent or queued
+ * @param shard metrics of this worker
+ * @param coalesce coalescing stage of this worker, null unless enabled
+ * @param captured records of this batch's traffic, written to the capture
+ * @param now current monotonic time
+*/
+void send_batch(
+    chat::datagram_socket& sock, server_state& state, chat::send_queues& queues, chat::outbox& out,
+    chat::metrics_shard& shard, chat::coalescer * coalesce, chat::capture_batch& captured, uint64_t now) {
+    for (size_t i = 0; i < out.size(); i++) {
+        chat::chat_type type = chat::frame_type(out.data(i), out.length(i));
+        shard.sent(type, out.length(i));
+        // acknowledgements for reliable delivery are not chat traffic
+        if (capture.is_open() && type != chat::UNKNOWN) {
+            captured.add(
+                capture.since_start(now), chat::CAPTURE_FROM_SERVER, out.address(i), out.data(i), out.length(i));
+        }
+    }
+    if (capture.is_open()) {
+        capture.write(captured);
+    }
+
+    // frames for clients that unpack bundles wait to be sent together
+    if (coalesce) {
+        std::shared_lock<std::shared_mutex> lock{state.mutex_};
+        coalesce->add(out, now, [&state](const sockaddr_in& address) {
+            const chat::user_record * user = state.users_.find(address);
+            return user != nullptr && (user->endpoint_.capabilities_ & CAP_COALESCE);
+        });
+        if (state.exit_) {
+            coalesce->flush_all(out);
+        }
+    }
+
+    // clients using reliable delivery get their datagrams wrapped, this
+    // is also where retransmits are queued, so it runs on every wakeup
+    if (state.reliable_) {
+        state.reliable_->wrap(out, now);
+    }
+
+    // send everything the batch produced in one go, outside of the lock
+    send_or_queue(sock, queues, out, shard);
+}
+
+/**
+ * @brief Print I/O counters to stdout
+ * @param stats counters to print
+*/
+void print_io_stats(const chat::io_stats& stats) {
+    printf("received %llu datagrams in %llu calls, sent %llu datagrams in %llu calls, "
+           "%llu send failures, %.3f syscalls per message\n",
+        (unsigned long long)stats.datagrams_received_, (unsigned long long)stats.recv_calls_,
+        (unsigned long long)stats.datagrams_sent_, (unsigned long long)stats.send_calls_,
+        (unsigned long long)stats.send_failures_, stats.syscalls_per_message());
+}
+
+/**
+ * @brief Print reliable delivery counters to stdout
+ * @param stats counters to print
+*/
+void print_reliable_stats(const chat::reliable_stats& stats) {
+    printf("reliable delivery: %llu retransmits, %llu duplicates dropped, "
+           "%llu dropped from full backlogs, %llu peers lost\n",
+        (unsigned long long)stats.retransmits_, (unsigned long long)stats.duplicates_,
+        (unsigned long long)stats.backlog_drops_, (unsigned long long)stats.peers_lost_);
+}
+
+/**
+ * @brief Print coalescing counters to stdout
+ * @param stats counters to print
+*/
+void print_coalesce_stats(const chat::coalesce_stats& stats) {
+    printf("coalescing: %llu frames sent in %llu datagrams, %.2f frames per datagram\n",
+        (unsigned long long)stats.frames_, (unsigned long long)stats.datagrams_,
+        stats.datagrams_ == 0 ? 0.0 : static_cast<double>(stats.frames_) / stats.datagrams_);
+}
+
+/**
+ * @brief Print send queue counters to stdout
+ * @param stats counters to print
+*/
+void print_send_queue_stats(const chat::send_queue_stats& stats) {
+    printf("send queues: %llu datagrams deferred, %llu drained, %llu dropped, "
+           "%llu clients disconnected, deepest %llu\n",
+        (unsigned long long)stats.deferred_, (unsigned long long)stats.drained_,
+        (unsigned long long)stats.dropped_, (unsigned long long)stats.evicted_,
+        (unsigned long long)stats.deepest_);
+}
+
+/**
+ * @brief Print the occupancy of a pool to stdout
+ * @param name what the pool holds
+ * @param stats occupancy to print
+*/
+void print_pool_stats(const char * name, const chat::pool_stats& stats) {
+    printf("pool %s: %llu in use, high water %llu, %llu blocks in %llu slabs, %llu KiB\n", name,
+        (unsigned long long)stats.in_use_, (unsigned long long)stats.high_water_,
+        (unsigned long long)stats.capacity_, (unsigned long long)stats.slabs_,
+        (unsigned long long)stats.bytes() / 1024);
+}
+
+/**
+ * @brief Print traffic between nodes to stdout
+ * @param stats counters to print
+*/
+void print_federation_stats(const chat::federation_stats& stats) {
+    printf("federation: %llu broadcasts and %llu direct messages forwarded, "
+           "%llu broadcasts and %llu direct messages received, %llu resyncs, %llu nodes lost\n",
+        (unsigned long long)stats.broadcasts_out_, (unsigned long long)stats.dms_out_,
+        (unsigned long long)stats.broadcasts_in_, (unsigned long long)stats.dms_in_,
+        (unsigned long long)stats.resyncs_, (unsigned long long)stats.nodes_lost_);
+}
+
+/**
+ * @brief Create a socket on a batching backend, mmsg or io_uring
+ * @param backend IO_MMSG or IO_URING
+ * @param address to bind to
+ * @param batch_size maximum datagrams per wakeup
+ * @param reuse_port set SO_REUSEPORT, for one socket per worker
+ * @param recv_timeout_ms if not 0, recv returns no datagrams after this long
+*/
+std::unique_ptr<chat::datagram_socket> make_batching_socket(
+    io_backend backend, const sockaddr_in& address, size_t batch_size, bool reuse_port, int recv_timeout_ms) {
+    if (backend == IO_URING) {
+        return std::make_unique<chat::uring_datagram_socket>(address, batch_size, reuse_port, recv_timeout_ms);
+    }
+    return std::make_unique<chat::mmsg_datagram_socket>(address, batch_size, reuse_port, recv_timeout_ms);
+}
+
+/**
+ * @brief event loop run by each worker, until any worker handles EXIT
+ * 
+ * @param sock worker's own socket
+ * @param state shared between all workers
+ * @param batch_size maximum number of datagrams received per wakeup
+ * @param shard this worker's own metrics
+ * @param coalesce this worker's coalescing stage, null if disabled
+ * @param queues this worker's datagrams waiting for the socket, per client
+*/
+void worker(
+    chat::datagram_socket& sock, server_state& state, size_t batch_size, chat::metrics_shard& shard,
+    chat::coalescer * coalesce, chat::send_queues& queues) {
+	// datagrams received per wakeup and datagrams queued by handlers
+	chat::inbox in{batch_size};
+	chat::outbox out;
+
+	// socket address and wire format used to store client address
+	client_endpoint client;
+
+	chat::message_view message;
+
+	// records of this batch's traffic, written to the capture together
+	chat::capture_batch captured;
+    DEBUG("Entering server loop\n");
+	for (;!state.exit_;) {
+        // wake in time to send bundles that are due, even if nothing arrives,
+        // and as soon as clients with a backlog can be sent to again
+        size_t count = 0;
+        uint64_t due = coalesce ? coalesce->due() : 0;
+        if (due == 0 && queues.empty()) {
+            count = sock.recv(in);
+        }
+        else {
+            uint64_t now = chat::monotonic_ns();
+            uint64_t timeout = due == 0 ? WORKER_WAKEUP_MS * 1000000ULL : (due > now ? due - now : 0);
+            bool writable = false;
+            if (sock.wait(timeout, queues.empty() ? nullptr : &writable)) {
+                count = sock.recv(in);
+            }
+            if (writable) {
+                drain_queues(sock, queues, out, batch_size);
+            }
+        }
+        uint64_t now = chat::monotonic_ns();
+
+        for (size_t i = 0; i < count && !state.exit_; i++) {
+            client.address_ = in.address(i);
+            client.capabilities_ = 0;
+
+            const char * data = in.data(i);
+            size_t length = in.length(i);
+            if (state.reliable_) {
+                // unwrap, acknowledge and drop duplicates of enveloped packets
+                auto result = state.reliable_->receive(data, length, client.address_, now, out, data, length);
+                if (result == chat::reliable_peers::CONSUMED) {
+                    continue;
+                }
+                if (result == chat::reliable_peers::MALFORMED) {
+                    shard.malformed(chat::UNKNOWN);
+                    continue;
+                }
+            }
+
+            // traffic between nodes is not client traffic, so it is not captured
+            if (chat::is_federation(data, length)) {
+                if (!handle_federation(state, data, length, client.address_, out, now)) {
+                    shard.malformed(chat::UNKNOWN);
+                }
+                continue;
+            }
+
+            if (capture.is_open()) {
+                captured.add(capture.since_start(now), chat::CAPTURE_TO_SERVER, client.address_, data, length);
+            }
+      
+            // DEBUG("Received message:\n");
+            // decode accepts both legacy packets and compact frames, the
+            // username and message refer into the inbox, nothing is copied
+            if (chat::decode(data, length, message, &client.format_)) {
+                // handle incoming packet
+                auto type = message.type_;
+                auto username = message.username_;
+                auto msg = message.message_;
+
+                DEBUG("handling msg type %d\n", type);
+                shard.received(type, length);
+                size_t queued = out.size();
+                auto start = std::chrono::steady_clock::now();
+
+                bool exit_loop = false;
+                // valid type, so dispatch message handler
+                dispatch(type, state, username, msg, client, out, now, exit_loop);
+                if (exit_loop) {
+                    state.exit_ = true;
+                }
+
+                // time includes waiting for the lock
+                auto elapsed = std::chrono::steady_clock::now() - start;
+                shard.handled(
+                    type, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+                    out.size() - queued);
+            }
+            else {
+                DEBUG("Unexpected packet length\n");
+                shard.malformed(chat::frame_type(data, length));
+            }
+        }
+
+        // clients silent for --idle-timeout leave, as if they had sent LEAVE
+        if (idle.due(now)) {
+            std::unique_lock<std::shared_mutex> lock{state.mutex_};
+            idle.expire(now, [&state, &out](const sockaddr_in& address) {
+                disconnect(state.users_, address, out);
+            });
+        }
+
+        // tell the other nodes this one is up, and notice those that are not
+        if (cluster.claim_hello(now)) {
+            std::unique_lock<std::shared_mutex> lock{state.mutex_};
+            hello_round(state, out, now);
+        }
+
+        // clients whose queue overflowed under --disconnect-slow leave, as if
+        // they had sent LEAVE, and the notices of that go out like any other
+        // handler's datagrams
+        for (;;) {
+            send_batch(sock, state, queues, out, shard, coalesce, captured, now);
+            auto evicted = queues.take_evicted();
+            if (evicted.empty()) {
+                break;
+            }
+            std::unique_lock<std::shared_mutex> lock{state.mutex_};
+            for (const auto& address: evicted) {
+                disconnect(state.users_, address, out);
+            }
+        }
+    }
+}
+
 /**
  * @brief server for chat protocol
+ * 
+ * @param options runtime configuration
 */
-void server() {
+void server(const server_options& options) {
     // keep track of online users
-    online_users online_users;
-
-    // port to start the server on
+    server_state state;
 
 	// socket address used for the server
 	struct sockaddr_in server_address;
@@ -479,57 +1655,282 @@ void server() {
 
 	// htons: host to network short: transforms a value in host byte
 	// ordering format to a short value in network byte ordering format
-	server_address.sin_port = htons(SERVER_PORT);
+	server_address.sin_port = htons(options.port_);
 
 	// htons: host to network long: same as htons but to long
 	// server_address.sin_addr.s_addr = htonl(INADDR_ANY);
 	// creates binary representation of server name and stores it as sin_addr
 	inet_pton(AF_INET, uwe::get_ipaddr().c_str(), &server_address.sin_addr);
 
-    // create a UDP socket
-	uwe::socket sock{AF_INET, SOCK_DGRAM, 0};
-
-	sock.bind((struct sockaddr *)&server_address, sizeof(server_address));
-
-	// socket address used to store client address
-	struct sockaddr_in client_address;
-	size_t client_address_len = 0;
-
-	char buffer[sizeof(chat::chat_message)];
-    DEBUG("Entering server loop\n");
-    bool exit_loop = false;
-	for (;!exit_loop;) {
-        int len = sock.recvfrom(
-			buffer, sizeof(buffer), 0, (struct sockaddr *)&client_address, &client_address_len);
-
-      
-        // DEBUG("Received message:\n");
-        if (len == sizeof(chat::chat_message)) {
-            // handle incoming packet
-            chat::chat_message * message = reinterpret_cast<chat::chat_message*>(buffer);
-            auto type = static_cast<chat::chat_type>(message->type_);
-            std::string username{(const char*)&message->username_[0]};
-            std::string msg{(const char*)&message->message_[0]};
-
-            if (is_valid_type(type)) {
-                DEBUG("handling msg type %d\n", type);
-                // valid type, so dispatch message handler
-                handle_messages[type](online_users, username, msg, client_address, sock, exit_loop);
-            }
+    chat::io_stats stats;
+    metrics.resize(options.workers_ <= 1 ? 1 : options.workers_);
+    // one coalescing stage per worker, each only sees its own clients' frames
+    std::vector<std::unique_ptr<chat::coalescer>> coalescers;
+    if (options.coalesce_) {
+        for (size_t i = 0; i < metrics.size(); i++) {
+            coalescers.push_back(std::make_unique<chat::coalescer>(options.coalesce_us_ * 1000));
+        }
+    }
+    // one set of send queues per worker, for the datagrams its socket refuses
+    std::vector<std::unique_ptr<chat::send_queues>> queues;
+    for (size_t i = 0; i < metrics.size(); i++) {
+        queues.push_back(std::make_unique<chat::send_queues>(options.queue_limit_,
+            options.disconnect_slow_ ? chat::send_queues::DISCONNECT : chat::send_queues::DROP));
+    }
+    if (options.reliable_) {
+        state.reliable_ = std::make_unique<chat::reliable_peers>();
+    }
+    // retransmit timers need workers to wake up even when nothing arrives
+    int wakeup_ms = options.reliable_ ? RELIABLE_TICK_MS : WORKER_WAKEUP_MS;
+
+    if (options.workers_ <= 1) {
+        // create a UDP socket on the selected backend
+        std::unique_ptr<chat::datagram_socket> sock;
+        if (options.backend_ != IO_UWE) {
+            sock = make_batching_socket(options.backend_,
+                server_address, options.batch_size_, false, options.reliable_ || idle.enabled() ? wakeup_ms : 0);
         }
         else {
-            DEBUG("Unexpected packet length\n");
+            sock = std::make_unique<chat::uwe_datagram_socket>(server_address);
+        }
+        worker(*sock, state, options.batch_size_, metrics.shard(0),
+            coalescers.empty() ? nullptr : coalescers[0].get(), *queues[0]);
+        stats += sock->stats();
+    }
+    else {
+        // one SO_REUSEPORT socket per worker, all bound to the server port.
+        // They time out periodically so idle workers notice EXIT.
+        std::vector<std::unique_ptr<chat::datagram_socket>> socks;
+        for (size_t i = 0; i < options.workers_; i++) {
+            socks.push_back(make_batching_socket(options.backend_,
+                server_address, options.batch_size_, true, wakeup_ms));
+        }
+
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < socks.size(); i++) {
+            workers.emplace_back(
+                worker, std::ref(*socks[i]), std::ref(state), options.batch_size_, std::ref(metrics.shard(i)),
+                coalescers.empty() ? nullptr : coalescers[i].get(), std::ref(*queues[i]));
+        }
+        for (auto& w: workers) {
+            w.join();
+        }
+        for (auto& sock: socks) {
+            stats += sock->stats();
         }
     }
+
+    print_io_stats(stats);
+    if (state.reliable_) {
+        print_reliable_stats(state.reliable_->stats());
+        print_pool_stats("reliable peers", state.reliable_->peer_stats());
+        print_pool_stats("unacknowledged packets", state.reliable_->packet_stats());
+    }
+    if (cluster.enabled()) {
+        print_federation_stats(cluster.stats());
+    }
+    if (!coalescers.empty()) {
+        chat::coalesce_stats coalesced;
+        for (const auto& c: coalescers) {
+            coalesced += c->stats();
+        }
+        print_coalesce_stats(coalesced);
+    }
+    chat::send_queue_stats queued;
+    chat::pool_stats queued_packets;
+    for (const auto& q: queues) {
+        queued += q->stats();
+        queued_packets += q->packet_stats();
+    }
+    if (queued.deferred_ > 0 || queued.dropped_ > 0) {
+        print_send_queue_stats(queued);
+        print_pool_stats("queued packets", queued_packets);
+    }
+    if (idle.enabled()) {
+        printf("idle timeout: %llu clients evicted\n", (unsigned long long)idle.evictions());
+    }
+    if (capture.is_open()) {
+        printf("capture: %llu KiB of records%s\n", (unsigned long long)capture.bytes() / 1024,
+            capture.failed() ? ", incomplete after a failed write" : "");
+        capture.close();
+    }
 }
 
+// chat_alloctest builds the server into itself, with a main of its own
+#ifndef CHAT_SERVER_NO_MAIN
 /**
  * @brief entry point for chat server application
 */
-int main(void) { 
+int main(int argc, char ** argv) { 
+    server_options options;
+    // address to bind to, loopback is useful for benchmarking with chat_loadgen
+    const char * address = "192.168.1.7";
+    // directory of the message log, none unless --log is given
+    const char * log_dir = nullptr;
+    // file to record traffic to, none unless --record is given
+    const char * record_path = nullptr;
+
+    static struct option long_options[] = {
+        {"io",    required_argument, nullptr, 'i'},
+        {"batch", required_argument, nullptr, 'b'},
+        {"workers", required_argument, nullptr, 'w'},
+        {"addr",  required_argument, nullptr, 'a'},
+        {"reliable", no_argument,    nullptr, 'r'},
+        {"coalesce", required_argument, nullptr, 'c'},
+        {"history", required_argument, nullptr, 'h'},
+        {"log",   required_argument, nullptr, 'l'},
+        {"queue-limit", required_argument, nullptr, 'q'},
+        {"disconnect-slow", no_argument, nullptr, 'd'},
+        {"idle-timeout", required_argument, nullptr, 't'},
+        {"record", required_argument, nullptr, 'R'},
+        {"port",  required_argument, nullptr, 'P'},
+        {"peer",  required_argument, nullptr, 'p'},
+        {nullptr, 0,                 nullptr, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "i:b:w:a:rc:h:l:q:dt:R:P:p:", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 'i':
+                if (strcmp(optarg, "uwe") == 0) {
+                    options.backend_ = IO_UWE;
+                }
+                else if (strcmp(optarg, "mmsg") == 0) {
+                    options.backend_ = IO_MMSG;
+                }
+                else if (strcmp(optarg, "uring") == 0) {
+                    options.backend_ = IO_URING;
+                }
+                else {
+                    printf("Unknown I/O backend: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                options.batch_size_ = strtoul(optarg, nullptr, 10);
+                if (options.batch_size_ == 0) {
+                    options.batch_size_ = 1;
+                }
+                break;
+            case 'w':
+                options.workers_ = strtoul(optarg, nullptr, 10);
+                if (options.workers_ == 0) {
+                    options.workers_ = 1;
+                }
+                break;
+            case 'a':
+                address = optarg;
+                break;
+            case 'r':
+                options.reliable_ = true;
+                break;
+            case 'c':
+                options.coalesce_ = true;
+                options.coalesce_us_ = strtoull(optarg, nullptr, 10);
+                break;
+            case 'h':
+                history.resize(strtoul(optarg, nullptr, 10));
+                break;
+            case 'l':
+                log_dir = optarg;
+                break;
+            case 'q':
+                options.queue_limit_ = strtoul(optarg, nullptr, 10);
+                if (options.queue_limit_ == 0) {
+                    options.queue_limit_ = 1;
+                }
+                break;
+            case 'd':
+                options.disconnect_slow_ = true;
+                break;
+            case 't':
+                idle.set_timeout(strtoull(optarg, nullptr, 10) * 1000000000ULL);
+                break;
+            case 'R':
+                record_path = optarg;
+                break;
+            case 'P':
+                options.port_ = static_cast<uint16_t>(strtoul(optarg, nullptr, 10));
+                break;
+            case 'p': {
+                // <ip>:<port> of another node, once per node
+                sockaddr_in peer{};
+                peer.sin_family = AF_INET;
+                std::string_view arg{optarg};
+                size_t colon = arg.rfind(':');
+                unsigned long port = colon == std::string_view::npos ? 0 : strtoul(optarg + colon + 1, nullptr, 10);
+                if (port == 0 || port > 65535 ||
+                    inet_pton(AF_INET, std::string{arg.substr(0, colon)}.c_str(), &peer.sin_addr) != 1) {
+                    printf("Invalid peer, expected <ip>:<port>: %s\n", optarg);
+                    exit(1);
+                }
+                peer.sin_port = htons(static_cast<uint16_t>(port));
+                cluster.add_peer(peer);
+                break;
+            }
+            default:
+                printf("USAGE: %s [--io uwe|mmsg|uring] [--batch <datagrams per wakeup>] [--workers <threads>] [--addr <ip>] [--reliable] [--coalesce <us>] [--history <messages>] [--log <dir>] [--queue-limit <datagrams>] [--disconnect-slow] [--idle-timeout <seconds>] [--record <capture file>] [--port <port>] [--peer <ip>:<port>]...\n", argv[0]);
+                exit(0);
+        }
+    }
+
+    if (options.workers_ > 1 && options.backend_ == IO_UWE) {
+        // the IoT socket api cannot share a port between sockets
+        printf("--workers %zu uses the mmsg I/O backend\n", options.workers_);
+        options.backend_ = IO_MMSG;
+    }
+
+    if (cluster.enabled() && !options.reliable_) {
+        // links between nodes use reliable delivery envelopes
+        printf("--peer uses reliable delivery between nodes\n");
+        options.reliable_ = true;
+    }
+
+    if (options.reliable_ && options.backend_ == IO_UWE) {
+        // retransmit timers need a receive timeout, which the IoT socket api lacks
+        printf("--reliable uses the mmsg I/O backend\n");
+        options.backend_ = IO_MMSG;
+    }
+
+    if (options.coalesce_ && options.backend_ == IO_UWE) {
+        // bundle deadlines need a receive that can time out, which the IoT socket api lacks
+        printf("--coalesce uses the mmsg I/O backend\n");
+        options.backend_ = IO_MMSG;
+    }
+
+    if (idle.enabled() && options.backend_ == IO_UWE) {
+        // expiring timers needs a receive that can time out, which the IoT socket api lacks
+        printf("--idle-timeout uses the mmsg I/O backend\n");
+        options.backend_ = IO_MMSG;
+    }
+
+    if (cluster.enabled()) {
+        printf("node on port %u in a cluster of %zu nodes, epoch %u\n",
+            (unsigned)options.port_, cluster.size() + 1, cluster.epoch());
+    }
+
+    if (history.capacity() > 0) {
+        printf("keeping the last %zu broadcasts, %zu KiB\n", history.capacity(), history.memory() / 1024);
+    }
+
+    if (log_dir != nullptr) {
+        auto start = std::chrono::steady_clock::now();
+        chat_log.open(log_dir);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        printf("logging messages to %s, %zu segments, next sequence %llu, opened in %lld us\n",
+            log_dir, chat_log.segments(), (unsigned long long)chat_log.next_seq(),
+            (long long)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    }
+
+    if (record_path != nullptr) {
+        capture.open(record_path, chat::monotonic_ns());
+        printf("recording traffic to %s\n", record_path);
+    }
+
     // Set server IP address
-    uwe::set_ipaddr("192.168.1.7");
-    server();
+    uwe::set_ipaddr(address);
+    server(options);
 
     return 0;
-}
\ No newline at end of file
+}
+#endif // CHAT_SERVER_NO_MAIN
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <cstring>
+#include <vector>
+
+#include <chat_ex2.hpp>
+#include <pool.hpp>
+#include <server_io.hpp>
+
+namespace chat {
+
+/**
+ * @struct coalesce_stats
+ * @brief Counters for the coalescing stage
+ * @var coalesce_stats::frames_
+ *  Member 'frames_' frames taken from the outbox to be coalesced
+ * @var coalesce_stats::datagrams_
+ *  Member 'datagrams_' datagrams those frames went out in, bundles and lone frames
+ */
+struct coalesce_stats {
+    uint64_t frames_ = 0;
+    uint64_t datagrams_ = 0;
+
+    coalesce_stats& operator+=(const coalesce_stats& other) {
+        frames_ += other.frames_;
+        datagrams_ += other.datagrams_;
+        return *this;
+    }
+};
+
+/**
+ * @brief Packs the compact frames a worker queues for the same client into
+ *        bundles, each sent as one datagram
+ *
+ * Frames for clients that joined with CAP_COALESCE are taken out of the
+ * outbox and appended to a bundle per destination. A bundle is sent when the
+ * next frame would take it past the byte budget, when its oldest frame has
+ * waited deadline_ns, or ahead of a frame that should not wait (JACK, LACK,
+ * EXIT and ERROR), which is then sent on its own so frames reach a client in
+ * the order they were queued. A bundle holding a single frame is sent as that
+ * bare frame. Emptied bundles are reused and the index's nodes come from a
+ * slab_pool, so once warmed up coalescing does not allocate.
+*/
+class coalescer {
+public:
+    /**
+     * @param deadline_ns longest a frame waits for others to join it, 0 to
+     *        only coalesce frames queued by the same batch
+     * @param budget largest bundle, at most MAX_BUNDLE_LENGTH bytes
+    */
+    explicit coalescer(uint64_t deadline_ns, size_t budget = MAX_BUNDLE_LENGTH) :
+        deadline_ns_{deadline_ns},
+        budget_{budget < MAX_BUNDLE_LENGTH ? budget : MAX_BUNDLE_LENGTH},
+        index_{0, index_map::allocator_type{nodes_}} {
+    }
+
+    const coalesce_stats& stats() const { return stats_; }
+
+    /**
+     * @brief time the oldest waiting bundle is due, 0 if none is waiting
+    */
+    uint64_t due() const {
+        uint64_t due = 0;
+        for (const auto& b: pending_) {
+            if (due == 0 || b.first_ns_ + deadline_ns_ < due) {
+                due = b.first_ns_ + deadline_ns_;
+            }
+        }
+        return due;
+    }
+
+    /**
+     * @brief take frames for coalescing destinations out of the outbox, then
+     *        queue every bundle that is due
+     * @param out datagrams queued by handlers, which must not have headers yet
+     * @param now current monotonic time
+     * @param coalesces called with a destination address, true if it joined with CAP_COALESCE
+    */
+    template<typename Coalesces>
+    void add(outbox& out, uint64_t now, Coalesces coalesces) {
+        taken_.clear();
+        size_t queued = out.size();
+        for (size_t i = 0; i < queued; i++) {
+            size_t length = out.length(i);
+            if (length == 0 || static_cast<uint8_t>(out.data(i)[0]) != WIRE_MAGIC ||
+                !coalesces(out.address(i))) {
+                continue;
+            }
+            taken_.push_back(i);
+            stats_.frames_++;
+
+            // copy out first, queuing may move the outbox's buffer
+            char frame[MAX_FRAME_LENGTH];
+            memcpy(frame, out.data(i), length);
+            const sockaddr_in address = out.address(i);
+            bundle& b = find(address, now);
+
+            if (urgent(frame_type(frame, length))) {
+                flush(b, out);
+                out.send(frame, length, address);
+                stats_.datagrams_++;
+                continue;
+            }
+            if (b.length_ + BUNDLE_LENGTH_PREFIX + length > budget_) {
+                flush(b, out);
+            }
+            if (b.count_ == 0) {
+                b.first_ns_ = now;
+            }
+            b.buffer_[b.length_] = static_cast<char>((length >> 8) & 0xFF);
+            b.buffer_[b.length_ + 1] = static_cast<char>(length & 0xFF);
+            memcpy(&b.buffer_[b.length_ + BUNDLE_LENGTH_PREFIX], frame, length);
+            b.length_ += BUNDLE_LENGTH_PREFIX + length;
+            b.count_++;
+            if (b.count_ == 0xFF) {
+                flush(b, out);
+            }
+        }
+        out.erase(taken_);
+        flush_due(out, now);
+    }
+
+    /**
+     * @brief queue every bundle that is due, waiting bundles that are not stay
+    */
+    void flush_due(outbox& out, uint64_t now) {
+        for (size_t i = 0; i < pending_.size();) {
+            bundle& b = pending_[i];
+            if (b.count_ > 0 && now - b.first_ns_ < deadline_ns_) {
+                i++;
+                continue;
+            }
+            flush(b, out);
+            // drop the emptied bundle, moving the last one into its place
+            index_.erase(address_key(b.address_));
+            if (i != pending_.size() - 1) {
+                b = pending_.back();
+                index_[address_key(b.address_)] = i;
+            }
+            pending_.pop_back();
+        }
+    }
+
+    /**
+     * @brief queue every waiting bundle, whether due or not
+    */
+    void flush_all(outbox& out) {
+        for (auto& b: pending_) {
+            flush(b, out);
+        }
+        pending_.clear();
+        index_.clear();
+    }
+
+private:
+    struct bundle {
+        sockaddr_in address_;
+        uint64_t first_ns_;
+        size_t length_;
+        size_t count_;
+        char buffer_[MAX_BUNDLE_LENGTH];
+    };
+
+    static bool urgent(chat_type type) {
+        return type == JACK || type == LACK || type == EXIT || type == ERROR;
+    }
+
+    /**
+     * @brief bundle for address, started empty if there is none
+    */
+    bundle& find(const sockaddr_in& address, uint64_t now) {
+        auto it = index_.find(address_key(address));
+        if (it != index_.end()) {
+            return pending_[it->second];
+        }
+        index_.emplace(address_key(address), pending_.size());
+        pending_.emplace_back();
+        bundle& b = pending_.back();
+        b.address_ = address;
+        b.first_ns_ = now;
+        b.length_ = BUNDLE_HEADER_LENGTH;
+        b.count_ = 0;
+        return b;
+    }
+
+    /**
+     * @brief queue a bundle's frames, if any, and empty it
+    */
+    void flush(bundle& b, outbox& out) {
+        if (b.count_ == 1) {
+            out.send(&b.buffer_[BUNDLE_HEADER_LENGTH + BUNDLE_LENGTH_PREFIX],
+                b.length_ - BUNDLE_HEADER_LENGTH - BUNDLE_LENGTH_PREFIX, b.address_);
+            stats_.datagrams_++;
+        }
+        else if (b.count_ > 1) {
+            b.buffer_[0] = static_cast<char>(BUNDLE_MAGIC);
+            b.buffer_[1] = static_cast<char>(b.count_);
+            out.send(&b.buffer_[0], b.length_, b.address_);
+            stats_.datagrams_++;
+        }
+        b.length_ = BUNDLE_HEADER_LENGTH;
+        b.count_ = 0;
+    }
+
+    uint64_t deadline_ns_;
+    size_t budget_;
+    typedef address_map<size_t> index_map;
+
+    // bundles with frames waiting, kept in the vector's capacity once emptied
+    std::vector<bundle> pending_;
+    slab_pool nodes_;
+    index_map index_;
+    std::vector<size_t> taken_;
+    coalesce_stats stats_;
+};
+
+}; // namespace chat
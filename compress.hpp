@@ -0,0 +1,258 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cstring>
+
+// Longest input lz_compress accepts
+#define LZ_MAX_INPUT 4096
+
+// Bits of the match finder's hash table
+#define LZ_HASH_BITS 10
+
+// Shortest match worth encoding
+#define LZ_MIN_MATCH 4
+
+namespace chat {
+
+//---------------------------------------------------------------------------------------
+// LZ77 block codec
+//
+// A block is a run of sequences, each some literal bytes followed by a copy
+// of earlier output, in the layout of an LZ4 block:
+//
+//   +--------------------+------------------+----------+------------------+------------------+
+//   | token              | literal length   | literals | offset           | match length     |
+//   | literals:4 match:4 | 255,...,n if 15  |          | (u16, LE, >= 1)  | 255,...,n if 15  |
+//   +--------------------+------------------+----------+------------------+------------------+
+//
+// The match nibble holds the match length minus LZ_MIN_MATCH. The last
+// sequence ends after its literals. Both ends prefix the output with the
+// same dictionary of common chat text, which offsets may reach back into,
+// so even short messages find matches.
+//---------------------------------------------------------------------------------------
+
+/**
+ * @brief text both ends treat as coming before every block
+ *
+ * Words and phrases common in chat, the most common last. Changing it
+ * changes the compressed format.
+*/
+inline constexpr char lz_dictionary[] =
+    "http://https://www..com/.org/.html?id=@gmail.com "
+    "Thanks! Thank you so much. Sorry, I don't know. I'm not sure. "
+    "tomorrow morning afternoon tonight yesterday weekend meeting "
+    "anyone everyone something nothing really actually probably "
+    "because though would could should about there their they're "
+    "when what where which with this that have from your you're "
+    "lol haha :) :( ok okay yes yeah no not just like going "
+    "Hello everyone! Hi all, how are you doing? Good morning, "
+    "What do you think? Let me know if you have any questions. "
+    " the and for you are was but can will all one out get "
+    " is in it of to a I ";
+
+inline constexpr size_t lz_dictionary_length = sizeof(lz_dictionary) - 1;
+
+namespace lz_detail {
+
+inline uint32_t read32(const char * p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * @brief match finder table with the dictionary already hashed in
+*/
+struct dictionary_table {
+    uint16_t positions_[1 << LZ_HASH_BITS];
+
+    dictionary_table() {
+        for (auto& p: positions_) {
+            p = 0xFFFF;
+        }
+        for (size_t i = 0; i + LZ_MIN_MATCH <= lz_dictionary_length; i++) {
+            positions_[hash(read32(lz_dictionary + i))] = static_cast<uint16_t>(i);
+        }
+    }
+};
+
+/**
+ * @brief write a literal or match length beyond what fits in its nibble
+*/
+inline bool put_length(char *& out, const char * end, size_t n) {
+    while (n >= 255) {
+        if (out == end) {
+            return false;
+        }
+        *out++ = static_cast<char>(255);
+        n -= 255;
+    }
+    if (out == end) {
+        return false;
+    }
+    *out++ = static_cast<char>(n);
+    return true;
+}
+
+inline bool get_length(const char *& in, const char * end, size_t& n) {
+    uint8_t b;
+    do {
+        if (in == end) {
+            return false;
+        }
+        b = static_cast<uint8_t>(*in++);
+        n += b;
+    } while (b == 255);
+    return true;
+}
+
+/**
+ * @brief write a sequence, or the last literals if match_length is 0
+*/
+inline bool put_sequence(
+    char *& out, const char * end, const char * literals, size_t literal_length,
+    size_t offset, size_t match_length) {
+    if (out == end) {
+        return false;
+    }
+    size_t match = match_length == 0 ? 0 : match_length - LZ_MIN_MATCH;
+    *out++ = static_cast<char>(((literal_length < 15 ? literal_length : 15) << 4) | (match < 15 ? match : 15));
+    if (literal_length >= 15 && !put_length(out, end, literal_length - 15)) {
+        return false;
+    }
+    if (static_cast<size_t>(end - out) < literal_length) {
+        return false;
+    }
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+    if (match_length == 0) {
+        return true;
+    }
+    if (end - out < 2) {
+        return false;
+    }
+    *out++ = static_cast<char>(offset & 0xFF);
+    *out++ = static_cast<char>(offset >> 8);
+    return match < 15 || put_length(out, end, match - 15);
+}
+
+}; // namespace lz_detail
+
+/**
+ * @brief Compress a block
+ *
+ * Greedy single pass: each position is looked up in a hash table of the last
+ * position seen with the same 4 bytes, so compressing costs O(length).
+ *
+ * @param src bytes to compress, at most LZ_MAX_INPUT
+ * @param length number of bytes
+ * @param dst buffer to write into
+ * @param capacity size of dst, compression gives up once it would not fit
+ * @return number of bytes written, or 0 if the block did not fit in capacity
+*/
+inline size_t lz_compress(const char * src, size_t length, char * dst, size_t capacity) {
+    using namespace lz_detail;
+    static const dictionary_table dictionary_positions;
+    if (length == 0 || length > LZ_MAX_INPUT) {
+        return 0;
+    }
+
+    // the dictionary followed by the input, so matches can reach back into it
+    char window[lz_dictionary_length + LZ_MAX_INPUT];
+    memcpy(window, lz_dictionary, lz_dictionary_length);
+    memcpy(window + lz_dictionary_length, src, length);
+    uint16_t positions[1 << LZ_HASH_BITS];
+    memcpy(positions, dictionary_positions.positions_, sizeof(positions));
+
+    char * out = dst;
+    const char * out_end = dst + capacity;
+    size_t begin = lz_dictionary_length;
+    size_t end = begin + length;
+    size_t anchor = begin;
+    size_t i = begin;
+    while (i + LZ_MIN_MATCH <= end) {
+        uint32_t v = read32(window + i);
+        uint32_t h = hash(v);
+        size_t candidate = positions[h];
+        positions[h] = static_cast<uint16_t>(i);
+        if (candidate == 0xFFFF || read32(window + candidate) != v) {
+            i++;
+            continue;
+        }
+        size_t match_length = LZ_MIN_MATCH;
+        while (i + match_length < end && window[candidate + match_length] == window[i + match_length]) {
+            match_length++;
+        }
+        if (!put_sequence(out, out_end, window + anchor, i - anchor, i - candidate, match_length)) {
+            return 0;
+        }
+        i += match_length;
+        anchor = i;
+    }
+    if (!put_sequence(out, out_end, window + anchor, end - anchor, 0, 0)) {
+        return 0;
+    }
+    return static_cast<size_t>(out - dst);
+}
+
+/**
+ * @brief Decompress a block, checking every length and offset against the
+ *        input, the output and the dictionary
+ * @param src compressed bytes
+ * @param length number of compressed bytes
+ * @param dst buffer to write into
+ * @param capacity size of dst
+ * @param written set to the number of bytes written
+ * @return true if the block was well formed and fit in capacity, otherwise false
+*/
+inline bool lz_decompress(const char * src, size_t length, char * dst, size_t capacity, size_t& written) {
+    using namespace lz_detail;
+    const char * in = src;
+    const char * in_end = src + length;
+    size_t n = 0;
+    while (in != in_end) {
+        uint8_t token = static_cast<uint8_t>(*in++);
+
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && !get_length(in, in_end, literal_length)) {
+            return false;
+        }
+        if (static_cast<size_t>(in_end - in) < literal_length || capacity - n < literal_length) {
+            return false;
+        }
+        memcpy(dst + n, in, literal_length);
+        in += literal_length;
+        n += literal_length;
+        if (in == in_end) {
+            break;
+        }
+
+        if (in_end - in < 2) {
+            return false;
+        }
+        size_t offset = static_cast<uint8_t>(in[0]) | (static_cast<uint8_t>(in[1]) << 8);
+        in += 2;
+        size_t match_length = token & 0x0F;
+        if (match_length == 15 && !get_length(in, in_end, match_length)) {
+            return false;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > n + lz_dictionary_length || capacity - n < match_length) {
+            return false;
+        }
+        // byte by byte, as a match may overlap its own output
+        for (size_t k = 0; k < match_length; k++, n++) {
+            dst[n] = offset > n ? lz_dictionary[lz_dictionary_length - (offset - n)] : dst[n - offset];
+        }
+    }
+    written = n;
+    return true;
+}
+
+}; // namespace chat
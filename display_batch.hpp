@@ -0,0 +1,173 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+
+// GUI api
+#include <gui.hpp>
+
+// Most frames sent to the GUI per second
+#define DISPLAY_FPS 30
+
+// Most console lines shown per frame, the rest wait for later frames
+#define DISPLAY_LINES_PER_FRAME 32
+
+// Console lines waiting to be shown, the oldest are dropped beyond this
+#define DISPLAY_SCROLLBACK 256
+
+namespace chat {
+
+/**
+ * @struct display_stats
+ * @brief Counters for the display batcher
+ * @var display_stats::frames_
+ *  Member 'frames_' frames sent to the GUI
+ * @var display_stats::lines_
+ *  Member 'lines_' console lines shown
+ * @var display_stats::dropped_
+ *  Member 'dropped_' console lines dropped because the GUI could not keep up
+ * @var display_stats::user_updates_
+ *  Member 'user_updates_' user list changes sent, after cancelling out
+ */
+struct display_stats {
+    uint64_t frames_ = 0;
+    uint64_t lines_ = 0;
+    uint64_t dropped_ = 0;
+    uint64_t user_updates_ = 0;
+};
+
+/**
+ * @brief Collects display commands for the GUI and hands them over as
+ *        frames, at most DISPLAY_FPS per second
+ *
+ * Commands are queued with the same send a GUI channel has, so code that
+ * updates the display does not care which it is given. A frame is one
+ * GUI_CONSOLE command with up to DISPLAY_LINES_PER_FRAME lines separated by
+ * '\n', then the net changes to the user list, so a user that joins and
+ * leaves between two frames is never sent at all. Lines wait for a frame in
+ * a scrollback of DISPLAY_SCROLLBACK lines; when they arrive faster than
+ * frames show them, the oldest are dropped and the next frame says how many
+ * have been so far.
+ * Only used from the client's main loop.
+*/
+class display_batcher {
+public:
+    explicit display_batcher(uint64_t frame_ns = 1000000000ULL / DISPLAY_FPS) : frame_ns_{frame_ns} {}
+
+    /**
+     * @brief queue a command for the next frame
+    */
+    void send(const display_command& cmd) {
+        switch (cmd.type_) {
+            case GUI_CONSOLE:
+                if (lines_.size() == DISPLAY_SCROLLBACK) {
+                    lines_.pop_front();
+                    stats_.dropped_++;
+                }
+                lines_.push_back(cmd.text_);
+                break;
+            case GUI_USER_ADD:
+                change_user(cmd.text_, +1);
+                break;
+            case GUI_USER_REMOVE:
+                change_user(cmd.text_, -1);
+                break;
+            default:
+                break;
+        }
+    }
+
+    bool empty() const { return lines_.empty() && users_.empty() && shown_dropped_ == stats_.dropped_; }
+
+    /**
+     * @brief milliseconds until the next frame is due, or timeout_ms if
+     *        sooner or there is nothing to show
+    */
+    int wait_ms(uint64_t now, int timeout_ms) const {
+        if (empty()) {
+            return timeout_ms;
+        }
+        uint64_t due = last_frame_ns_ + frame_ns_;
+        uint64_t ms = due > now ? (due - now + 999999) / 1000000 : 0;
+        return ms < static_cast<uint64_t>(timeout_ms) ? static_cast<int>(ms) : timeout_ms;
+    }
+
+    /**
+     * @brief send a frame if one is due and there is anything to show
+     * @param gui_tx channel to the GUI thread
+     * @param now monotonic time
+     * @param force send regardless of the frame rate, and every waiting line
+    */
+    template<typename Tx>
+    void flush(Tx& gui_tx, uint64_t now, bool force = false) {
+        if (empty() || (!force && now - last_frame_ns_ < frame_ns_)) {
+            return;
+        }
+        last_frame_ns_ = now;
+        stats_.frames_++;
+
+        size_t count = force ? lines_.size() : std::min<size_t>(lines_.size(), DISPLAY_LINES_PER_FRAME);
+        std::string text;
+        for (size_t i = 0; i < count; i++) {
+            if (!text.empty()) {
+                text.push_back('\n');
+            }
+            text.append(lines_.front());
+            lines_.pop_front();
+        }
+        stats_.lines_ += count;
+        if (shown_dropped_ != stats_.dropped_) {
+            char notice[96];
+            snprintf(notice, sizeof(notice), "(%llu messages dropped, too many to show)",
+                (unsigned long long)stats_.dropped_);
+            if (!text.empty()) {
+                text.push_back('\n');
+            }
+            text.append(notice);
+            shown_dropped_ = stats_.dropped_;
+        }
+        if (!text.empty()) {
+            display_command cmd{GUI_CONSOLE, text};
+            gui_tx.send(cmd);
+        }
+
+        for (const auto& [name, delta]: users_) {
+            display_command cmd{delta > 0 ? GUI_USER_ADD : GUI_USER_REMOVE, name};
+            gui_tx.send(cmd);
+            stats_.user_updates_++;
+        }
+        users_.clear();
+    }
+
+    const display_stats& stats() const { return stats_; }
+
+private:
+    /**
+     * @brief record a user list change, cancelling out the opposite change
+     *        not yet sent
+    */
+    void change_user(const std::string& name, int delta) {
+        auto it = users_.find(name);
+        if (it == users_.end()) {
+            users_.emplace(name, delta);
+        }
+        else if (it->second != delta) {
+            users_.erase(it);
+        }
+    }
+
+    uint64_t frame_ns_;
+    uint64_t last_frame_ns_ = 0;
+    std::deque<std::string> lines_;
+    // net change per user since the last frame, +1 added, -1 removed
+    std::map<std::string, int> users_;
+    uint64_t shown_dropped_ = 0;
+    display_stats stats_;
+};
+
+}; // namespace chat
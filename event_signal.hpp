@@ -0,0 +1,69 @@
+#pragma once
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <system_error>
+
+namespace chat {
+
+/**
+ * @brief Wakes a thread sleeping until another thread has work for it
+ *
+ * Backed by an eventfd, so a notify that arrives before the wait is not
+ * lost, any number of notifies collapse into one wakeup, and the descriptor
+ * can be multiplexed with poll alongside sockets.
+*/
+class event_signal {
+public:
+    event_signal() : fd_{::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)} {
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "eventfd");
+        }
+    }
+
+    ~event_signal() {
+        ::close(fd_);
+    }
+
+    event_signal(const event_signal&) = delete;
+    event_signal& operator=(const event_signal&) = delete;
+
+    int fd() const { return fd_; }
+
+    /**
+     * @brief wake the waiting thread, callable from any thread
+    */
+    void notify() {
+        uint64_t one = 1;
+        ssize_t n;
+        do {
+            n = ::write(fd_, &one, sizeof(one));
+        } while (n < 0 && errno == EINTR);
+    }
+
+    /**
+     * @brief sleep until notified or timeout_ms has passed
+     * @param timeout_ms maximum time to sleep, -1 for no limit
+     * @return true if notified, false on timeout
+    */
+    bool wait(int timeout_ms) {
+        pollfd p{fd_, POLLIN, 0};
+        int n = ::poll(&p, 1, timeout_ms);
+        if (n <= 0) {
+            return false;
+        }
+        uint64_t count;
+        while (::read(fd_, &count, sizeof(count)) < 0 && errno == EINTR) {
+        }
+        return true;
+    }
+
+private:
+    int fd_;
+};
+
+}; // namespace chat
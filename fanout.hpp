@@ -0,0 +1,126 @@
+#pragma once
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <vector>
+
+#include <chat_ex2.hpp>
+#include <server_io.hpp>
+
+namespace chat {
+
+/**
+ * @brief Packed destination addresses for messages sent to every online user
+ *
+ * Addresses are grouped by wire format and capabilities, so a message is
+ * encoded once per format, and compressed once for all clients that take
+ * compressed frames, and each recipient costs one queued datagram that
+ * points at the shared payload, and a message only some clients understand
+ * skips whole groups. Each entry records an owner (the registry's index for
+ * the user) so the owner can be repointed when removal moves an entry.
+*/
+class fanout {
+public:
+    static constexpr uint32_t NONE = 0xFFFFFFFF;
+    static constexpr size_t GROUPS = 2 << CAPABILITY_BITS;
+
+    /**
+     * @brief group holding destinations with a given format and capabilities
+    */
+    static size_t group_of(wire_format format, uint8_t capabilities) {
+        return format | ((capabilities & ((1 << CAPABILITY_BITS) - 1)) << 1);
+    }
+
+    /**
+     * @brief add a destination
+     * @param address to send to
+     * @param group from group_of
+     * @param owner index reported back when this entry moves
+     * @return slot of the new entry within its group
+    */
+    uint32_t add(const sockaddr_in& address, size_t group, uint32_t owner) {
+        addresses_[group].push_back(address);
+        owners_[group].push_back(owner);
+        return static_cast<uint32_t>(addresses_[group].size() - 1);
+    }
+
+    /**
+     * @brief remove a destination, moving the last entry of its group into slot
+     * @param group of the destination
+     * @param slot returned by add
+     * @return owner of the entry now in slot, or NONE if nothing moved
+    */
+    uint32_t remove(size_t group, uint32_t slot) {
+        uint32_t last = static_cast<uint32_t>(addresses_[group].size() - 1);
+        uint32_t moved = NONE;
+        if (slot != last) {
+            addresses_[group][slot] = addresses_[group][last];
+            owners_[group][slot] = owners_[group][last];
+            moved = owners_[group][slot];
+        }
+        addresses_[group].pop_back();
+        owners_[group].pop_back();
+        return moved;
+    }
+
+    /**
+     * @brief update the owner recorded for an entry
+    */
+    void set_owner(size_t group, uint32_t slot, uint32_t owner) {
+        owners_[group][slot] = owner;
+    }
+
+    void clear() {
+        for (size_t group = 0; group < GROUPS; group++) {
+            addresses_[group].clear();
+            owners_[group].clear();
+        }
+    }
+
+    size_t size() const {
+        size_t size = 0;
+        for (size_t group = 0; group < GROUPS; group++) {
+            size += addresses_[group].size();
+        }
+        return size;
+    }
+
+    /**
+     * @brief queue a message for every destination
+     * @param msg message, already encoded
+     * @param out queue of datagrams to send
+     * @param except if not null, address not to send to
+     * @param require only send to destinations with all of these capabilities
+     * @param exclude only send to destinations with none of these capabilities
+    */
+    void send(
+        const encoded_message& msg, outbox& out, const sockaddr_in * except = nullptr,
+        uint8_t require = 0, uint8_t exclude = 0) const {
+        for (size_t group = 0; group < GROUPS; group++) {
+            auto format = static_cast<wire_format>(group & 1);
+            uint8_t capabilities = static_cast<uint8_t>(group >> 1);
+            const auto& addresses = addresses_[group];
+            if (addresses.empty() || (capabilities & require) != require || (capabilities & exclude) != 0) {
+                continue;
+            }
+
+            size_t length = msg.size(format, capabilities);
+            size_t handle = out.stage(msg.data(format, capabilities), length);
+            for (const auto& address: addresses) {
+                if (except != nullptr &&
+                    address.sin_addr.s_addr == except->sin_addr.s_addr &&
+                    address.sin_port == except->sin_port) {
+                    continue;
+                }
+                out.send_staged(handle, length, address);
+            }
+        }
+    }
+
+private:
+    std::vector<sockaddr_in> addresses_[GROUPS];
+    std::vector<uint32_t> owners_[GROUPS];
+};
+
+}; // namespace chat
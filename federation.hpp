@@ -0,0 +1,470 @@
+#pragma once
+
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <chat_ex2.hpp>
+#include <reliable.hpp>
+
+//---------------------------------------------------------------------------------------
+// Federation of server nodes
+//
+// Several servers, each on its own address and port, form a cluster. Every
+// node owns the users that joined it, and tells the other nodes, its peers,
+// who joins and leaves, so each node holds a directory of which node every
+// remote user is on. Broadcasts are forwarded once to each peer, which fans
+// them out to its own users, and a direct message to a remote user goes
+// straight to the node that user is on. Links between nodes use reliable
+// delivery envelopes (see reliable.hpp).
+//
+//   | 0xCA | kind | epoch u32 | count u32 | name len u8 | name | target len u8 | target | text |
+//
+// The epoch is the wall clock in milliseconds as a node starts, so a node
+// that restarts comes back with a newer one. A HELLO or SNAPSHOT with a newer
+// epoch than a peer had means it has started or restarted, so its users are
+// forgotten and both sides send each other a snapshot of their users. Any
+// other message not from the peer's current epoch, such as a late
+// retransmit from before it restarted, is dropped. Every FEDERATION_HELLO_MS each
+// node sends a HELLO with its number of users; a peer whose directory
+// disagrees twice running asks for a fresh snapshot. A peer heard nothing
+// from for FEDERATION_TIMEOUT_MS is taken to be down and its users offline.
+//
+//   HELLO:     count = users on the sender
+//   SNAPSHOT:  text = names of users on the sender, each followed by '\0'
+//   JOINED:    name = user that joined the sender
+//   LEFT:      name = user that left the sender
+//   RESYNC:    ask the receiver for a SNAPSHOT
+//   GOODBYE:   the sender is shutting down
+//   BROADCAST: name = sender, text = message
+//   DM:        name = sender, target = recipient, text = message
+
+#define FEDERATION_MAGIC          0xCA
+#define FEDERATION_HEADER_LENGTH  10
+
+// Longest federation datagram, snapshots are split to fit
+#define FEDERATION_MAX_LENGTH     MAX_BUNDLE_LENGTH
+
+// How often nodes tell their peers they are up
+#define FEDERATION_HELLO_MS       1000
+
+// Peers heard nothing from for this long are taken to be down
+#define FEDERATION_TIMEOUT_MS     5000
+
+static_assert(
+    FEDERATION_HEADER_LENGTH + 2 * (1 + MAX_USERNAME_LENGTH) + MAX_MESSAGE_LENGTH <= FEDERATION_MAX_LENGTH,
+    "forwarded messages fit a federation datagram");
+
+namespace chat {
+
+enum federation_kind {
+    FEDERATION_HELLO = 0,
+    FEDERATION_SNAPSHOT,
+    FEDERATION_JOINED,
+    FEDERATION_LEFT,
+    FEDERATION_RESYNC,
+    FEDERATION_GOODBYE,
+    FEDERATION_BROADCAST,
+    FEDERATION_DM,
+};
+
+/**
+ * @struct federation_message
+ * @brief A received federation datagram, referring into the received bytes
+ * @var federation_message::kind_
+ *  Member 'kind_' a federation_kind
+ * @var federation_message::epoch_
+ *  Member 'epoch_' sender's epoch
+ * @var federation_message::count_
+ *  Member 'count_' users on the sender, for HELLO
+ * @var federation_message::name_
+ *  Member 'name_' user joined or left, or sender of a forwarded message
+ * @var federation_message::target_
+ *  Member 'target_' recipient of a forwarded direct message
+ * @var federation_message::text_
+ *  Member 'text_' forwarded message, or snapshot names
+ */
+struct federation_message {
+    federation_kind kind_;
+    uint32_t epoch_;
+    uint32_t count_;
+    std::string_view name_;
+    std::string_view target_;
+    std::string_view text_;
+};
+
+/**
+ * @brief check if a received datagram comes from another node
+*/
+inline bool is_federation(const char * buffer, size_t length) {
+    return length > 0 && static_cast<uint8_t>(buffer[0]) == FEDERATION_MAGIC;
+}
+
+/**
+ * @brief Encode a federation datagram
+ * @param buffer at least FEDERATION_MAX_LENGTH bytes
+ * @param kind a federation_kind
+ * @param epoch sender's epoch
+ * @param count users on the sender, for HELLO
+ * @param name at most MAX_USERNAME_LENGTH bytes
+ * @param target at most MAX_USERNAME_LENGTH bytes
+ * @param text cut short to fit FEDERATION_MAX_LENGTH
+ * @return number of bytes encoded
+*/
+inline size_t encode_federation(
+    char * buffer, federation_kind kind, uint32_t epoch, uint32_t count,
+    std::string_view name = {}, std::string_view target = {}, std::string_view text = {}) {
+    name = name.substr(0, MAX_USERNAME_LENGTH);
+    target = target.substr(0, MAX_USERNAME_LENGTH);
+    buffer[0] = static_cast<char>(FEDERATION_MAGIC);
+    buffer[1] = static_cast<char>(kind);
+    put_u32(buffer + 2, epoch);
+    put_u32(buffer + 6, count);
+    size_t n = FEDERATION_HEADER_LENGTH;
+    for (auto field: {name, target}) {
+        buffer[n++] = static_cast<char>(field.length());
+        memcpy(buffer + n, field.data(), field.length());
+        n += field.length();
+    }
+    text = text.substr(0, FEDERATION_MAX_LENGTH - n);
+    memcpy(buffer + n, text.data(), text.length());
+    return n + text.length();
+}
+
+/**
+ * @brief Parse a federation datagram
+ * @return true if well formed, otherwise false
+*/
+inline bool parse_federation(const char * buffer, size_t length, federation_message& message) {
+    if (!is_federation(buffer, length) || length < FEDERATION_HEADER_LENGTH + 2 ||
+        static_cast<uint8_t>(buffer[1]) > FEDERATION_DM) {
+        return false;
+    }
+    message.kind_ = static_cast<federation_kind>(buffer[1]);
+    message.epoch_ = get_u32(buffer + 2);
+    message.count_ = get_u32(buffer + 6);
+    size_t n = FEDERATION_HEADER_LENGTH;
+    for (auto field: {&message.name_, &message.target_}) {
+        if (n >= length) {
+            return false;
+        }
+        size_t field_length = static_cast<uint8_t>(buffer[n++]);
+        if (field_length > MAX_USERNAME_LENGTH || field_length > length - n) {
+            return false;
+        }
+        *field = std::string_view{buffer + n, field_length};
+        n += field_length;
+    }
+    message.text_ = std::string_view{buffer + n, length - n};
+    return true;
+}
+
+/**
+ * @brief Pack user names into SNAPSHOT datagrams
+ * @param epoch sender's epoch
+ * @param names called with a function taking each name
+ * @param send called with each encoded datagram and its length
+*/
+template<typename Names, typename Send>
+void pack_snapshot(uint32_t epoch, Names names, Send send) {
+    char text[FEDERATION_MAX_LENGTH];
+    size_t capacity = FEDERATION_MAX_LENGTH - FEDERATION_HEADER_LENGTH - 2;
+    size_t used = 0;
+    char buffer[FEDERATION_MAX_LENGTH];
+    auto flush = [&]() {
+        send(buffer, encode_federation(buffer, FEDERATION_SNAPSHOT, epoch, 0, {}, {}, {text, used}));
+        used = 0;
+    };
+    names([&](std::string_view name) {
+        if (used + name.length() + 1 > capacity) {
+            flush();
+        }
+        memcpy(text + used, name.data(), name.length());
+        text[used + name.length()] = '\0';
+        used += name.length() + 1;
+    });
+    if (used > 0) {
+        flush();
+    }
+}
+
+/**
+ * @struct federation_node
+ * @brief A peer node of the cluster
+ * @var federation_node::address_
+ *  Member 'address_' address and port the node's server is bound to
+ * @var federation_node::epoch_
+ *  Member 'epoch_' node's epoch, 0 until heard from or once taken to be down
+ * @var federation_node::last_epoch_
+ *  Member 'last_epoch_' newest epoch the node has had, kept while it is down
+ * @var federation_node::said_goodbye_
+ *  Member 'said_goodbye_' the node left with GOODBYE, so last_epoch_ is over
+ * @var federation_node::users_
+ *  Member 'users_' users on the node in the directory
+ * @var federation_node::mismatches_
+ *  Member 'mismatches_' HELLOs in a row whose count disagreed with users_
+ * @var federation_node::last_heard_ns_
+ *  Member 'last_heard_ns_' when anything was last received from the node
+ */
+struct federation_node {
+    sockaddr_in address_;
+    uint32_t epoch_ = 0;
+    uint32_t last_epoch_ = 0;
+    bool said_goodbye_ = false;
+    uint32_t users_ = 0;
+    uint32_t mismatches_ = 0;
+    std::atomic<uint64_t> last_heard_ns_{0};
+};
+
+/**
+ * @struct federation_stats
+ * @brief Counters for traffic between nodes
+ * @var federation_stats::broadcasts_out_
+ *  Member 'broadcasts_out_' broadcasts forwarded to peers, one per peer
+ * @var federation_stats::dms_out_
+ *  Member 'dms_out_' direct messages forwarded to the recipient's node
+ * @var federation_stats::broadcasts_in_
+ *  Member 'broadcasts_in_' broadcasts received from peers
+ * @var federation_stats::dms_in_
+ *  Member 'dms_in_' direct messages received from peers
+ * @var federation_stats::resyncs_
+ *  Member 'resyncs_' snapshots asked for after the directory disagreed
+ * @var federation_stats::nodes_lost_
+ *  Member 'nodes_lost_' peers taken to be down after going silent
+ */
+struct federation_stats {
+    std::atomic<uint64_t> broadcasts_out_{0};
+    std::atomic<uint64_t> dms_out_{0};
+    std::atomic<uint64_t> broadcasts_in_{0};
+    std::atomic<uint64_t> dms_in_{0};
+    std::atomic<uint64_t> resyncs_{0};
+    std::atomic<uint64_t> nodes_lost_{0};
+};
+
+/**
+ * @brief This node's peers and the directory of users on them
+ *
+ * Peers are added before any worker starts. Changes to the directory, and
+ * to a peer's epoch, need the caller's exclusive lock, lookups and the
+ * counters only a shared one.
+*/
+class federation {
+public:
+    federation() {
+        // never 0, which stands for a peer not heard from
+        epoch_ = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+        if (epoch_ == 0) {
+            epoch_ = 1;
+        }
+    }
+
+    /**
+     * @brief add a peer, before any worker starts
+    */
+    void add_peer(const sockaddr_in& address) {
+        nodes_.push_back(std::make_unique<federation_node>());
+        nodes_.back()->address_ = address;
+    }
+
+    bool enabled() const { return !nodes_.empty(); }
+
+    uint32_t epoch() const { return epoch_; }
+
+    size_t size() const { return nodes_.size(); }
+
+    federation_node& node(size_t index) { return *nodes_[index]; }
+
+    /**
+     * @brief index of the peer at an address
+     * @return index, or -1 if the address is not a peer
+    */
+    int find_node(const sockaddr_in& address) const {
+        for (size_t i = 0; i < nodes_.size(); i++) {
+            const sockaddr_in& a = nodes_[i]->address_;
+            if (a.sin_addr.s_addr == address.sin_addr.s_addr && a.sin_port == address.sin_port) {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * @brief check if a peer is up and a message carries its current epoch,
+     *        under at least the caller's shared lock
+    */
+    bool current(size_t index, uint32_t epoch) const {
+        return nodes_[index]->epoch_ != 0 && nodes_[index]->epoch_ == epoch;
+    }
+
+    /**
+     * @brief check if a HELLO or SNAPSHOT with an epoch starts a new run of a
+     *        peer: one newer than any it had, or the one it had before it was
+     *        taken to be down without saying GOODBYE
+    */
+    bool starts_run(size_t index, uint32_t epoch) const {
+        const federation_node& n = *nodes_[index];
+        if (epoch == 0 || n.epoch_ == epoch) {
+            return false;
+        }
+        if (n.last_epoch_ == 0 || newer(epoch, n.last_epoch_)) {
+            return true;
+        }
+        return epoch == n.last_epoch_ && n.epoch_ == 0 && !n.said_goodbye_;
+    }
+
+    /**
+     * @brief record that a peer is up with an epoch
+    */
+    void up(size_t index, uint32_t epoch) {
+        federation_node& n = *nodes_[index];
+        n.epoch_ = epoch;
+        n.last_epoch_ = epoch;
+        n.said_goodbye_ = false;
+    }
+
+    /**
+     * @brief record that a peer is down, having said GOODBYE or gone silent
+    */
+    void down(size_t index, bool goodbye) {
+        nodes_[index]->epoch_ = 0;
+        nodes_[index]->said_goodbye_ = goodbye;
+    }
+
+    /**
+     * @brief record that a peer was heard from
+    */
+    void heard(size_t index, uint64_t now) {
+        nodes_[index]->last_heard_ns_.store(now, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief node a remote user is on
+     * @return index of the peer, or -1 if no peer has the user
+    */
+    int owner(std::string_view name) const {
+        auto it = directory_.find(lookup(name));
+        return it != directory_.end() ? static_cast<int>(it->second) : -1;
+    }
+
+    /**
+     * @brief record a user on a peer
+     * @return true if the user was not already recorded on that peer
+    */
+    bool insert(std::string_view name, size_t index) {
+        auto [it, inserted] = directory_.try_emplace(std::string{name}, static_cast<uint32_t>(index));
+        if (!inserted) {
+            if (it->second == index) {
+                return false;
+            }
+            // the user moved between nodes faster than the LEFT arrived
+            nodes_[it->second]->users_--;
+            it->second = static_cast<uint32_t>(index);
+        }
+        nodes_[index]->users_++;
+        version_++;
+        return true;
+    }
+
+    /**
+     * @brief forget a user on a peer
+     * @return true if the user was recorded on that peer
+    */
+    bool erase(std::string_view name, size_t index) {
+        auto it = directory_.find(lookup(name));
+        if (it == directory_.end() || it->second != index) {
+            return false;
+        }
+        directory_.erase(it);
+        nodes_[index]->users_--;
+        version_++;
+        return true;
+    }
+
+    /**
+     * @brief forget every user on a peer
+     * @param index of the peer
+     * @param removed called with the name of each user forgotten
+    */
+    template<typename Removed>
+    void clear_node(size_t index, Removed removed) {
+        for (auto it = directory_.begin(); it != directory_.end();) {
+            if (it->second != index) {
+                ++it;
+                continue;
+            }
+            version_++;
+            removed(std::string_view{it->first});
+            it = directory_.erase(it);
+        }
+        nodes_[index]->users_ = 0;
+        nodes_[index]->mismatches_ = 0;
+    }
+
+    /**
+     * @brief call f with the name of every user on every peer
+    */
+    template<typename F>
+    void for_each_user(F f) const {
+        for (const auto& entry: directory_) {
+            f(std::string_view{entry.first});
+        }
+    }
+
+    /**
+     * @brief users on all peers
+    */
+    size_t users() const { return directory_.size(); }
+
+    /**
+     * @brief directory version, incremented by every insert and erase
+    */
+    uint64_t version() const { return version_; }
+
+    /**
+     * @brief claim the next HELLO round, so only one worker runs it
+     * @return true if a round is due and this caller claimed it
+    */
+    bool claim_hello(uint64_t now) {
+        uint64_t next = next_hello_ns_.load(std::memory_order_relaxed);
+        return enabled() && now >= next &&
+            next_hello_ns_.compare_exchange_strong(next, now + FEDERATION_HELLO_MS * 1000000ULL);
+    }
+
+    federation_stats& stats() { return stats_; }
+
+private:
+    /**
+     * @brief true if epoch a is later than b, allowing for wrap around
+    */
+    static bool newer(uint32_t a, uint32_t b) {
+        return static_cast<int32_t>(a - b) > 0;
+    }
+
+    /**
+     * @brief reuse one key per thread to look up names without allocating
+    */
+    static const std::string& lookup(std::string_view name) {
+        thread_local std::string key;
+        key.assign(name.data(), name.length());
+        return key;
+    }
+
+    uint32_t epoch_;
+    std::vector<std::unique_ptr<federation_node>> nodes_;
+    std::unordered_map<std::string, uint32_t> directory_;
+    uint64_t version_ = 0;
+    std::atomic<uint64_t> next_hello_ns_{0};
+    federation_stats stats_;
+};
+
+}; // namespace chat
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <atomic>
+#include <memory>
+
+#include <pool.hpp>
+#include <timer_wheel.hpp>
+
+// Resolution of idle timeouts
+#define IDLE_TICK_MS 100
+
+// How often clients send a HEARTBEAT
+#define HEARTBEAT_INTERVAL_MS 5000
+
+namespace chat {
+
+/**
+ * @brief Notices clients that have gone silent, for the server to evict
+ *
+ * Every client that joins gets a timer in a timer_wheel. Rather than moving
+ * the timer on every message, each message just records the tick it arrived
+ * in, and a timer that fires for a client heard from since is rescheduled
+ * from then. A busy client's timer fires about once per timeout, and a
+ * message costs a hash lookup and a relaxed store.
+ *
+ * add, remove, expire and clear need the caller's exclusive lock, touch only
+ * a shared one.
+*/
+class idle_monitor {
+public:
+    /**
+     * @param tick_ns length of a tick
+    */
+    explicit idle_monitor(uint64_t tick_ns = IDLE_TICK_MS * 1000000ULL) :
+        tick_ns_{tick_ns},
+        by_address_{0, address_map<uint32_t>::allocator_type{nodes_}} {
+    }
+
+    /**
+     * @brief evict clients silent for timeout_ns, 0 to never evict, before
+     *        any worker starts
+    */
+    void set_timeout(uint64_t timeout_ns) {
+        timeout_ticks_ = timeout_ns == 0 ? 0 : (timeout_ns + tick_ns_ - 1) / tick_ns_;
+    }
+
+    bool enabled() const { return timeout_ticks_ != 0; }
+
+    /**
+     * @brief number of clients being watched
+    */
+    size_t size() const { return by_address_.size(); }
+
+    /**
+     * @brief start watching a client that just joined
+    */
+    void add(const sockaddr_in& address, uint64_t now) {
+        if (!enabled()) {
+            return;
+        }
+        start(now);
+        uint64_t k = address_key(address);
+        if (by_address_.count(k) != 0) {
+            return;
+        }
+        uint32_t id = wheel_.create(k);
+        if (id >= capacity_) {
+            grow(id + 1);
+        }
+        seen_[id].store(tick(now), std::memory_order_relaxed);
+        wheel_.schedule(id, tick(now) + timeout_ticks_);
+        by_address_.emplace(k, id);
+    }
+
+    /**
+     * @brief stop watching a client, if it is watched
+    */
+    void remove(const sockaddr_in& address) {
+        auto it = by_address_.find(address_key(address));
+        if (it == by_address_.end()) {
+            return;
+        }
+        wheel_.destroy(it->second);
+        by_address_.erase(it);
+    }
+
+    /**
+     * @brief note that a client was heard from
+    */
+    void touch(const sockaddr_in& address, uint64_t now) {
+        if (!enabled()) {
+            return;
+        }
+        auto it = by_address_.find(address_key(address));
+        if (it != by_address_.end()) {
+            seen_[it->second].store(tick(now), std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief true if expire has ticks to catch up on
+    */
+    bool due(uint64_t now) const {
+        uint64_t ticked = ticked_.load(std::memory_order_relaxed);
+        return enabled() && ticked != 0 && tick(now) > ticked;
+    }
+
+    /**
+     * @brief advance to now, calling evict for each client silent for the timeout
+     * @param now current monotonic time
+     * @param evict called with the address of each silent client, which is
+     *        no longer watched
+     * @return number of clients evicted
+    */
+    template<typename Evict>
+    size_t expire(uint64_t now, Evict evict) {
+        if (!due(now)) {
+            return 0;
+        }
+        size_t evicted = 0;
+        wheel_.advance(tick(now), [this, &evict, &evicted](uint32_t id, uint64_t k) {
+            uint64_t last = seen_[id].load(std::memory_order_relaxed);
+            if (last + timeout_ticks_ > wheel_.now()) {
+                // heard from since the timer was set
+                wheel_.schedule(id, last + timeout_ticks_);
+                return;
+            }
+            wheel_.destroy(id);
+            by_address_.erase(k);
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = static_cast<uint32_t>(k >> 16);
+            address.sin_port = static_cast<uint16_t>(k & 0xFFFF);
+            evict(address);
+            evicted++;
+        });
+        ticked_.store(wheel_.now(), std::memory_order_relaxed);
+        evictions_ += evicted;
+        return evicted;
+    }
+
+    /**
+     * @brief clients evicted so far
+    */
+    uint64_t evictions() const { return evictions_; }
+
+    void clear() {
+        wheel_.clear();
+        by_address_.clear();
+    }
+
+private:
+    uint64_t tick(uint64_t now) const { return now / tick_ns_; }
+
+    /**
+     * @brief start the wheel at the first client's join
+    */
+    void start(uint64_t now) {
+        if (ticked_.load(std::memory_order_relaxed) == 0) {
+            wheel_ = timer_wheel{tick(now)};
+            ticked_.store(tick(now), std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief grow the last seen ticks to at least n, copying them over
+    */
+    void grow(size_t n) {
+        size_t capacity = capacity_ == 0 ? 1024 : capacity_;
+        while (capacity < n) {
+            capacity *= 2;
+        }
+        auto seen = std::make_unique<std::atomic<uint64_t>[]>(capacity);
+        for (size_t i = 0; i < capacity_; i++) {
+            seen[i].store(seen_[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        seen_ = std::move(seen);
+        capacity_ = capacity;
+    }
+
+    uint64_t tick_ns_;
+    uint64_t timeout_ticks_ = 0;
+    // tick expire has caught up to, 0 until the first client joins
+    std::atomic<uint64_t> ticked_{0};
+    uint64_t evictions_ = 0;
+    timer_wheel wheel_;
+    // index nodes are pooled, so joins and leaves do not touch the heap
+    slab_pool nodes_;
+    address_map<uint32_t> by_address_;
+    // tick each client was last heard from, indexed by timer id
+    std::unique_ptr<std::atomic<uint64_t>[]> seen_;
+    size_t capacity_ = 0;
+};
+
+}; // namespace chat
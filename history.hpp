@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string_view>
+
+#include <chat_ex2.hpp>
+
+namespace chat {
+
+/**
+ * @brief The most recent BROADCASTs, kept so they can be replayed to users
+ *        who join later
+ *
+ * A ring of fixed size slots, allocated once when the capacity is set, so
+ * appending copies into an existing slot and never allocates, and memory use
+ * is exactly capacity() * slot size. Once full, each append overwrites the
+ * oldest message. Appends and replays take a mutex of their own, as
+ * broadcasts are handled by several workers at once under a shared lock.
+*/
+class message_history {
+public:
+    explicit message_history(size_t capacity = 0) {
+        resize(capacity);
+    }
+
+    /**
+     * @brief set the number of messages kept, discarding any already kept,
+     *        before any worker starts
+    */
+    void resize(size_t capacity) {
+        entries_ = capacity > 0 ? std::make_unique<entry[]>(capacity) : nullptr;
+        capacity_ = capacity;
+        appended_ = 0;
+    }
+
+    size_t capacity() const { return capacity_; }
+
+    /**
+     * @brief bytes allocated for messages
+    */
+    size_t memory() const { return capacity_ * sizeof(entry); }
+
+    /**
+     * @brief keep a message, overwriting the oldest if full
+     * @param username sender, truncated to MAX_USERNAME_LENGTH-1 bytes
+     * @param message body, truncated to MAX_MESSAGE_LENGTH-1 bytes
+    */
+    void append(std::string_view username, std::string_view message) {
+        if (capacity_ == 0) {
+            return;
+        }
+        username = username.substr(0, MAX_USERNAME_LENGTH - 1);
+        message = message.substr(0, MAX_MESSAGE_LENGTH - 1);
+
+        std::lock_guard<std::mutex> lock{mutex_};
+        entry& e = entries_[appended_ % capacity_];
+        memcpy(e.username_, username.data(), username.length());
+        e.username_length_ = static_cast<uint8_t>(username.length());
+        memcpy(e.message_, message.data(), message.length());
+        e.message_length_ = static_cast<uint16_t>(message.length());
+        appended_++;
+    }
+
+    /**
+     * @brief visit the most recent messages, oldest first
+     * @param n most messages to visit
+     * @param visit called with (std::string_view username, std::string_view message),
+     *        the views are only valid during the call
+     * @return number of messages visited
+    */
+    template<typename Visit>
+    size_t replay(size_t n, Visit visit) const {
+        std::lock_guard<std::mutex> lock{mutex_};
+        size_t kept = appended_ < capacity_ ? static_cast<size_t>(appended_) : capacity_;
+        if (n > kept) {
+            n = kept;
+        }
+        for (uint64_t i = appended_ - n; i < appended_; i++) {
+            const entry& e = entries_[i % capacity_];
+            visit(std::string_view{e.username_, e.username_length_},
+                std::string_view{e.message_, e.message_length_});
+        }
+        return n;
+    }
+
+private:
+    struct entry {
+        uint8_t username_length_;
+        uint16_t message_length_;
+        char username_[MAX_USERNAME_LENGTH];
+        char message_[MAX_MESSAGE_LENGTH];
+    };
+
+    mutable std::mutex mutex_;
+    std::unique_ptr<entry[]> entries_;
+    size_t capacity_ = 0;
+    uint64_t appended_ = 0;
+};
+
+}; // namespace chat
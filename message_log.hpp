@@ -0,0 +1,660 @@
+#pragma once
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <chat_ex2.hpp>
+
+// Size of every log segment file
+#define LOG_SEGMENT_BYTES (16 * 1024 * 1024)
+
+// Start of each segment holding its header, sender filter and sparse index
+#define LOG_HEADER_BYTES (64 * 1024)
+
+// Records are indexed at most once per this many bytes
+#define LOG_INDEX_BYTES (8 * 1024)
+
+// Size of each segment's bloom filter of senders
+#define LOG_BLOOM_BYTES 1024
+
+// How often appended records are flushed to disk, together
+#define LOG_FLUSH_MS 100
+
+// Returned by append once the log has failed and records are no longer kept
+#define LOG_NO_SEQ UINT64_MAX
+
+#define LOG_MAGIC   "CHATLOG1"
+#define LOG_VERSION 1
+
+namespace chat {
+
+/**
+ * @struct log_index_entry
+ * @brief Sparse index entry, the first record at or after a LOG_INDEX_BYTES boundary
+ * @var log_index_entry::seq_
+ *  Member 'seq_' sequence number of the record
+ * @var log_index_entry::ns_
+ *  Member 'ns_' time the record was appended, ns since the epoch
+ * @var log_index_entry::offset_
+ *  Member 'offset_' position of the record within the segment
+ */
+struct log_index_entry {
+    uint64_t seq_;
+    uint64_t ns_;
+    uint64_t offset_;
+};
+
+/**
+ * @struct log_segment_header
+ * @brief Start of a segment file, everything needed to open the log without
+ *        reading any records
+ *
+ * The committed fields are only advanced once the records they cover have
+ * been flushed, so after a crash a segment ends at its last flush.
+ * @var log_segment_header::magic_
+ *  Member 'magic_' LOG_MAGIC once the segment is in use, zero for a spare
+ * @var log_segment_header::version_
+ *  Member 'version_' LOG_VERSION
+ * @var log_segment_header::index_count_
+ *  Member 'index_count_' committed entries in index_
+ * @var log_segment_header::base_seq_
+ *  Member 'base_seq_' sequence number of the first record
+ * @var log_segment_header::end_seq_
+ *  Member 'end_seq_' committed, one past the sequence number of the last record
+ * @var log_segment_header::used_
+ *  Member 'used_' committed bytes, including the header
+ * @var log_segment_header::first_ns_
+ *  Member 'first_ns_' time the first record was appended
+ * @var log_segment_header::last_ns_
+ *  Member 'last_ns_' time the last committed record was appended
+ * @var log_segment_header::bloom_
+ *  Member 'bloom_' bloom filter of the senders of the segment's records
+ * @var log_segment_header::index_
+ *  Member 'index_' sparse index, ascending
+ */
+struct log_segment_header {
+    char magic_[8];
+    uint32_t version_;
+    uint32_t index_count_;
+    uint64_t base_seq_;
+    uint64_t end_seq_;
+    uint64_t used_;
+    uint64_t first_ns_;
+    uint64_t last_ns_;
+    uint64_t reserved_;
+    uint8_t bloom_[LOG_BLOOM_BYTES];
+    log_index_entry index_[(LOG_HEADER_BYTES - 64 - LOG_BLOOM_BYTES) / sizeof(log_index_entry)];
+};
+
+static_assert(sizeof(log_segment_header) <= LOG_HEADER_BYTES, "log header too large");
+static_assert(
+    sizeof(log_segment_header::index_) / sizeof(log_index_entry) >=
+    (LOG_SEGMENT_BYTES - LOG_HEADER_BYTES) / LOG_INDEX_BYTES, "log index too small");
+
+/**
+ * @struct log_record_header
+ * @brief Start of each record, followed by the sender, recipient and message
+ *        bytes, the whole record padded to a multiple of 8 bytes
+ */
+struct log_record_header {
+    uint64_t seq_;
+    uint64_t ns_;
+    uint32_t length_;
+    uint16_t message_length_;
+    uint8_t type_;
+    uint8_t sender_length_;
+    uint8_t recipient_length_;
+    uint8_t reserved_[7];
+};
+
+/**
+ * @struct log_entry
+ * @brief A record read back from the log, referring into the mapped segment
+ * @var log_entry::seq_
+ *  Member 'seq_' sequence number, one higher than the record before it
+ * @var log_entry::ns_
+ *  Member 'ns_' time appended, ns since the epoch
+ * @var log_entry::type_
+ *  Member 'type_' BROADCAST or DIRECTMESSAGE
+ * @var log_entry::sender_
+ *  Member 'sender_' user who sent the message
+ * @var log_entry::recipient_
+ *  Member 'recipient_' user a direct message was sent to, empty for broadcasts
+ * @var log_entry::message_
+ *  Member 'message_' message body
+ */
+struct log_entry {
+    uint64_t seq_;
+    uint64_t ns_;
+    chat_type type_;
+    std::string_view sender_;
+    std::string_view recipient_;
+    std::string_view message_;
+};
+
+/**
+ * @brief Durable append-only log of routed messages
+ *
+ * Records are copied into fixed size segment files mapped into memory, so an
+ * append is a memcpy under a short lock. A background thread flushes new
+ * records every LOG_FLUSH_MS, all at once, then commits them in the segment
+ * header, and keeps a spare segment ready so rolling over never waits on the
+ * file system. Each segment's header carries a sparse index and a bloom
+ * filter of senders, so opening the log reads headers only, and queries jump
+ * to the right part of a segment or skip it entirely.
+*/
+class message_log {
+public:
+    message_log() = default;
+
+    ~message_log() {
+        close();
+    }
+
+    message_log(const message_log&) = delete;
+    message_log& operator=(const message_log&) = delete;
+
+    bool is_open() const { return !segments_.empty(); }
+
+    /**
+     * @brief open, or create, the log in a directory and start flushing
+     * @param dir directory holding the segment files
+    */
+    void open(const std::string& dir) {
+        dir_ = dir;
+        if (::mkdir(dir_.c_str(), 0755) < 0 && errno != EEXIST) {
+            throw std::system_error(errno, std::generic_category(), "mkdir " + dir_);
+        }
+
+        DIR * d = ::opendir(dir_.c_str());
+        if (d == nullptr) {
+            throw std::system_error(errno, std::generic_category(), "opendir " + dir_);
+        }
+        std::vector<std::string> names;
+        while (dirent * e = ::readdir(d)) {
+            std::string name{e->d_name};
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".seg") == 0) {
+                names.push_back(name);
+            }
+        }
+        ::closedir(d);
+        // names are zero padded ordinals, so they sort in log order
+        std::sort(names.begin(), names.end());
+
+        for (const auto& name: names) {
+            next_ordinal_ = std::max<uint64_t>(next_ordinal_, std::strtoull(name.c_str(), nullptr, 10) + 1);
+            std::unique_ptr<segment> seg = map(dir_ + "/" + name, false);
+            const log_segment_header * h = seg->header();
+            if (h->magic_[0] == '\0') {
+                // a spare that was never used
+                ::unlink((dir_ + "/" + name).c_str());
+                continue;
+            }
+            if (memcmp(h->magic_, LOG_MAGIC, sizeof(h->magic_)) != 0 || h->version_ != LOG_VERSION ||
+                h->used_ < LOG_HEADER_BYTES || h->used_ > LOG_SEGMENT_BYTES) {
+                throw std::system_error(EINVAL, std::generic_category(), "log segment " + name);
+            }
+            seg->base_seq_ = h->base_seq_;
+            seg->next_seq_ = h->end_seq_;
+            seg->written_ = seg->flushed_ = h->used_;
+            seg->indexed_ = seg->flushed_indexed_ = h->index_count_;
+            seg->first_ns_ = h->first_ns_;
+            seg->last_ns_ = h->last_ns_;
+            segments_.push_back(std::move(seg));
+        }
+
+        if (segments_.empty()) {
+            activate(create());
+        }
+        next_seq_ = segments_.back()->next_seq_;
+
+        stop_ = false;
+        flusher_ = std::thread{[this]() { flush_loop(); }};
+    }
+
+    /**
+     * @brief flush everything appended and stop
+    */
+    void close() {
+        if (flusher_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock{mutex_};
+                stop_ = true;
+            }
+            wake_.notify_one();
+            flusher_.join();
+        }
+        segments_.clear();
+        spare_.reset();
+    }
+
+    /**
+     * @brief sequence number the next record will get
+    */
+    uint64_t next_seq() const {
+        std::lock_guard<std::mutex> lock{mutex_};
+        return next_seq_;
+    }
+
+    size_t segments() const {
+        std::lock_guard<std::mutex> lock{mutex_};
+        return segments_.size();
+    }
+
+    /**
+     * @brief append a record, flushed to disk within LOG_FLUSH_MS
+     * @param type BROADCAST or DIRECTMESSAGE
+     * @param sender user who sent the message, truncated to MAX_USERNAME_LENGTH-1 bytes
+     * @param recipient user a direct message is for, empty for broadcasts
+     * @param message body, truncated to MAX_MESSAGE_LENGTH-1 bytes
+     * @return the record's sequence number, or LOG_NO_SEQ if logging has
+     *         stopped because a new segment could not be created
+    */
+    uint64_t append(
+        chat_type type, std::string_view sender, std::string_view recipient, std::string_view message) {
+        sender = sender.substr(0, MAX_USERNAME_LENGTH - 1);
+        recipient = recipient.substr(0, MAX_USERNAME_LENGTH - 1);
+        message = message.substr(0, MAX_MESSAGE_LENGTH - 1);
+        size_t length = (sizeof(log_record_header) + sender.length() + recipient.length() +
+            message.length() + 7) & ~size_t{7};
+        uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+
+        std::lock_guard<std::mutex> lock{mutex_};
+        if (failed_) {
+            return LOG_NO_SEQ;
+        }
+        segment * seg = segments_.back().get();
+        if (seg->written_ + length > LOG_SEGMENT_BYTES) {
+            try {
+                seg = roll();
+            }
+            catch (std::system_error& ex) {
+                // a full disk is no reason to stop chatting, so stop logging
+                fprintf(stderr, "log: %s, no longer logging\n", ex.what());
+                failed_ = true;
+                return LOG_NO_SEQ;
+            }
+        }
+
+        log_record_header h{};
+        h.seq_ = next_seq_;
+        h.ns_ = ns;
+        h.length_ = static_cast<uint32_t>(length);
+        h.message_length_ = static_cast<uint16_t>(message.length());
+        h.type_ = static_cast<uint8_t>(type);
+        h.sender_length_ = static_cast<uint8_t>(sender.length());
+        h.recipient_length_ = static_cast<uint8_t>(recipient.length());
+        char * at = seg->base_ + seg->written_;
+        memcpy(at, &h, sizeof(h));
+        at += sizeof(h);
+        memcpy(at, sender.data(), sender.length());
+        at += sender.length();
+        memcpy(at, recipient.data(), recipient.length());
+        at += recipient.length();
+        memcpy(at, message.data(), message.length());
+
+        log_segment_header * header = seg->header();
+        if (seg->indexed_ == 0 || (seg->written_ - LOG_HEADER_BYTES) / LOG_INDEX_BYTES >= seg->indexed_) {
+            header->index_[seg->indexed_++] = log_index_entry{next_seq_, ns, seg->written_};
+        }
+        size_t h1, h2;
+        bloom_bits(sender, h1, h2);
+        header->bloom_[h1 / 8] |= static_cast<uint8_t>(1 << (h1 % 8));
+        header->bloom_[h2 / 8] |= static_cast<uint8_t>(1 << (h2 % 8));
+
+        if (seg->first_ns_ == 0) {
+            seg->first_ns_ = ns;
+        }
+        seg->last_ns_ = ns;
+        seg->written_ += length;
+        seg->next_seq_++;
+        return next_seq_++;
+    }
+
+    /**
+     * @brief visit records from a sequence number onwards, oldest first
+     * @param seq first sequence number wanted
+     * @param max most records to visit
+     * @param sender only records from this user, or everyone's if empty
+     * @param accept called with each candidate log_entry, false to skip it
+     * @param visit called with each accepted log_entry, valid during the call
+     * @return number of records visited
+    */
+    template<typename Accept, typename Visit>
+    size_t since(uint64_t seq, size_t max, std::string_view sender, Accept accept, Visit visit) const {
+        std::vector<view> views = snapshot(sender);
+        // last segment starting at or before seq
+        auto it = std::upper_bound(views.begin(), views.end(), seq,
+            [](uint64_t s, const view& v) { return s < v.seg_->base_seq_; });
+        if (it != views.begin()) {
+            --it;
+        }
+
+        size_t visited = 0;
+        for (; it != views.end() && visited < max; ++it) {
+            if (it->end_seq_ <= seq) {
+                continue;
+            }
+            // start from the last index entry at or before seq
+            const log_segment_header * h = it->seg_->header();
+            size_t offset = LOG_HEADER_BYTES;
+            auto entry = std::upper_bound(h->index_, h->index_ + it->indexed_, seq,
+                [](uint64_t s, const log_index_entry& e) { return s < e.seq_; });
+            if (entry != h->index_) {
+                offset = (entry - 1)->offset_;
+            }
+            scan(*it, offset, it->written_, [&](const log_entry& e) {
+                if (visited < max && e.seq_ >= seq && matches(e, sender) && accept(e)) {
+                    visit(e);
+                    visited++;
+                }
+                return visited < max;
+            });
+        }
+        return visited;
+    }
+
+    /**
+     * @brief visit the most recent records, oldest first
+     * @param n most records to visit
+     * @param sender only records from this user, or everyone's if empty
+     * @param accept called with each candidate log_entry, false to skip it
+     * @param visit called with each accepted log_entry, valid during the call
+     * @return number of records visited
+    */
+    template<typename Accept, typename Visit>
+    size_t last(size_t n, std::string_view sender, Accept accept, Visit visit) const {
+        std::vector<view> views = snapshot(sender);
+        std::vector<log_entry> found;
+        std::vector<log_entry> block;
+        // newest segment first, and within it newest index block first
+        for (auto it = views.rbegin(); it != views.rend() && found.size() < n; ++it) {
+            const log_segment_header * h = it->seg_->header();
+            for (size_t i = it->indexed_; i > 0 && found.size() < n; i--) {
+                size_t end = i < it->indexed_ ? h->index_[i].offset_ : it->written_;
+                block.clear();
+                scan(*it, h->index_[i - 1].offset_, end, [&](const log_entry& e) {
+                    if (matches(e, sender) && accept(e)) {
+                        block.push_back(e);
+                    }
+                    return true;
+                });
+                for (auto e = block.rbegin(); e != block.rend() && found.size() < n; ++e) {
+                    found.push_back(*e);
+                }
+            }
+        }
+        for (auto e = found.rbegin(); e != found.rend(); ++e) {
+            visit(*e);
+        }
+        return found.size();
+    }
+
+private:
+    struct segment {
+        std::string path_;
+        int fd_ = -1;
+        char * base_ = nullptr;
+        // advanced by append, under the mutex
+        uint64_t base_seq_ = 0;
+        uint64_t next_seq_ = 0;
+        size_t written_ = LOG_HEADER_BYTES;
+        uint32_t indexed_ = 0;
+        uint64_t first_ns_ = 0;
+        uint64_t last_ns_ = 0;
+        // advanced by the flusher
+        size_t flushed_ = LOG_HEADER_BYTES;
+        uint32_t flushed_indexed_ = 0;
+
+        log_segment_header * header() const { return reinterpret_cast<log_segment_header*>(base_); }
+
+        ~segment() {
+            if (base_ != nullptr) {
+                ::munmap(base_, LOG_SEGMENT_BYTES);
+            }
+            if (fd_ >= 0) {
+                ::close(fd_);
+            }
+        }
+    };
+
+    // what a query may read of a segment, taken under the mutex
+    struct view {
+        const segment * seg_;
+        uint64_t end_seq_;
+        size_t written_;
+        uint32_t indexed_;
+    };
+
+    // a segment's records and header fields to flush, taken under the mutex
+    struct dirty {
+        segment * seg_;
+        size_t from_;
+        size_t to_;
+        uint64_t end_seq_;
+        uint32_t indexed_;
+        uint64_t first_ns_;
+        uint64_t last_ns_;
+    };
+
+    static std::unique_ptr<segment> map(const std::string& path, bool create) {
+        auto seg = std::make_unique<segment>();
+        seg->path_ = path;
+        seg->fd_ = ::open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+        if (seg->fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "open " + path);
+        }
+        if (create && ::ftruncate(seg->fd_, LOG_SEGMENT_BYTES) < 0) {
+            throw std::system_error(errno, std::generic_category(), "ftruncate " + path);
+        }
+        struct stat st;
+        if (::fstat(seg->fd_, &st) < 0 || st.st_size != LOG_SEGMENT_BYTES) {
+            throw std::system_error(EINVAL, std::generic_category(), "log segment size " + path);
+        }
+        void * base = ::mmap(nullptr, LOG_SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd_, 0);
+        if (base == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "mmap " + path);
+        }
+        seg->base_ = static_cast<char*>(base);
+        return seg;
+    }
+
+    /**
+     * @brief a new, unused segment file, the mutex held or before the flusher starts
+    */
+    std::unique_ptr<segment> create() {
+        return map(segment_path(next_ordinal_++), true);
+    }
+
+    std::string segment_path(uint64_t ordinal) const {
+        char name[32];
+        snprintf(name, sizeof(name), "/%020llu.seg", static_cast<unsigned long long>(ordinal));
+        return dir_ + name;
+    }
+
+    /**
+     * @brief start appending to seg, the mutex held or before the flusher starts
+    */
+    void activate(std::unique_ptr<segment> seg) {
+        log_segment_header * h = seg->header();
+        h->version_ = LOG_VERSION;
+        h->base_seq_ = h->end_seq_ = next_seq_;
+        h->used_ = LOG_HEADER_BYTES;
+        seg->base_seq_ = seg->next_seq_ = next_seq_;
+        memcpy(h->magic_, LOG_MAGIC, sizeof(h->magic_));
+        segments_.push_back(std::move(seg));
+    }
+
+    /**
+     * @brief move appends on to a fresh segment, the mutex held
+    */
+    segment * roll() {
+        if (!spare_) {
+            // the flusher has not caught up, so pay for the file here
+            spare_ = create();
+        }
+        activate(std::move(spare_));
+        wake_.notify_one();
+        return segments_.back().get();
+    }
+
+    /**
+     * @brief segments that may hold records from sender, all if it is empty
+    */
+    std::vector<view> snapshot(std::string_view sender) const {
+        std::lock_guard<std::mutex> lock{mutex_};
+        std::vector<view> views;
+        views.reserve(segments_.size());
+        for (const auto& seg: segments_) {
+            // append sets bloom bits under the mutex, so they are read under it
+            if (maybe_from(*seg, sender)) {
+                views.push_back(view{seg.get(), seg->next_seq_, seg->written_, seg->indexed_});
+            }
+        }
+        return views;
+    }
+
+    // FNV-1a, split into two bloom filter bit positions
+    static void bloom_bits(std::string_view name, size_t& h1, size_t& h2) {
+        uint64_t h = 14695981039346656037ULL;
+        for (char c: name) {
+            h = (h ^ static_cast<uint8_t>(c)) * 1099511628211ULL;
+        }
+        h1 = static_cast<size_t>(h % (LOG_BLOOM_BYTES * 8));
+        h2 = static_cast<size_t>((h >> 32) % (LOG_BLOOM_BYTES * 8));
+    }
+
+    static bool maybe_from(const segment& seg, std::string_view sender) {
+        if (sender.empty()) {
+            return true;
+        }
+        size_t h1, h2;
+        bloom_bits(sender, h1, h2);
+        const uint8_t * bloom = seg.header()->bloom_;
+        return (bloom[h1 / 8] & (1 << (h1 % 8))) && (bloom[h2 / 8] & (1 << (h2 % 8)));
+    }
+
+    static bool matches(const log_entry& e, std::string_view sender) {
+        return sender.empty() || e.sender_ == sender;
+    }
+
+    /**
+     * @brief call f with each record starting in [from, to) until it returns false
+    */
+    template<typename F>
+    static void scan(const view& v, size_t from, size_t to, F f) {
+        const char * base = v.seg_->base_;
+        for (size_t offset = from; offset < to;) {
+            log_record_header h;
+            memcpy(&h, base + offset, sizeof(h));
+            const char * at = base + offset + sizeof(h);
+            log_entry e{h.seq_, h.ns_, static_cast<chat_type>(h.type_),
+                std::string_view{at, h.sender_length_},
+                std::string_view{at + h.sender_length_, h.recipient_length_},
+                std::string_view{at + h.sender_length_ + h.recipient_length_, h.message_length_}};
+            if (!f(e)) {
+                return;
+            }
+            offset += h.length_;
+        }
+    }
+
+    void flush_loop() {
+        std::unique_lock<std::mutex> lock{mutex_};
+        for (;;) {
+            bool stopping = stop_;
+            std::vector<dirty> work;
+            for (const auto& seg: segments_) {
+                if (seg->flushed_ < seg->written_ || seg->flushed_indexed_ < seg->indexed_) {
+                    work.push_back(dirty{seg.get(), seg->flushed_, seg->written_, seg->next_seq_,
+                        seg->indexed_, seg->first_ns_, seg->last_ns_});
+                }
+            }
+            bool need_spare = !spare_;
+            lock.unlock();
+
+            // records first, then the header that commits them
+            size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+            for (const auto& d: work) {
+                size_t from = d.from_ / page * page;
+                ::msync(d.seg_->base_ + from, d.to_ - from, MS_SYNC);
+                log_segment_header * h = d.seg_->header();
+                h->end_seq_ = d.end_seq_;
+                h->used_ = d.to_;
+                h->index_count_ = d.indexed_;
+                h->first_ns_ = d.first_ns_;
+                h->last_ns_ = d.last_ns_;
+                ::msync(d.seg_->base_, LOG_HEADER_BYTES, MS_SYNC);
+            }
+            std::unique_ptr<segment> spare;
+            if (need_spare && !stopping) {
+                try {
+                    spare = create_unlocked();
+                }
+                catch (std::system_error& ex) {
+                    // roll will try again, and stop logging if it fails too
+                    fprintf(stderr, "log: %s\n", ex.what());
+                }
+            }
+
+            lock.lock();
+            for (const auto& d: work) {
+                d.seg_->flushed_ = d.to_;
+                d.seg_->flushed_indexed_ = d.indexed_;
+            }
+            if (spare && !spare_) {
+                spare_ = std::move(spare);
+            }
+            if (stopping) {
+                return;
+            }
+            wake_.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_MS));
+        }
+    }
+
+    /**
+     * @brief create a spare segment without holding the mutex for the file system calls
+    */
+    std::unique_ptr<segment> create_unlocked() {
+        uint64_t ordinal;
+        {
+            std::lock_guard<std::mutex> lock{mutex_};
+            ordinal = next_ordinal_++;
+        }
+        return map(segment_path(ordinal), true);
+    }
+
+    std::string dir_;
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    std::thread flusher_;
+    bool stop_ = false;
+    // set once a new segment could not be created, appends are dropped
+    bool failed_ = false;
+    std::vector<std::unique_ptr<segment>> segments_;
+    std::unique_ptr<segment> spare_;
+    uint64_t next_seq_ = 0;
+    uint64_t next_ordinal_ = 0;
+};
+
+}; // namespace chat
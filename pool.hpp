@@ -0,0 +1,346 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <server_io.hpp>
+
+// Blocks carved out of each slab a pool allocates
+#define POOL_SLAB_BLOCKS 64
+
+namespace chat {
+
+/**
+ * @struct pool_stats
+ * @brief Occupancy of a pool
+ * @var pool_stats::in_use_
+ *  Member 'in_use_' blocks handed out and not yet returned
+ * @var pool_stats::capacity_
+ *  Member 'capacity_' blocks in all slabs, in use or free
+ * @var pool_stats::high_water_
+ *  Member 'high_water_' most blocks in use at once
+ * @var pool_stats::slabs_
+ *  Member 'slabs_' slabs allocated from the heap
+ * @var pool_stats::block_size_
+ *  Member 'block_size_' bytes per block
+ */
+struct pool_stats {
+    uint64_t in_use_ = 0;
+    uint64_t capacity_ = 0;
+    uint64_t high_water_ = 0;
+    uint64_t slabs_ = 0;
+    uint64_t block_size_ = 0;
+
+    /**
+     * @brief bytes held in slabs
+    */
+    uint64_t bytes() const { return capacity_ * block_size_; }
+
+    /**
+     * @brief add up the pools of several workers, the high water mark of the
+     *        total is at most the sum of theirs
+    */
+    pool_stats& operator+=(const pool_stats& other) {
+        in_use_ += other.in_use_;
+        capacity_ += other.capacity_;
+        high_water_ += other.high_water_;
+        slabs_ += other.slabs_;
+        block_size_ = std::max(block_size_, other.block_size_);
+        return *this;
+    }
+};
+
+/**
+ * @brief Fixed size blocks carved out of slabs, recycled through a free list
+ *
+ * A slab of POOL_SLAB_BLOCKS blocks is allocated whenever the free list runs
+ * out, and slabs are only returned to the heap with the pool, so once a pool
+ * has grown to its working set allocating and freeing a block is a couple of
+ * pointer moves and never touches the general purpose heap. Not synchronised.
+*/
+class slab_pool {
+public:
+    /**
+     * @param block_size bytes per block, 0 to take the size of the first
+     *        object allocated through a pool_allocator
+     * @param slab_blocks blocks per slab
+    */
+    explicit slab_pool(size_t block_size = 0, size_t slab_blocks = POOL_SLAB_BLOCKS) :
+        slab_blocks_{slab_blocks > 0 ? slab_blocks : 1} {
+        stats_.block_size_ = block_size;
+    }
+
+    slab_pool(const slab_pool&) = delete;
+    slab_pool& operator=(const slab_pool&) = delete;
+
+    size_t block_size() const { return stats_.block_size_; }
+
+    const pool_stats& stats() const { return stats_; }
+
+    /**
+     * @brief check if blocks hold objects of a size and alignment, sizing
+     *        the blocks for them if nothing has been allocated yet
+    */
+    bool holds(size_t size, size_t alignment) {
+        if (stats_.block_size_ == 0) {
+            stats_.block_size_ = size;
+        }
+        return size == stats_.block_size_ && alignment <= alignof(std::max_align_t);
+    }
+
+    /**
+     * @brief take a block, growing the pool by a slab if none are free
+    */
+    void * allocate() {
+        if (free_ == nullptr) {
+            grow();
+        }
+        free_block * block = free_;
+        free_ = block->next_;
+        stats_.in_use_++;
+        stats_.high_water_ = std::max(stats_.high_water_, stats_.in_use_);
+        return block;
+    }
+
+    /**
+     * @brief return a block taken from this pool
+    */
+    void deallocate(void * p) {
+        free_block * block = static_cast<free_block*>(p);
+        block->next_ = free_;
+        free_ = block;
+        stats_.in_use_--;
+    }
+
+private:
+    struct free_block {
+        free_block * next_;
+    };
+
+    void grow() {
+        // round blocks up so every block stays aligned for any type
+        size_t unit = sizeof(std::max_align_t);
+        size_t stride = (std::max(stats_.block_size_, sizeof(free_block)) + unit - 1) / unit;
+        slabs_.emplace_back(new std::max_align_t[stride * slab_blocks_]);
+        std::max_align_t * slab = slabs_.back().get();
+        // link the blocks so they are handed out in address order
+        for (size_t i = slab_blocks_; i-- > 0;) {
+            free_block * block = reinterpret_cast<free_block*>(slab + i * stride);
+            block->next_ = free_;
+            free_ = block;
+        }
+        stats_.capacity_ += slab_blocks_;
+        stats_.slabs_++;
+    }
+
+    size_t slab_blocks_;
+    free_block * free_ = nullptr;
+    std::vector<std::unique_ptr<std::max_align_t[]>> slabs_;
+    pool_stats stats_;
+};
+
+/**
+ * @brief Objects of one type, constructed in blocks of a slab_pool
+*/
+template<typename T>
+class object_pool {
+public:
+    explicit object_pool(size_t slab_blocks = POOL_SLAB_BLOCKS) : pool_{sizeof(T), slab_blocks} {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "over aligned pool object");
+    }
+
+    const pool_stats& stats() const { return pool_.stats(); }
+
+    template<typename... Args>
+    T * create(Args&&... args) {
+        void * block = pool_.allocate();
+        return new (block) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T * object) {
+        object->~T();
+        pool_.deallocate(object);
+    }
+
+private:
+    slab_pool pool_;
+};
+
+/**
+ * @brief Allocator placing single objects, such as the nodes of a node
+ *        based container, in a slab_pool
+ *
+ * Arrays, like a hash table's buckets, still come from the heap, but they
+ * only grow with the container, not with every insert.
+*/
+template<typename T>
+class pool_allocator {
+public:
+    typedef T value_type;
+
+    explicit pool_allocator(slab_pool& pool) : pool_{&pool} {}
+
+    template<typename U>
+    pool_allocator(const pool_allocator<U>& other) : pool_{other.pool()} {}
+
+    slab_pool * pool() const { return pool_; }
+
+    T * allocate(size_t n) {
+        if (n == 1 && pool_->holds(sizeof(T), alignof(T))) {
+            return static_cast<T*>(pool_->allocate());
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T * p, size_t n) {
+        if (n == 1 && pool_->holds(sizeof(T), alignof(T))) {
+            pool_->deallocate(p);
+            return;
+        }
+        ::operator delete(p);
+    }
+
+    template<typename U>
+    bool operator==(const pool_allocator<U>& other) const { return pool_ == other.pool(); }
+
+    template<typename U>
+    bool operator!=(const pool_allocator<U>& other) const { return pool_ != other.pool(); }
+
+private:
+    slab_pool * pool_;
+};
+
+/**
+ * @brief Hash map keyed by a client's IP:PORT, with its nodes in a slab_pool
+*/
+template<typename V>
+using address_map = std::unordered_map<
+    uint64_t, V, std::hash<uint64_t>, std::equal_to<uint64_t>,
+    pool_allocator<std::pair<const uint64_t, V>>>;
+
+/**
+ * @brief key of a client's IP:PORT in an address_map
+*/
+inline uint64_t address_key(const sockaddr_in& address) {
+    return (static_cast<uint64_t>(address.sin_addr.s_addr) << 16) | address.sin_port;
+}
+
+/**
+ * @struct packet_buffer
+ * @brief A datagram held until it can be sent, linked into a packet_queue
+ * @var packet_buffer::next_
+ *  Member 'next_' next datagram in its queue
+ * @var packet_buffer::length_
+ *  Member 'length_' number of bytes used in data_
+ * @var packet_buffer::data_
+ *  Member 'data_' datagram bytes
+ */
+struct packet_buffer {
+    packet_buffer * next_;
+    size_t length_;
+    char data_[MAX_DATAGRAM_LENGTH];
+};
+
+/**
+ * @brief Reusable buffers for datagrams that outlive the batch they were
+ *        sent in
+*/
+class packet_pool {
+public:
+    explicit packet_pool(size_t slab_blocks = POOL_SLAB_BLOCKS) : pool_{slab_blocks} {}
+
+    const pool_stats& stats() const { return pool_.stats(); }
+
+    /**
+     * @brief copy a datagram, header then payload, into a buffer
+     * @param header bytes to send ahead of the payload
+     * @param header_length number of header bytes
+     * @param data payload
+     * @param length number of payload bytes, with header_length at most MAX_DATAGRAM_LENGTH
+    */
+    packet_buffer * acquire(const char * header, size_t header_length, const char * data, size_t length) {
+        packet_buffer * packet = pool_.create();
+        packet->next_ = nullptr;
+        if (header_length > 0) {
+            memcpy(packet->data_, header, header_length);
+        }
+        memcpy(packet->data_ + header_length, data, length);
+        packet->length_ = header_length + length;
+        return packet;
+    }
+
+    packet_buffer * acquire(const char * data, size_t length) {
+        return acquire(nullptr, 0, data, length);
+    }
+
+    void release(packet_buffer * packet) {
+        pool_.destroy(packet);
+    }
+
+private:
+    object_pool<packet_buffer> pool_;
+};
+
+/**
+ * @brief First in first out queue of pooled datagrams, linked through the
+ *        buffers so queuing never allocates
+*/
+class packet_queue {
+public:
+    bool empty() const { return head_ == nullptr; }
+    size_t size() const { return size_; }
+
+    packet_buffer * front() const { return head_; }
+
+    void push_back(packet_buffer * packet) {
+        packet->next_ = nullptr;
+        if (tail_ != nullptr) {
+            tail_->next_ = packet;
+        }
+        else {
+            head_ = packet;
+        }
+        tail_ = packet;
+        size_++;
+    }
+
+    /**
+     * @brief unlink the oldest datagram, for the caller to release
+    */
+    packet_buffer * pop_front() {
+        packet_buffer * packet = head_;
+        head_ = packet->next_;
+        if (head_ == nullptr) {
+            tail_ = nullptr;
+        }
+        size_--;
+        return packet;
+    }
+
+    /**
+     * @brief release every queued datagram
+    */
+    void clear(packet_pool& packets) {
+        while (!empty()) {
+            packets.release(pop_front());
+        }
+    }
+
+private:
+    packet_buffer * head_ = nullptr;
+    packet_buffer * tail_ = nullptr;
+    size_t size_ = 0;
+};
+
+}; // namespace chat
@@ -0,0 +1,695 @@
+#pragma once
+
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <vector>
+
+#include <chat_ex2.hpp>
+#include <pool.hpp>
+#include <server_io.hpp>
+
+//---------------------------------------------------------------------------------------
+// Optional reliable delivery
+//
+// A peer that wants reliable delivery wraps every packet it sends in a small
+// envelope carrying a per peer sequence number. The other side acknowledges
+// each one with the next sequence number it expects (cumulative) and a
+// bitmap of the 32 after that it already has (selective), and drops any
+// duplicate. Up to RELIABLE_WINDOW packets are outstanding at once and each
+// is retransmitted, with exponential backoff, until acknowledged. Packets are
+// delivered as they arrive rather than held back for ones missing before
+// them. A side starts wrapping replies once it receives an envelope from a
+// peer, so nothing changes for peers that never send one.
+//
+//   DATA, SYN:  | 0xC8 | kind | sequence u32 | packet (compact frame or legacy packet)
+//   ACK:        | 0xC8 | kind | cumulative u32 | selective u32 |
+//
+// SYN is DATA sent before anything has been acknowledged. Until then a sender
+// keeps one packet outstanding, so the receiver can start counting from the
+// first SYN it sees and recognise a restarted peer by a SYN far from the
+// sequence numbers it was expecting.
+
+#define RELIABLE_MAGIC          0xC8
+#define RELIABLE_HEADER_LENGTH  6
+#define RELIABLE_ACK_LENGTH     10
+
+// Packets outstanding per peer
+#define RELIABLE_WINDOW         64
+
+// Packets queued per peer while the window is full, the oldest are dropped beyond this
+#define RELIABLE_BACKLOG        1024
+
+// Retransmit timeout before any round trip has been measured, and its bounds
+#define RELIABLE_RTO_MS         200
+#define RELIABLE_MIN_RTO_MS     20
+#define RELIABLE_MAX_RTO_MS     2000
+
+// Transmissions of a packet before the peer is given up on
+#define RELIABLE_MAX_RETRIES    8
+
+// How often retransmit timers are checked
+#define RELIABLE_TICK_MS        20
+
+// Peers heard nothing from, with nothing outstanding, are forgotten after this long
+#define RELIABLE_IDLE_MS        60000
+
+namespace chat {
+
+enum reliable_kind {
+    RELIABLE_DATA = 0,
+    RELIABLE_SYN,
+    RELIABLE_ACK,
+};
+
+/**
+ * @brief monotonic time in nanoseconds, for retransmit timers
+*/
+inline uint64_t monotonic_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline void put_u32(char * buffer, uint32_t value) {
+    value = htonl(value);
+    memcpy(buffer, &value, sizeof(value));
+}
+
+inline uint32_t get_u32(const char * buffer) {
+    uint32_t value;
+    memcpy(&value, buffer, sizeof(value));
+    return ntohl(value);
+}
+
+/**
+ * @struct reliable_envelope
+ * @brief A received envelope
+ * @var reliable_envelope::kind_
+ *  Member 'kind_' DATA, SYN or ACK
+ * @var reliable_envelope::sequence_
+ *  Member 'sequence_' sequence number of DATA and SYN, next expected sequence number of ACK
+ * @var reliable_envelope::selective_
+ *  Member 'selective_' ACK only, bit i set if sequence_ + 1 + i has been received
+ * @var reliable_envelope::payload_
+ *  Member 'payload_' DATA and SYN only, the wrapped packet
+ * @var reliable_envelope::length_
+ *  Member 'length_' length of payload_
+ */
+struct reliable_envelope {
+    reliable_kind kind_;
+    uint32_t sequence_;
+    uint32_t selective_;
+    const char * payload_;
+    size_t length_;
+};
+
+/**
+ * @brief check if a received datagram is wrapped in an envelope
+*/
+inline bool is_reliable(const char * buffer, size_t length) {
+    return length > 0 && static_cast<uint8_t>(buffer[0]) == RELIABLE_MAGIC;
+}
+
+/**
+ * @brief Parse a received envelope
+ * @param buffer received bytes
+ * @param length number of bytes received
+ * @param envelope parsed envelope, payload_ refers into buffer
+ * @return true if well formed, otherwise false
+*/
+inline bool parse_reliable(const char * buffer, size_t length, reliable_envelope& envelope) {
+    if (!is_reliable(buffer, length) || length < RELIABLE_HEADER_LENGTH) {
+        return false;
+    }
+    envelope.kind_ = static_cast<reliable_kind>(buffer[1]);
+    envelope.sequence_ = get_u32(buffer + 2);
+    switch (envelope.kind_) {
+        case RELIABLE_DATA:
+        case RELIABLE_SYN:
+            envelope.selective_ = 0;
+            envelope.payload_ = buffer + RELIABLE_HEADER_LENGTH;
+            envelope.length_ = length - RELIABLE_HEADER_LENGTH;
+            return envelope.length_ > 0;
+        case RELIABLE_ACK:
+            if (length != RELIABLE_ACK_LENGTH) {
+                return false;
+            }
+            envelope.selective_ = get_u32(buffer + RELIABLE_HEADER_LENGTH);
+            envelope.payload_ = nullptr;
+            envelope.length_ = 0;
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @struct reliable_stats
+ * @brief Counters for the reliability layer
+ * @var reliable_stats::retransmits_
+ *  Member 'retransmits_' packets sent again after their timer expired
+ * @var reliable_stats::duplicates_
+ *  Member 'duplicates_' packets received that had already been received
+ * @var reliable_stats::backlog_drops_
+ *  Member 'backlog_drops_' packets dropped because a peer's backlog was full
+ * @var reliable_stats::peers_lost_
+ *  Member 'peers_lost_' peers given up on after RELIABLE_MAX_RETRIES transmissions
+ */
+struct reliable_stats {
+    uint64_t retransmits_ = 0;
+    uint64_t duplicates_ = 0;
+    uint64_t backlog_drops_ = 0;
+    uint64_t peers_lost_ = 0;
+};
+
+/**
+ * @brief Sending half of a reliable peer: sequence numbers, the window of
+ *        unacknowledged packets and their retransmit timers
+ *
+ * Packets are handed to an emit callback,
+ * emit(const char * header, size_t header_length, const char * payload, size_t length),
+ * which does the actual sending. Copies of unacknowledged and backlogged
+ * packets are kept in buffers from a packet_pool, returned as soon as they
+ * are acknowledged.
+*/
+class reliable_sender {
+public:
+    /**
+     * @param packets pool for copies of outstanding packets, outliving the sender
+     * @param initial_sequence sequence number of the first packet
+    */
+    explicit reliable_sender(packet_pool& packets, uint32_t initial_sequence = 0) :
+        packets_{packets},
+        base_{initial_sequence},
+        next_{initial_sequence} {
+    }
+
+    reliable_sender(const reliable_sender&) = delete;
+    reliable_sender& operator=(const reliable_sender&) = delete;
+
+    ~reliable_sender() {
+        release();
+    }
+
+    size_t in_flight() const { return next_ - base_; }
+
+    /**
+     * @brief forget everything outstanding, for a peer that has restarted
+    */
+    void restart() {
+        release();
+        base_ = next_;
+        established_ = false;
+    }
+
+    /**
+     * @brief send a packet, or queue it if the window is full
+    */
+    template<typename Emit>
+    void send(const char * data, size_t length, uint64_t now, reliable_stats& stats, Emit emit) {
+        if (in_flight() >= window() || !backlog_.empty()) {
+            if (backlog_.size() >= RELIABLE_BACKLOG) {
+                packets_.release(backlog_.pop_front());
+                stats.backlog_drops_++;
+            }
+            backlog_.push_back(packets_.acquire(data, length));
+            return;
+        }
+        transmit(data, length, now, emit);
+    }
+
+    /**
+     * @brief apply an ACK, then send what the window has room for
+    */
+    template<typename Emit>
+    void acknowledge(uint32_t cumulative, uint32_t selective, uint64_t now, Emit emit) {
+        // ignore ACKs for sequence numbers never sent
+        if (cumulative - base_ > in_flight()) {
+            return;
+        }
+        for (uint32_t seq = base_; seq != cumulative; seq++) {
+            acked(seq, now);
+        }
+        for (uint32_t i = 0; i < 32; i++) {
+            uint32_t seq = cumulative + 1 + i;
+            if ((selective & (1u << i)) && seq - base_ < in_flight()) {
+                acked(seq, now);
+            }
+        }
+        established_ = true;
+
+        while (base_ != next_ && slot(base_).acked_) {
+            base_++;
+        }
+        while (!backlog_.empty() && in_flight() < window()) {
+            packet_buffer * packet = backlog_.pop_front();
+            packet_slot& s = slot(next_);
+            s.sent_ns_ = now;
+            s.retries_ = 0;
+            s.acked_ = false;
+            s.payload_ = packet;
+            emit_slot(next_++, emit);
+        }
+    }
+
+    /**
+     * @brief retransmit packets whose timer has expired
+     * @return false if a packet has been sent RELIABLE_MAX_RETRIES times, so
+     *         the peer should be given up on, otherwise true
+    */
+    template<typename Emit>
+    bool poll(uint64_t now, reliable_stats& stats, Emit emit) {
+        for (uint32_t seq = base_; seq != next_; seq++) {
+            packet_slot& s = slot(seq);
+            if (s.acked_ || now - s.sent_ns_ < timeout(s.retries_)) {
+                continue;
+            }
+            if (s.retries_ + 1 >= RELIABLE_MAX_RETRIES) {
+                return false;
+            }
+            s.retries_++;
+            s.sent_ns_ = now;
+            stats.retransmits_++;
+            emit_slot(seq, emit);
+        }
+        return true;
+    }
+
+private:
+    struct packet_slot {
+        uint64_t sent_ns_ = 0;
+        uint32_t retries_ = 0;
+        bool acked_ = true;
+        packet_buffer * payload_ = nullptr;
+    };
+
+    packet_slot& slot(uint32_t seq) { return slots_[seq % RELIABLE_WINDOW]; }
+
+    /**
+     * @brief one packet at a time until the peer has acknowledged something
+    */
+    size_t window() const { return established_ ? RELIABLE_WINDOW : 1; }
+
+    uint64_t timeout(uint32_t retries) const {
+        uint64_t rto = rto_ns_ << (retries < 6 ? retries : 6);
+        return rto < RELIABLE_MAX_RTO_MS * 1000000ULL ? rto : RELIABLE_MAX_RTO_MS * 1000000ULL;
+    }
+
+    void encode_header(char * header, uint32_t seq) const {
+        header[0] = static_cast<char>(RELIABLE_MAGIC);
+        header[1] = established_ ? RELIABLE_DATA : RELIABLE_SYN;
+        put_u32(header + 2, seq);
+    }
+
+    template<typename Emit>
+    void transmit(const char * data, size_t length, uint64_t now, Emit emit) {
+        packet_slot& s = slot(next_);
+        s.sent_ns_ = now;
+        s.retries_ = 0;
+        s.acked_ = false;
+        s.payload_ = packets_.acquire(data, length);
+        emit_slot(next_++, emit);
+    }
+
+    template<typename Emit>
+    void emit_slot(uint32_t seq, Emit emit) {
+        const packet_slot& s = slot(seq);
+        char header[RELIABLE_HEADER_LENGTH];
+        encode_header(header, seq);
+        emit(header, sizeof(header), s.payload_->data_, s.payload_->length_);
+    }
+
+    /**
+     * @brief return every outstanding and backlogged packet to the pool
+    */
+    void release() {
+        for (auto& s: slots_) {
+            if (s.payload_ != nullptr) {
+                packets_.release(s.payload_);
+                s.payload_ = nullptr;
+            }
+            s.acked_ = true;
+        }
+        backlog_.clear(packets_);
+    }
+
+    void acked(uint32_t seq, uint64_t now) {
+        packet_slot& s = slot(seq);
+        if (s.acked_) {
+            return;
+        }
+        s.acked_ = true;
+        packets_.release(s.payload_);
+        s.payload_ = nullptr;
+        // only time packets sent once, a retransmitted one is ambiguous
+        if (s.retries_ == 0) {
+            sample_rtt(now - s.sent_ns_);
+        }
+    }
+
+    // RFC 6298 smoothed round trip time
+    void sample_rtt(uint64_t rtt) {
+        if (srtt_ns_ == 0) {
+            srtt_ns_ = rtt;
+            rttvar_ns_ = rtt / 2;
+        }
+        else {
+            uint64_t delta = rtt > srtt_ns_ ? rtt - srtt_ns_ : srtt_ns_ - rtt;
+            rttvar_ns_ = (3 * rttvar_ns_ + delta) / 4;
+            srtt_ns_ = (7 * srtt_ns_ + rtt) / 8;
+        }
+        rto_ns_ = srtt_ns_ + 4 * rttvar_ns_;
+        if (rto_ns_ < RELIABLE_MIN_RTO_MS * 1000000ULL) {
+            rto_ns_ = RELIABLE_MIN_RTO_MS * 1000000ULL;
+        }
+    }
+
+    packet_pool& packets_;
+    uint32_t base_;
+    uint32_t next_;
+    bool established_ = false;
+    packet_slot slots_[RELIABLE_WINDOW];
+    packet_queue backlog_;
+    uint64_t srtt_ns_ = 0;
+    uint64_t rttvar_ns_ = 0;
+    uint64_t rto_ns_ = RELIABLE_RTO_MS * 1000000ULL;
+};
+
+/**
+ * @brief Receiving half of a reliable peer: which sequence numbers have
+ *        arrived, to drop duplicates and build ACKs
+*/
+class reliable_receiver {
+public:
+    /**
+     * @brief check if a packet is the first from a peer, or a SYN from one
+     *        that has restarted
+    */
+    bool restarted(uint32_t seq, bool syn) const {
+        int32_t distance = static_cast<int32_t>(seq - expected_);
+        return !started_ || (syn && (distance < -2 * RELIABLE_WINDOW || distance > RELIABLE_WINDOW));
+    }
+
+    /**
+     * @brief record a received packet
+     * @return true if it has not been received before, otherwise false
+    */
+    bool accept(uint32_t seq, bool syn) {
+        if (restarted(seq, syn)) {
+            started_ = true;
+            expected_ = seq + 1;
+            received_ = 0;
+            return true;
+        }
+        int32_t distance = static_cast<int32_t>(seq - expected_);
+        if (distance < 0 || distance > 64) {
+            // already received, or too far ahead to track so wait for a retransmit
+            return false;
+        }
+        if (distance == 0) {
+            expected_++;
+            while (received_ & 1) {
+                received_ >>= 1;
+                expected_++;
+            }
+            received_ >>= 1;
+            return true;
+        }
+        uint64_t bit = uint64_t{1} << (distance - 1);
+        if (received_ & bit) {
+            return false;
+        }
+        received_ |= bit;
+        return true;
+    }
+
+    /**
+     * @brief encode an ACK for everything received so far
+     * @param buffer at least RELIABLE_ACK_LENGTH bytes
+    */
+    void encode_ack(char * buffer) const {
+        buffer[0] = static_cast<char>(RELIABLE_MAGIC);
+        buffer[1] = RELIABLE_ACK;
+        put_u32(buffer + 2, expected_);
+        put_u32(buffer + RELIABLE_HEADER_LENGTH, static_cast<uint32_t>(received_));
+    }
+
+private:
+    bool started_ = false;
+    // next sequence number expected
+    uint32_t expected_ = 0;
+    // bit i set if expected_ + 1 + i has been received
+    uint64_t received_ = 0;
+};
+
+/**
+ * @brief Both halves of the reliable link with one peer
+*/
+struct reliable_peer {
+    explicit reliable_peer(packet_pool& packets, uint32_t initial_sequence = 0) :
+        sender_{packets, initial_sequence} {
+    }
+
+    /**
+     * @brief handle a received envelope
+     * @param envelope as parsed by parse_reliable
+     * @param now monotonic time
+     * @param stats counters to update
+     * @param emit sends ACKs, and packets the window now has room for
+     * @return true if envelope carries a new packet to deliver, otherwise false
+    */
+    template<typename Emit>
+    bool receive(const reliable_envelope& envelope, uint64_t now, reliable_stats& stats, Emit emit) {
+        last_heard_ns_ = now;
+        if (envelope.kind_ == RELIABLE_ACK) {
+            sender_.acknowledge(envelope.sequence_, envelope.selective_, now, emit);
+            return false;
+        }
+
+        bool syn = envelope.kind_ == RELIABLE_SYN;
+        if (syn && receiver_.restarted(envelope.sequence_, syn)) {
+            // packets outstanding to the peer's old session will never be acknowledged
+            sender_.restart();
+        }
+        bool fresh = receiver_.accept(envelope.sequence_, syn);
+        if (!fresh) {
+            stats.duplicates_++;
+        }
+        // acknowledge duplicates too, the earlier ACK may have been lost
+        char ack[RELIABLE_ACK_LENGTH];
+        receiver_.encode_ack(ack);
+        emit(ack, sizeof(ack), nullptr, 0);
+        return fresh;
+    }
+
+    reliable_sender sender_;
+    reliable_receiver receiver_;
+    uint64_t last_heard_ns_ = 0;
+};
+
+/**
+ * @brief Emit callback that queues packets for one peer in an outbox, the
+ *        header carried per datagram
+*/
+struct outbox_emitter {
+    outbox& out_;
+    sockaddr_in address_;
+
+    void operator()(const char * header, size_t header_length, const char * payload, size_t length) {
+        out_.send(payload, length, address_);
+        out_.set_header(out_.size() - 1, header, header_length);
+    }
+};
+
+/**
+ * @brief The server's reliable links, one per client that has sent it an
+ *        envelope, shared by all workers
+ *
+ * Peers, the index of them and the copies of their outstanding packets are
+ * all pooled, so clients coming and going cost no heap allocation once the
+ * pools have grown to the working set.
+*/
+class reliable_peers {
+public:
+    enum result {
+        PLAIN,      // not an envelope, handle as is
+        DELIVER,    // new packet, handle the payload
+        CONSUMED,   // ACK or duplicate, nothing to handle
+        MALFORMED,  // broken envelope
+    };
+
+    reliable_peers() : peers_{0, peer_map::allocator_type{nodes_}} {}
+
+    ~reliable_peers() {
+        for (auto& peer: peers_) {
+            peer_pool_.destroy(peer.second);
+        }
+    }
+
+    /**
+     * @brief handle a received datagram
+     * @param data received bytes
+     * @param length number of bytes received
+     * @param from sender's address
+     * @param now monotonic time
+     * @param out queue for ACKs and packets the window now has room for
+     * @param payload set to the wrapped packet if DELIVER
+     * @param payload_length set to the length of the wrapped packet if DELIVER
+    */
+    result receive(
+        const char * data, size_t length, const sockaddr_in& from, uint64_t now,
+        outbox& out, const char *& payload, size_t& payload_length) {
+        if (!is_reliable(data, length)) {
+            return PLAIN;
+        }
+        reliable_envelope envelope;
+        if (!parse_reliable(data, length, envelope)) {
+            return MALFORMED;
+        }
+
+        std::lock_guard<std::mutex> lock{mutex_};
+        auto it = peers_.find(address_key(from));
+        if (it == peers_.end()) {
+            if (envelope.kind_ == RELIABLE_ACK) {
+                return CONSUMED;
+            }
+            // start at a random sequence number, so a client can tell a
+            // restarted server from a late retransmit
+            it = peers_.emplace(address_key(from), peer_pool_.create(packets_, random_())).first;
+            count_.store(peers_.size(), std::memory_order_relaxed);
+        }
+        if (!it->second->receive(envelope, now, stats_, outbox_emitter{out, from})) {
+            return CONSUMED;
+        }
+        payload = envelope.payload_;
+        payload_length = envelope.length_;
+        return DELIVER;
+    }
+
+    /**
+     * @brief wrap datagrams for a peer from now on, before it has sent an
+     *        envelope, for links the server opens itself
+     * @param address of the peer
+     * @param now monotonic time
+    */
+    void connect(const sockaddr_in& address, uint64_t now) {
+        std::lock_guard<std::mutex> lock{mutex_};
+        if (peers_.find(address_key(address)) != peers_.end()) {
+            return;
+        }
+        reliable_peer * peer = peer_pool_.create(packets_, random_());
+        // counts as heard from, or it would be forgotten as idle straight away
+        peer->last_heard_ns_ = now;
+        peers_.emplace(address_key(address), peer);
+        count_.store(peers_.size(), std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief wrap datagrams queued for reliable peers, and queue any
+     *        retransmits that are due
+     *
+     * Datagrams without a header that are addressed to a reliable peer are
+     * replaced by that peer's wrapped copy, or held back if its window is full.
+     *
+     * @param out datagrams about to be sent
+     * @param now monotonic time
+    */
+    void wrap(outbox& out, uint64_t now) {
+        if (count_.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock{mutex_};
+        wrapped_.clear();
+        size_t queued = out.size();
+        for (size_t i = 0; i < queued; i++) {
+            if (out.header_length(i) > 0) {
+                continue;
+            }
+            auto it = peers_.find(address_key(out.address(i)));
+            if (it == peers_.end()) {
+                continue;
+            }
+            sockaddr_in address = out.address(i);
+            it->second->sender_.send(out.data(i), out.length(i), now, stats_, outbox_emitter{out, address});
+            wrapped_.push_back(i);
+        }
+        out.erase(wrapped_);
+
+        if (now - last_poll_ns_ >= RELIABLE_TICK_MS * 1000000ULL) {
+            last_poll_ns_ = now;
+            poll(out, now);
+        }
+    }
+
+    reliable_stats stats() {
+        std::lock_guard<std::mutex> lock{mutex_};
+        return stats_;
+    }
+
+    /**
+     * @brief occupancy of the peer records
+    */
+    pool_stats peer_stats() {
+        std::lock_guard<std::mutex> lock{mutex_};
+        return peer_pool_.stats();
+    }
+
+    /**
+     * @brief occupancy of the buffers holding outstanding packets
+    */
+    pool_stats packet_stats() {
+        std::lock_guard<std::mutex> lock{mutex_};
+        return packets_.stats();
+    }
+
+private:
+    /**
+     * @brief retransmit, and forget peers that are lost or long idle
+    */
+    void poll(outbox& out, uint64_t now) {
+        for (auto it = peers_.begin(); it != peers_.end();) {
+            reliable_peer& peer = *it->second;
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = static_cast<uint32_t>(it->first >> 16);
+            address.sin_port = static_cast<uint16_t>(it->first & 0xFFFF);
+
+            bool alive = peer.sender_.poll(now, stats_, outbox_emitter{out, address});
+            if (!alive) {
+                stats_.peers_lost_++;
+            }
+            bool idle = peer.sender_.in_flight() == 0 &&
+                now - peer.last_heard_ns_ >= RELIABLE_IDLE_MS * 1000000ULL;
+            if (alive && !idle) {
+                ++it;
+                continue;
+            }
+            peer_pool_.destroy(it->second);
+            it = peers_.erase(it);
+        }
+        count_.store(peers_.size(), std::memory_order_relaxed);
+    }
+
+    typedef address_map<reliable_peer*> peer_map;
+
+    std::mutex mutex_;
+    packet_pool packets_;
+    object_pool<reliable_peer> peer_pool_;
+    slab_pool nodes_;
+    peer_map peers_;
+    // number of peers, read without the lock so servers with none skip wrapping
+    std::atomic<size_t> count_{0};
+    std::vector<size_t> wrapped_;
+    uint64_t last_poll_ns_ = 0;
+    reliable_stats stats_;
+    std::mt19937 random_{std::random_device{}()};
+};
+
+}; // namespace chat
@@ -0,0 +1,250 @@
+#pragma once
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <chat_ex2.hpp>
+#include <fanout.hpp>
+#include <user_registry.hpp>
+
+namespace chat {
+
+/**
+ * @struct room_member
+ * @brief A user in a room, stored by value in the room
+ * @var room_member::name_
+ *  Member 'name_' username, not NUL terminated
+ * @var room_member::name_length_
+ *  Member 'name_length_' number of bytes used in name_
+ * @var room_member::group_
+ *  Member 'group_' fanout group of the user's endpoint
+ * @var room_member::fanout_slot_
+ *  Member 'fanout_slot_' position of the user's address in the room's fanout
+ */
+struct room_member {
+    char name_[MAX_USERNAME_LENGTH];
+    uint8_t name_length_;
+    uint8_t group_;
+    uint32_t fanout_slot_;
+
+    std::string_view name() const { return std::string_view{&name_[0], name_length_}; }
+};
+
+/**
+ * @brief A named group of online users, with its own fanout of their addresses
+ *
+ * Sending to a room walks only the room's fanout, so a room message costs
+ * O(members) queued datagrams and is encoded once per wire format, however
+ * many users are online.
+*/
+class room {
+public:
+    explicit room(std::string_view name) : name_{name} {}
+
+    std::string_view name() const { return name_; }
+    size_t size() const { return members_.size(); }
+    bool empty() const { return members_.empty(); }
+
+    const std::vector<room_member>& members() const { return members_; }
+
+    /**
+     * @brief packed addresses of every member
+    */
+    const fanout& destinations() const { return fanout_; }
+
+private:
+    friend class room_registry;
+
+    void add(const user_record& user) {
+        room_member member;
+        memcpy(&member.name_[0], user.name_, user.name_length_);
+        member.name_length_ = user.name_length_;
+        member.group_ = static_cast<uint8_t>(
+            fanout::group_of(user.endpoint_.format_, user.endpoint_.capabilities_));
+        uint32_t index = static_cast<uint32_t>(members_.size());
+        member.fanout_slot_ = fanout_.add(user.endpoint_.address_, member.group_, index);
+        members_.push_back(member);
+    }
+
+    bool remove(std::string_view name) {
+        auto it = std::find_if(members_.begin(), members_.end(),
+            [name](const room_member& m) { return m.name() == name; });
+        if (it == members_.end()) {
+            return false;
+        }
+        uint32_t index = static_cast<uint32_t>(it - members_.begin());
+
+        // the fanout moves one of its own entries into the hole it leaves
+        uint32_t moved = fanout_.remove(it->group_, it->fanout_slot_);
+        if (moved != fanout::NONE) {
+            members_[moved].fanout_slot_ = it->fanout_slot_;
+        }
+
+        // move the last member into the hole, and repoint its fanout entry
+        uint32_t last = static_cast<uint32_t>(members_.size() - 1);
+        if (index != last) {
+            members_[index] = members_[last];
+            fanout_.set_owner(members_[index].group_, members_[index].fanout_slot_, index);
+        }
+        members_.pop_back();
+        return true;
+    }
+
+    std::string name_;
+    std::vector<room_member> members_;
+    fanout fanout_;
+};
+
+/**
+ * @brief Rooms by name, and the rooms each user is in
+ *
+ * A room is created by its first member and removed with its last. Each
+ * user's memberships are indexed too, so checking that a sender is in a room
+ * and removing a user from every room when they leave cost O(rooms they are
+ * in), not O(rooms). Like the user registry it is not synchronised, callers
+ * hold the same lock.
+*/
+class room_registry {
+public:
+    size_t size() const { return rooms_.size(); }
+
+    /**
+     * @brief find a room by name
+     * @return the room, or nullptr if there is none
+    */
+    const room * find(std::string_view name) const {
+        auto it = rooms_.find(lookup(name));
+        return it == rooms_.end() ? nullptr : it->second.get();
+    }
+
+    /**
+     * @brief rooms a user is in
+    */
+    const std::vector<room*>& rooms_of(std::string_view user) const {
+        static const std::vector<room*> none;
+        auto it = memberships_.find(lookup(user));
+        return it == memberships_.end() ? none : it->second;
+    }
+
+    /**
+     * @brief check if a user is in a room
+    */
+    bool is_member(std::string_view name, std::string_view user) const {
+        const auto& rooms = rooms_of(user);
+        return std::any_of(rooms.begin(), rooms.end(), [name](const room * r) { return r->name() == name; });
+    }
+
+    /**
+     * @brief create a room with a first member
+     * @param name of room, truncated to MAX_USERNAME_LENGTH-1 bytes
+     * @param creator online user who becomes the first member
+     * @return false if the room already exists, otherwise true
+    */
+    bool create(std::string_view name, const user_record& creator) {
+        name = name.substr(0, MAX_USERNAME_LENGTH - 1);
+        auto [it, created] = rooms_.try_emplace(lookup(name), nullptr);
+        if (!created) {
+            return false;
+        }
+        it->second = std::make_unique<room>(name);
+        join(*it->second, creator);
+        return true;
+    }
+
+    /**
+     * @brief add an online user to an existing room
+     * @return false if there is no such room or the user is already in it
+    */
+    bool add(std::string_view name, const user_record& user) {
+        auto it = rooms_.find(lookup(name));
+        if (it == rooms_.end() || is_member(name, user.name())) {
+            return false;
+        }
+        join(*it->second, user);
+        return true;
+    }
+
+    /**
+     * @brief remove a user from a room, removing the room once empty
+     * @return false if the user was not in the room
+    */
+    bool remove(std::string_view name, std::string_view user) {
+        auto membership = memberships_.find(lookup(user));
+        if (membership == memberships_.end()) {
+            return false;
+        }
+        auto& rooms = membership->second;
+        auto r = std::find_if(rooms.begin(), rooms.end(), [name](const room * r) { return r->name() == name; });
+        if (r == rooms.end()) {
+            return false;
+        }
+        leave(**r, user);
+        *r = rooms.back();
+        rooms.pop_back();
+        if (rooms.empty()) {
+            memberships_.erase(membership);
+        }
+        return true;
+    }
+
+    /**
+     * @brief remove a user from every room they are in
+     * @return number of rooms left
+    */
+    size_t remove_all(std::string_view user) {
+        auto membership = memberships_.find(lookup(user));
+        if (membership == memberships_.end()) {
+            return 0;
+        }
+        size_t left = membership->second.size();
+        for (room * r: membership->second) {
+            leave(*r, user);
+        }
+        memberships_.erase(membership);
+        return left;
+    }
+
+    void clear() {
+        rooms_.clear();
+        memberships_.clear();
+    }
+
+private:
+    /**
+     * @brief a name as a key to look up, in a buffer each thread reuses, so
+     *        lookups do not allocate a string every message
+    */
+    static const std::string& lookup(std::string_view name) {
+        thread_local std::string key;
+        key.assign(name.data(), name.length());
+        return key;
+    }
+
+    void join(room& r, const user_record& user) {
+        r.add(user);
+        memberships_[lookup(user.name())].push_back(&r);
+    }
+
+    /**
+     * @brief take a user out of a room, leaving their membership list to the caller
+    */
+    void leave(room& r, std::string_view user) {
+        r.remove(user);
+        if (r.empty()) {
+            rooms_.erase(lookup(r.name()));
+        }
+    }
+
+    std::unordered_map<std::string, std::unique_ptr<room>> rooms_;
+    std::unordered_map<std::string, std::vector<room*>> memberships_;
+};
+
+}; // namespace chat
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <pool.hpp>
+#include <server_io.hpp>
+
+// Default most datagrams held for one client while the socket cannot take them
+#define SEND_QUEUE_LIMIT 256
+
+namespace chat {
+
+/**
+ * @struct send_queue_stats
+ * @brief Counters for the per client send queues
+ * @var send_queue_stats::deferred_
+ *  Member 'deferred_' datagrams the socket could not take at once, or that waited behind those
+ * @var send_queue_stats::drained_
+ *  Member 'drained_' deferred datagrams later handed to the socket
+ * @var send_queue_stats::dropped_
+ *  Member 'dropped_' datagrams dropped because their client's queue was full
+ * @var send_queue_stats::evicted_
+ *  Member 'evicted_' clients disconnected because their queue was full
+ * @var send_queue_stats::deepest_
+ *  Member 'deepest_' most datagrams queued for one client at once
+ */
+struct send_queue_stats {
+    uint64_t deferred_ = 0;
+    uint64_t drained_ = 0;
+    uint64_t dropped_ = 0;
+    uint64_t evicted_ = 0;
+    uint64_t deepest_ = 0;
+
+    send_queue_stats& operator+=(const send_queue_stats& other) {
+        deferred_ += other.deferred_;
+        drained_ += other.drained_;
+        dropped_ += other.dropped_;
+        evicted_ += other.evicted_;
+        deepest_ = std::max(deepest_, other.deepest_);
+        return *this;
+    }
+};
+
+/**
+ * @brief Bounded queues of datagrams per client, for when the socket's send
+ *        buffer is full
+ *
+ * The worker sends without blocking. Whatever the socket refuses is copied
+ * into its client's queue, and so is anything later sent to a client that
+ * still has a queue, so datagrams reach each client in order. Queues are
+ * drained round robin once the socket is writable, so one busy destination
+ * cannot starve the others, and a client whose queue reaches the limit
+ * either loses the datagrams that do not fit or is disconnected. Queued
+ * datagrams and the index of clients with a queue live in pools, so a
+ * congested client costs no heap allocation once the pools have grown.
+*/
+class send_queues {
+public:
+    enum policy {
+        DROP,           // drop datagrams that do not fit
+        DISCONNECT,     // drop the client's queue and report it for eviction
+    };
+
+    explicit send_queues(size_t limit = SEND_QUEUE_LIMIT, policy overflow = DROP) :
+        limit_{limit > 0 ? limit : 1},
+        policy_{overflow},
+        queues_{0, queue_map::allocator_type{nodes_}} {
+    }
+
+    ~send_queues() {
+        for (auto& q: queues_) {
+            q.second.datagrams_.clear(packets_);
+        }
+    }
+
+    /**
+     * @brief true if no client has datagrams waiting
+    */
+    bool empty() const { return active_.empty(); }
+
+    const send_queue_stats& stats() const { return stats_; }
+
+    /**
+     * @brief occupancy of the buffers holding queued datagrams
+    */
+    const pool_stats& packet_stats() const { return packets_.stats(); }
+
+    /**
+     * @brief move datagrams for clients that have a queue to the back of it
+     * @param out datagrams about to be sent, headers included
+    */
+    void divert(outbox& out) {
+        if (empty()) {
+            return;
+        }
+        taken_.clear();
+        for (size_t i = 0; i < out.size(); i++) {
+            auto it = queues_.find(address_key(out.address(i)));
+            if (it != queues_.end()) {
+                push(it->second, out, i);
+                taken_.push_back(i);
+            }
+        }
+        out.erase(taken_);
+    }
+
+    /**
+     * @brief queue the datagrams the socket could not take
+     * @param out datagrams just sent
+     * @param from position of the first datagram not taken, see datagram_socket::blocked_from
+    */
+    void defer(const outbox& out, size_t from) {
+        for (size_t i = from; i < out.size(); i++) {
+            if (!evicted_.empty() && is_evicted(out.address(i))) {
+                // the rest of the batch for a client already being disconnected
+                stats_.dropped_++;
+                continue;
+            }
+            uint64_t k = address_key(out.address(i));
+            auto it = queues_.find(k);
+            if (it == queues_.end()) {
+                it = queues_.emplace(k, client_queue{out.address(i), {}}).first;
+                active_.push_back(k);
+            }
+            push(it->second, out, i);
+        }
+    }
+
+    /**
+     * @brief queue the oldest waiting datagrams into an empty outbox, taking
+     *        one from each client in turn
+     * @param out filled with datagrams to send
+     * @param max most datagrams to take
+    */
+    void fill(outbox& out, size_t max) {
+        filled_.clear();
+        size_t clients = active_.size();
+        // the next datagram to take from each client, in the order they are visited
+        cursors_.clear();
+        for (size_t n = 0; n < clients; n++) {
+            client_queue& q = queues_.find(active_[(cursor_ + n) % clients])->second;
+            cursors_.emplace_back(&q, q.datagrams_.front());
+        }
+        while (filled_.size() < max) {
+            size_t before = filled_.size();
+            for (size_t n = 0; n < clients && filled_.size() < max; n++) {
+                auto& [q, d] = cursors_[n];
+                if (d != nullptr) {
+                    out.send(d->data_, d->length_, q->address_);
+                    filled_.push_back(q);
+                    d = d->next_;
+                }
+            }
+            if (filled_.size() == before) {
+                break;
+            }
+        }
+        // start with the next client next time
+        cursor_ = clients > 0 ? (cursor_ + 1) % clients : 0;
+    }
+
+    /**
+     * @brief drop the datagrams queued by the last fill that the socket took
+     * @param n number taken, the first n that fill queued
+    */
+    void sent(size_t n) {
+        n = std::min(n, filled_.size());
+        for (size_t i = 0; i < n; i++) {
+            packets_.release(filled_[i]->datagrams_.pop_front());
+        }
+        stats_.drained_ += n;
+        remove_empty();
+    }
+
+    /**
+     * @brief clients disconnected since the last call, under the DISCONNECT policy
+    */
+    std::vector<sockaddr_in> take_evicted() {
+        std::vector<sockaddr_in> evicted;
+        evicted.swap(evicted_);
+        return evicted;
+    }
+
+private:
+    struct client_queue {
+        sockaddr_in address_;
+        packet_queue datagrams_;
+    };
+
+    typedef address_map<client_queue> queue_map;
+
+    /**
+     * @brief copy datagram i of out, header and payload, into a client's queue
+    */
+    void push(client_queue& q, const outbox& out, size_t i) {
+        if (q.datagrams_.size() >= limit_) {
+            if (policy_ == DISCONNECT) {
+                stats_.dropped_ += q.datagrams_.size() + 1;
+                stats_.evicted_++;
+                q.datagrams_.clear(packets_);
+                evicted_.push_back(q.address_);
+                remove_empty();
+            }
+            else {
+                stats_.dropped_++;
+            }
+            return;
+        }
+        q.datagrams_.push_back(packets_.acquire(out.header(i), out.header_length(i), out.data(i), out.length(i)));
+        stats_.deferred_++;
+        stats_.deepest_ = std::max<uint64_t>(stats_.deepest_, q.datagrams_.size());
+    }
+
+    bool is_evicted(const sockaddr_in& address) const {
+        return std::any_of(evicted_.begin(), evicted_.end(),
+            [k = address_key(address)](const sockaddr_in& a) { return address_key(a) == k; });
+    }
+
+    void remove_empty() {
+        for (size_t i = 0; i < active_.size();) {
+            auto it = queues_.find(active_[i]);
+            if (!it->second.datagrams_.empty()) {
+                i++;
+                continue;
+            }
+            queues_.erase(it);
+            active_[i] = active_.back();
+            active_.pop_back();
+        }
+        filled_.clear();
+    }
+
+    size_t limit_;
+    policy policy_;
+    packet_pool packets_;
+    slab_pool nodes_;
+    queue_map queues_;
+    // clients with a queue, in the order fill visits them
+    std::vector<uint64_t> active_;
+    size_t cursor_ = 0;
+    std::vector<client_queue*> filled_;
+    std::vector<std::pair<client_queue*, packet_buffer*>> cursors_;
+    std::vector<size_t> taken_;
+    std::vector<sockaddr_in> evicted_;
+    send_queue_stats stats_;
+};
+
+}; // namespace chat
@@ -0,0 +1,496 @@
+#pragma once
+
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <system_error>
+#include <vector>
+
+// IOT socket api
+#include <iot/socket.hpp>
+
+#include <chat_ex2.hpp>
+
+// Longest per destination header sent ahead of a payload, see outbox::set_header
+#define MAX_DATAGRAM_HEADER_LENGTH 16
+
+// Longest payload, a legacy packet, a compact frame or a bundle of frames
+#define MAX_PAYLOAD_LENGTH \
+    (sizeof(chat::chat_message) > MAX_FRAME_LENGTH ? \
+        (sizeof(chat::chat_message) > MAX_BUNDLE_LENGTH ? sizeof(chat::chat_message) : MAX_BUNDLE_LENGTH) : \
+        (MAX_FRAME_LENGTH > MAX_BUNDLE_LENGTH ? MAX_FRAME_LENGTH : MAX_BUNDLE_LENGTH))
+
+// Large enough for any payload, with a header
+#define MAX_DATAGRAM_LENGTH (MAX_PAYLOAD_LENGTH + MAX_DATAGRAM_HEADER_LENGTH)
+
+// Default number of datagrams drained per wakeup
+#define DEFAULT_BATCH_SIZE 64
+
+namespace chat {
+
+/**
+ * @struct io_stats
+ * @brief Counters for the datagram I/O layer
+ * @var io_stats::recv_calls_
+ *  Member 'recv_calls_' number of receive syscalls made
+ * @var io_stats::send_calls_
+ *  Member 'send_calls_' number of send syscalls made
+ * @var io_stats::datagrams_received_
+ *  Member 'datagrams_received_' number of datagrams received
+ * @var io_stats::datagrams_sent_
+ *  Member 'datagrams_sent_' number of datagrams sent
+ * @var io_stats::send_failures_
+ *  Member 'send_failures_' number of datagrams that could not be sent
+ */
+struct io_stats {
+    uint64_t recv_calls_ = 0;
+    uint64_t send_calls_ = 0;
+    uint64_t datagrams_received_ = 0;
+    uint64_t datagrams_sent_ = 0;
+    uint64_t send_failures_ = 0;
+
+    io_stats& operator+=(const io_stats& other) {
+        recv_calls_ += other.recv_calls_;
+        send_calls_ += other.send_calls_;
+        datagrams_received_ += other.datagrams_received_;
+        datagrams_sent_ += other.datagrams_sent_;
+        send_failures_ += other.send_failures_;
+        return *this;
+    }
+
+    /**
+     * @brief syscalls made per received message
+    */
+    double syscalls_per_message() const {
+        return datagrams_received_ == 0 ? 0.0 :
+            static_cast<double>(recv_calls_ + send_calls_) / datagrams_received_;
+    }
+};
+
+/**
+ * @brief Datagrams received in a single wakeup, stored in one contiguous buffer
+*/
+class inbox {
+public:
+    explicit inbox(size_t capacity) :
+        buffer_(capacity * MAX_DATAGRAM_LENGTH),
+        addresses_(capacity),
+        lengths_(capacity),
+        size_{0} {
+    }
+
+    /**
+     * @brief maximum number of datagrams received per wakeup
+    */
+    size_t capacity() const { return lengths_.size(); }
+
+    /**
+     * @brief number of datagrams currently held
+    */
+    size_t size() const { return size_; }
+
+    const char * data(size_t i) const { return &buffer_[i * MAX_DATAGRAM_LENGTH]; }
+    char * data(size_t i) { return &buffer_[i * MAX_DATAGRAM_LENGTH]; }
+    size_t length(size_t i) const { return lengths_[i]; }
+    const sockaddr_in& address(size_t i) const { return addresses_[i]; }
+
+    /**
+     * @brief record datagram i, received from address
+    */
+    void set(size_t i, size_t length, const sockaddr_in& address) {
+        lengths_[i] = length;
+        addresses_[i] = address;
+    }
+
+    void resize(size_t size) { size_ = size; }
+
+    sockaddr_in * addresses() { return &addresses_[0]; }
+
+private:
+    std::vector<char> buffer_;
+    std::vector<sockaddr_in> addresses_;
+    std::vector<size_t> lengths_;
+    size_t size_;
+};
+
+/**
+ * @brief Datagrams queued by message handlers, sent together once a batch of
+ *        received messages has been handled
+ *
+ * Payloads are copied into a single growable buffer and referenced by
+ * offset, so queuing never holds on to a handler's stack. A payload sent to
+ * many destinations is staged once and every datagram refers to that copy.
+ * A datagram may also carry a short header of its own, sent ahead of the
+ * shared payload.
+*/
+class outbox {
+public:
+    outbox() {
+        buffer_.reserve(DEFAULT_BATCH_SIZE * MAX_DATAGRAM_LENGTH);
+        entries_.reserve(DEFAULT_BATCH_SIZE);
+    }
+
+    /**
+     * @brief queue datagram to be sent to address
+     * @param data bytes to send
+     * @param length number of bytes to send
+     * @param address destination
+    */
+    void send(const char * data, size_t length, const sockaddr_in& address) {
+        send_staged(stage(data, length), length, address);
+    }
+
+    /**
+     * @brief copy a payload into the outbox, without queuing it for anyone
+     * @param data bytes to copy
+     * @param length number of bytes to copy
+     * @return handle to pass to send_staged
+    */
+    size_t stage(const char * data, size_t length) {
+        size_t offset = buffer_.size();
+        buffer_.insert(buffer_.end(), data, data + length);
+        return offset;
+    }
+
+    /**
+     * @brief queue a previously staged payload to be sent to address
+     * @param handle returned by stage
+     * @param length number of bytes staged
+     * @param address destination
+    */
+    void send_staged(size_t handle, size_t length, const sockaddr_in& address) {
+        entries_.push_back(entry{handle, length, address, 0});
+    }
+
+    /**
+     * @brief give datagram i a header of its own, sent ahead of its payload
+     * @param i datagram to prefix
+     * @param header bytes to send first
+     * @param length number of header bytes, at most MAX_DATAGRAM_HEADER_LENGTH
+    */
+    void set_header(size_t i, const char * header, size_t length) {
+        memcpy(entries_[i].header_, header, length);
+        entries_[i].header_length_ = static_cast<uint8_t>(length);
+    }
+
+    /**
+     * @brief drop the datagrams at the given positions, keeping the order of the rest
+     * @param positions ascending positions to drop
+    */
+    void erase(const std::vector<size_t>& positions) {
+        size_t next = 0;
+        size_t kept = 0;
+        for (size_t i = 0; i < entries_.size(); i++) {
+            if (next < positions.size() && positions[next] == i) {
+                next++;
+                continue;
+            }
+            entries_[kept++] = entries_[i];
+        }
+        entries_.resize(kept);
+    }
+
+    size_t size() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+
+    const char * data(size_t i) const { return buffer_.data() + entries_[i].offset_; }
+    size_t length(size_t i) const { return entries_[i].length_; }
+    const sockaddr_in& address(size_t i) const { return entries_[i].address_; }
+    const char * header(size_t i) const { return entries_[i].header_; }
+    size_t header_length(size_t i) const { return entries_[i].header_length_; }
+
+    /**
+     * @brief drop all queued datagrams, keeping allocated storage
+    */
+    void clear() {
+        buffer_.clear();
+        entries_.clear();
+    }
+
+private:
+    struct entry {
+        size_t offset_;
+        size_t length_;
+        sockaddr_in address_;
+        uint8_t header_length_;
+        char header_[MAX_DATAGRAM_HEADER_LENGTH];
+    };
+
+    std::vector<char> buffer_;
+    std::vector<entry> entries_;
+};
+
+/**
+ * @brief Interface for the server's datagram I/O backend
+*/
+class datagram_socket {
+public:
+    virtual ~datagram_socket() {}
+
+    /**
+     * @brief block until at least one datagram arrives, then receive as many
+     *        as are ready, up to the inbox capacity
+     * @param in filled with received datagrams
+     * @return number of datagrams received
+    */
+    virtual size_t recv(inbox& in) = 0;
+
+    /**
+     * @brief block until a datagram is ready or timeout_ns has passed
+     * @param timeout_ns longest to wait
+     * @param writable if not null, also wake when the socket can send, and
+     *        set to whether it can
+     * @return true if there is a datagram to recv, always true for backends
+     *         that cannot wait, whose recv blocks instead
+    */
+    virtual bool wait(uint64_t timeout_ns, bool * writable = nullptr) {
+        if (writable != nullptr) {
+            *writable = true;
+        }
+        return true;
+    }
+
+    /**
+     * @brief send datagrams queued in out, without blocking if the backend can
+     * @param out datagrams to send, left unchanged
+    */
+    virtual void send(const outbox& out) = 0;
+
+    /**
+     * @brief position, in the outbox last passed to send, of the first
+     *        datagram not sent because the socket's send buffer was full, the
+     *        outbox size if all were sent or failed
+    */
+    size_t blocked_from() const { return blocked_from_; }
+
+    const io_stats& stats() const { return stats_; }
+
+    /**
+     * @brief positions, in the outbox last passed to send, of the datagrams
+     *        that could not be sent
+    */
+    const std::vector<size_t>& failed() const { return failed_; }
+
+protected:
+    io_stats stats_;
+    std::vector<size_t> failed_;
+    size_t blocked_from_ = 0;
+};
+
+/**
+ * @brief Backend using the IoT socket api, one syscall per datagram
+*/
+class uwe_datagram_socket : public datagram_socket {
+public:
+    explicit uwe_datagram_socket(const sockaddr_in& address) :
+        sock_{AF_INET, SOCK_DGRAM, 0} {
+        sock_.bind((struct sockaddr *)&address, sizeof(address));
+    }
+
+    size_t recv(inbox& in) override {
+        sockaddr_in address;
+        size_t address_len = 0;
+        int len = sock_.recvfrom(
+            in.data(0), MAX_DATAGRAM_LENGTH, 0, (struct sockaddr *)&address, &address_len);
+        stats_.recv_calls_++;
+        if (len < 0) {
+            in.resize(0);
+            return 0;
+        }
+        stats_.datagrams_received_++;
+        in.set(0, len, address);
+        in.resize(1);
+        return 1;
+    }
+
+    void send(const outbox& out) override {
+        // the IoT socket api blocks instead of refusing datagrams
+        failed_.clear();
+        blocked_from_ = out.size();
+        for (size_t i = 0; i < out.size(); i++) {
+            const char * data = out.data(i);
+            size_t length = out.length(i);
+            if (out.header_length(i) > 0) {
+                // the IoT socket api has no gather send, so join header and payload
+                memcpy(&scratch_[0], out.header(i), out.header_length(i));
+                memcpy(&scratch_[out.header_length(i)], data, length);
+                data = &scratch_[0];
+                length += out.header_length(i);
+            }
+            int len = sock_.sendto(
+                data, length, 0,
+                (sockaddr*)&out.address(i), sizeof(struct sockaddr_in));
+            stats_.send_calls_++;
+            if (len < 0) {
+                stats_.send_failures_++;
+                failed_.push_back(i);
+            }
+            else {
+                stats_.datagrams_sent_++;
+            }
+        }
+    }
+
+private:
+    uwe::socket sock_;
+    char scratch_[MAX_DATAGRAM_LENGTH];
+};
+
+/**
+ * @brief Backend using recvmmsg and sendmmsg on a raw UDP socket, so a wakeup
+ *        drains up to a full batch and a fan-out costs a few syscalls
+ *
+ * With reuse_port several of these can be bound to the same address, one
+ * per worker thread, and the kernel spreads clients across them.
+*/
+class mmsg_datagram_socket : public datagram_socket {
+public:
+    /**
+     * @param address to bind to
+     * @param batch_size maximum datagrams per recvmmsg/sendmmsg call
+     * @param reuse_port set SO_REUSEPORT before binding
+     * @param recv_timeout_ms if not 0, recv returns no datagrams after this long
+    */
+    mmsg_datagram_socket(
+        const sockaddr_in& address, size_t batch_size,
+        bool reuse_port = false, int recv_timeout_ms = 0) :
+        fd_{::socket(AF_INET, SOCK_DGRAM, 0)},
+        batch_size_{batch_size},
+        headers_(batch_size),
+        iovecs_(2 * batch_size) {
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "socket");
+        }
+
+        int on = 1;
+        if (reuse_port && ::setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            fail("setsockopt(SO_REUSEPORT)");
+        }
+
+        if (recv_timeout_ms > 0) {
+            timeval timeout{recv_timeout_ms / 1000, (recv_timeout_ms % 1000) * 1000};
+            if (::setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+                fail("setsockopt(SO_RCVTIMEO)");
+            }
+        }
+
+        if (::bind(fd_, (const struct sockaddr *)&address, sizeof(address)) < 0) {
+            fail("bind");
+        }
+    }
+
+    ~mmsg_datagram_socket() override {
+        ::close(fd_);
+    }
+
+    mmsg_datagram_socket(const mmsg_datagram_socket&) = delete;
+    mmsg_datagram_socket& operator=(const mmsg_datagram_socket&) = delete;
+
+    size_t recv(inbox& in) override {
+        size_t count = in.capacity() < batch_size_ ? in.capacity() : batch_size_;
+        for (size_t i = 0; i < count; i++) {
+            iovecs_[i].iov_base = in.data(i);
+            iovecs_[i].iov_len = MAX_DATAGRAM_LENGTH;
+            memset(&headers_[i], 0, sizeof(mmsghdr));
+            headers_[i].msg_hdr.msg_iov = &iovecs_[i];
+            headers_[i].msg_hdr.msg_iovlen = 1;
+            headers_[i].msg_hdr.msg_name = &in.addresses()[i];
+            headers_[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        }
+
+        // block for the first datagram, then take whatever else is queued
+        int n = ::recvmmsg(fd_, &headers_[0], count, MSG_WAITFORONE, nullptr);
+        stats_.recv_calls_++;
+        if (n < 0) {
+            in.resize(0);
+            return 0;
+        }
+
+        for (int i = 0; i < n; i++) {
+            // truncated datagrams are reported as empty, so they fail to decode
+            size_t len = (headers_[i].msg_hdr.msg_flags & MSG_TRUNC) ? 0 : headers_[i].msg_len;
+            in.set(i, len, in.addresses()[i]);
+        }
+        stats_.datagrams_received_ += n;
+        in.resize(n);
+        return n;
+    }
+
+    bool wait(uint64_t timeout_ns, bool * writable = nullptr) override {
+        pollfd p{fd_, static_cast<short>(writable != nullptr ? POLLIN | POLLOUT : POLLIN), 0};
+        timespec timeout{
+            static_cast<time_t>(timeout_ns / 1000000000), static_cast<long>(timeout_ns % 1000000000)};
+        if (::ppoll(&p, 1, &timeout, nullptr) <= 0) {
+            p.revents = 0;
+        }
+        if (writable != nullptr) {
+            *writable = (p.revents & POLLOUT) != 0;
+        }
+        return (p.revents & POLLIN) != 0;
+    }
+
+    void send(const outbox& out) override {
+        failed_.clear();
+        blocked_from_ = out.size();
+        size_t next = 0;
+        while (next < out.size()) {
+            size_t count = out.size() - next < batch_size_ ? out.size() - next : batch_size_;
+            for (size_t i = 0; i < count; i++) {
+                // header, if any, then payload
+                iovec * iov = &iovecs_[2 * i];
+                size_t iovlen = 0;
+                if (out.header_length(next + i) > 0) {
+                    iov[iovlen].iov_base = const_cast<char*>(out.header(next + i));
+                    iov[iovlen++].iov_len = out.header_length(next + i);
+                }
+                iov[iovlen].iov_base = const_cast<char*>(out.data(next + i));
+                iov[iovlen++].iov_len = out.length(next + i);
+                memset(&headers_[i], 0, sizeof(mmsghdr));
+                headers_[i].msg_hdr.msg_iov = iov;
+                headers_[i].msg_hdr.msg_iovlen = iovlen;
+                headers_[i].msg_hdr.msg_name = const_cast<sockaddr_in*>(&out.address(next + i));
+                headers_[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            }
+
+            // never block, a full send buffer leaves the rest to the caller
+            int n = ::sendmmsg(fd_, &headers_[0], count, MSG_DONTWAIT);
+            stats_.send_calls_++;
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                    blocked_from_ = next;
+                    return;
+                }
+                // skip the datagram that failed and carry on with the rest
+                stats_.send_failures_++;
+                failed_.push_back(next);
+                next++;
+                continue;
+            }
+            stats_.datagrams_sent_ += n;
+            next += n;
+        }
+    }
+
+private:
+    [[noreturn]] void fail(const char * what) {
+        int err = errno;
+        ::close(fd_);
+        throw std::system_error(err, std::generic_category(), what);
+    }
+
+    int fd_;
+    size_t batch_size_;
+    std::vector<mmsghdr> headers_;
+    std::vector<iovec> iovecs_;
+};
+
+}; // namespace chat
@@ -0,0 +1,247 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <chat_ex2.hpp>
+
+namespace chat {
+
+/**
+ * @brief Log linear histogram in the style of HdrHistogram
+ *
+ * Values are bucketed by the position of their top bit and the SUB_BITS bits
+ * below it, so any value is recorded to within 1/2^SUB_BITS of its size and
+ * the whole uint64_t range fits in a fixed array. Buckets are atomics updated
+ * with relaxed ordering, so recording never takes a lock and a reader can
+ * take a snapshot at any time.
+*/
+class histogram {
+public:
+    static constexpr unsigned SUB_BITS = 3;
+    static constexpr unsigned SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr unsigned BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    void record(uint64_t value) {
+        counts_[index(value)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    uint64_t count(size_t bucket) const {
+        return counts_[bucket].load(std::memory_order_relaxed);
+    }
+
+    static size_t index(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return static_cast<size_t>(value);
+        }
+        unsigned shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    /**
+     * @brief largest value recorded in a bucket
+    */
+    static uint64_t upper_bound(size_t bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        unsigned shift = bucket / SUB_BUCKETS - 1;
+        uint64_t lower = static_cast<uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+        return lower + ((uint64_t{1} << shift) - 1);
+    }
+
+private:
+    std::atomic<uint64_t> counts_[BUCKETS] = {};
+};
+
+/**
+ * @brief A point in time copy of one or more histograms, summed
+*/
+class histogram_snapshot {
+public:
+    void add(const histogram& h) {
+        for (size_t i = 0; i < histogram::BUCKETS; i++) {
+            uint64_t n = h.count(i);
+            counts_[i] += n;
+            total_ += n;
+        }
+    }
+
+    uint64_t total() const { return total_; }
+
+    /**
+     * @brief value at or below which fraction p of recorded values fall
+     * @param p between 0 and 1
+     * @return upper bound of the bucket holding that value, 0 if empty
+    */
+    uint64_t percentile(double p) const {
+        if (total_ == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(p * total_);
+        if (rank >= total_) {
+            rank = total_ - 1;
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < histogram::BUCKETS; i++) {
+            seen += counts_[i];
+            if (seen > rank) {
+                return histogram::upper_bound(i);
+            }
+        }
+        return 0;
+    }
+
+    uint64_t max() const { return percentile(1.0); }
+
+private:
+    uint64_t counts_[histogram::BUCKETS] = {};
+    uint64_t total_ = 0;
+};
+
+/**
+ * @struct type_counters
+ * @brief Traffic counters for one chat_type
+ * @var type_counters::packets_in_
+ *  Member 'packets_in_' well formed datagrams received
+ * @var type_counters::bytes_in_
+ *  Member 'bytes_in_' bytes of well formed datagrams received
+ * @var type_counters::packets_out_
+ *  Member 'packets_out_' datagrams queued for sending
+ * @var type_counters::bytes_out_
+ *  Member 'bytes_out_' bytes of datagrams queued for sending
+ * @var type_counters::send_failures_
+ *  Member 'send_failures_' datagrams the I/O backend failed to send
+ * @var type_counters::malformed_
+ *  Member 'malformed_' datagrams received with lengths that do not decode
+ */
+struct type_counters {
+    std::atomic<uint64_t> packets_in_{0};
+    std::atomic<uint64_t> bytes_in_{0};
+    std::atomic<uint64_t> packets_out_{0};
+    std::atomic<uint64_t> bytes_out_{0};
+    std::atomic<uint64_t> send_failures_{0};
+    std::atomic<uint64_t> malformed_{0};
+};
+
+/**
+ * @brief Metrics written by a single worker thread
+ *
+ * Indexed by chat_type, with UNKNOWN counting datagrams whose type could not
+ * be read. Each worker has its own shard, on its own cache lines, so the
+ * relaxed atomic increments are never contended.
+*/
+struct alignas(64) metrics_shard {
+    type_counters types_[UNKNOWN + 1];
+    histogram handler_ns_[UNKNOWN];
+    histogram fanout_;
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t n) {
+        counter.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief record a received datagram that decoded
+    */
+    void received(chat_type type, size_t bytes) {
+        add(types_[type].packets_in_, 1);
+        add(types_[type].bytes_in_, bytes);
+    }
+
+    /**
+     * @brief record a received datagram that did not decode
+    */
+    void malformed(chat_type type) {
+        add(types_[type].malformed_, 1);
+    }
+
+    /**
+     * @brief record the time taken to handle a message and the number of
+     *        datagrams it queued
+    */
+    void handled(chat_type type, uint64_t ns, size_t fanout) {
+        handler_ns_[type].record(ns);
+        fanout_.record(fanout);
+    }
+
+    /**
+     * @brief record a datagram queued for sending
+    */
+    void sent(chat_type type, size_t bytes) {
+        add(types_[type].packets_out_, 1);
+        add(types_[type].bytes_out_, bytes);
+    }
+
+    /**
+     * @brief record a datagram the I/O backend could not send
+    */
+    void send_failed(chat_type type) {
+        add(types_[type].send_failures_, 1);
+    }
+};
+
+/**
+ * @brief Server wide metrics, one shard per worker, summed when read
+*/
+class server_metrics {
+public:
+    explicit server_metrics(size_t workers = 1) {
+        resize(workers);
+    }
+
+    /**
+     * @brief set the number of workers, before any of them start recording
+    */
+    void resize(size_t workers) {
+        shards_.clear();
+        for (size_t i = 0; i < workers; i++) {
+            shards_.push_back(std::make_unique<metrics_shard>());
+        }
+    }
+
+    size_t size() const { return shards_.size(); }
+    metrics_shard& shard(size_t worker) { return *shards_[worker]; }
+
+    /**
+     * @brief counter summed over all workers
+     * @param type chat_type, or UNKNOWN
+     * @param member counter to sum, e.g. &type_counters::packets_in_
+    */
+    uint64_t total(size_t type, std::atomic<uint64_t> type_counters::* member) const {
+        uint64_t n = 0;
+        for (const auto& shard: shards_) {
+            n += (shard->types_[type].*member).load(std::memory_order_relaxed);
+        }
+        return n;
+    }
+
+    /**
+     * @brief handler time histogram for a type, summed over all workers
+    */
+    histogram_snapshot handler_ns(chat_type type) const {
+        histogram_snapshot snapshot;
+        for (const auto& shard: shards_) {
+            snapshot.add(shard->handler_ns_[type]);
+        }
+        return snapshot;
+    }
+
+    /**
+     * @brief fan-out size histogram, summed over all workers
+    */
+    histogram_snapshot fanout() const {
+        histogram_snapshot snapshot;
+        for (const auto& shard: shards_) {
+            snapshot.add(shard->fanout_);
+        }
+        return snapshot;
+    }
+
+private:
+    std::vector<std::unique_ptr<metrics_shard>> shards_;
+};
+
+}; // namespace chat
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace chat {
+
+/**
+ * @brief Bounded lock-free queue between exactly one producer thread and one
+ *        consumer thread
+ *
+ * Slots are allocated once, up front, and filled and read in place: the
+ * producer claims the next free slot, writes into it and publishes it, and
+ * the consumer peeks at a run of published slots, handles them where they lie
+ * and releases them. Each side owns one index, on its own cache line, and
+ * keeps a cached copy of the other side's index so it only touches the shared
+ * line when the cached value says the ring is full or empty.
+ *
+ * A claim or push that finds the ring full is counted as an overflow, and the
+ * producer decides whether to wait or drop.
+*/
+template<typename T>
+class spsc_ring {
+public:
+    /**
+     * @param capacity number of slots, rounded up to a power of two
+    */
+    explicit spsc_ring(size_t capacity) {
+        size_t slots = 2;
+        while (slots < capacity) {
+            slots *= 2;
+        }
+        mask_ = slots - 1;
+        slots_ = std::make_unique<T[]>(slots);
+    }
+
+    spsc_ring(const spsc_ring&) = delete;
+    spsc_ring& operator=(const spsc_ring&) = delete;
+
+    size_t capacity() const { return mask_ + 1; }
+
+    /**
+     * @brief number of published slots not yet released, approximate unless
+     *        called from the producer or consumer
+    */
+    size_t size() const {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+    }
+
+    bool empty() const { return size() == 0; }
+
+    /**
+     * @brief number of claims and pushed items that found the ring full
+    */
+    uint64_t overflows() const { return overflows_.load(std::memory_order_relaxed); }
+
+    //---------------------------------------------------------------------------------
+    // Producer
+
+    /**
+     * @brief true if there is no slot to claim, without counting an overflow
+    */
+    bool full() {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - producer_head_ <= mask_) {
+            return false;
+        }
+        producer_head_ = head_.load(std::memory_order_acquire);
+        return tail - producer_head_ > mask_;
+    }
+
+    /**
+     * @brief next slot to fill, which stays invisible to the consumer until
+     *        publish is called
+     * @return the slot, or nullptr if the ring is full
+    */
+    T * claim() {
+        if (full()) {
+            overflows_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        return &slots_[tail_.load(std::memory_order_relaxed) & mask_];
+    }
+
+    /**
+     * @brief hand the claimed slot to the consumer
+    */
+    void publish() {
+        tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /**
+     * @brief copy items into the ring, publishing them together
+     * @return number of items pushed, those that did not fit count as overflows
+    */
+    size_t push(const T * items, size_t n) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t room = capacity() - (tail - producer_head_);
+        if (room < n) {
+            producer_head_ = head_.load(std::memory_order_acquire);
+            room = capacity() - (tail - producer_head_);
+        }
+        size_t count = std::min(n, room);
+        for (size_t i = 0; i < count; i++) {
+            slots_[(tail + i) & mask_] = items[i];
+        }
+        if (count < n) {
+            overflows_.fetch_add(n - count, std::memory_order_relaxed);
+        }
+        tail_.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+    //---------------------------------------------------------------------------------
+    // Consumer
+
+    /**
+     * @brief run of published slots that are contiguous in memory
+     * @param first set to the oldest published slot
+     * @param max largest run wanted
+     * @return number of slots in the run, 0 if the ring is empty
+    */
+    size_t peek(T *& first, size_t max) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (consumer_tail_ == head) {
+            consumer_tail_ = tail_.load(std::memory_order_acquire);
+        }
+        size_t index = head & mask_;
+        size_t count = std::min({consumer_tail_ - head, capacity() - index, max});
+        first = &slots_[index];
+        return count;
+    }
+
+    /**
+     * @brief return slots handled in place to the producer
+     * @param n number of slots, no more than the last peek returned
+    */
+    void release(size_t n) {
+        head_.store(head_.load(std::memory_order_relaxed) + n, std::memory_order_release);
+    }
+
+    /**
+     * @brief move up to n items out of the ring
+     * @return number of items popped
+    */
+    size_t pop(T * out, size_t n) {
+        size_t popped = 0;
+        T * first;
+        size_t count;
+        while (popped < n && (count = peek(first, n - popped)) > 0) {
+            std::move(first, first + count, out + popped);
+            release(count);
+            popped += count;
+        }
+        return popped;
+    }
+
+private:
+    // written by the consumer
+    alignas(64) std::atomic<size_t> head_{0};
+    size_t consumer_tail_ = 0;
+
+    // written by the producer
+    alignas(64) std::atomic<size_t> tail_{0};
+    size_t producer_head_ = 0;
+    std::atomic<uint64_t> overflows_{0};
+
+    // read only once constructed
+    alignas(64) size_t mask_;
+    std::unique_ptr<T[]> slots_;
+};
+
+}; // namespace chat
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace chat {
+
+// Bits of the tick consumed by each level of the wheel, 64 slots per level
+#define TIMER_WHEEL_BITS 6
+
+// Levels of the wheel, timers up to 2^(6*4) ticks ahead are placed exactly
+#define TIMER_WHEEL_LEVELS 4
+
+/**
+ * @brief Hierarchical timing wheel, with timers identified by small integers
+ *
+ * Level 0 has a slot per tick, each higher level a slot per full turn of the
+ * level below it. A timer goes in the lowest level whose range covers its
+ * expiry, and when a lower level wraps the due slot of the level above is
+ * moved down. Scheduling, cancelling and each tick are O(1), plus O(1) per
+ * timer that fires or moves down a level, whatever the number of timers.
+ *
+ * Timers live in a pool, linked into their slot through their indices, so a
+ * timer costs no allocation once the pool has grown. Not synchronised.
+*/
+class timer_wheel {
+public:
+    static constexpr uint32_t NONE = 0xFFFFFFFF;
+
+    /**
+     * @param now tick the wheel starts at
+    */
+    explicit timer_wheel(uint64_t now = 0) : now_{now} {
+        for (auto& level: slots_) {
+            for (auto& slot: level) {
+                slot = NONE;
+            }
+        }
+    }
+
+    /**
+     * @brief tick the wheel has been advanced to
+    */
+    uint64_t now() const { return now_; }
+
+    /**
+     * @brief number of timers allocated, scheduled or not
+    */
+    size_t size() const { return nodes_.size() - free_count_; }
+
+    /**
+     * @brief allocate a timer, not yet scheduled
+     * @param key reported back when the timer fires
+     * @return id of the timer
+    */
+    uint32_t create(uint64_t key) {
+        uint32_t id;
+        if (free_ != NONE) {
+            id = free_;
+            free_ = nodes_[id].next_;
+            free_count_--;
+        }
+        else {
+            id = static_cast<uint32_t>(nodes_.size());
+            nodes_.emplace_back();
+        }
+        node& n = nodes_[id];
+        n.key_ = key;
+        n.expires_ = 0;
+        n.prev_ = n.next_ = NONE;
+        n.slot_ = NONE;
+        return id;
+    }
+
+    /**
+     * @brief cancel a timer if scheduled, and return its id to the pool
+    */
+    void destroy(uint32_t id) {
+        cancel(id);
+        nodes_[id].next_ = free_;
+        free_ = id;
+        free_count_++;
+    }
+
+    uint64_t key(uint32_t id) const { return nodes_[id].key_; }
+
+    /**
+     * @brief fire a timer at a tick, replacing any earlier schedule
+     * @param id timer from create
+     * @param expires tick to fire at, the next tick if already past
+    */
+    void schedule(uint32_t id, uint64_t expires) {
+        cancel(id);
+        nodes_[id].expires_ = expires > now_ ? expires : now_ + 1;
+        link(id);
+    }
+
+    /**
+     * @brief stop a timer firing, keeping its id
+    */
+    void cancel(uint32_t id) {
+        node& n = nodes_[id];
+        if (n.slot_ == NONE) {
+            return;
+        }
+        if (n.prev_ != NONE) {
+            nodes_[n.prev_].next_ = n.next_;
+        }
+        else {
+            slot(n.slot_) = n.next_;
+        }
+        if (n.next_ != NONE) {
+            nodes_[n.next_].prev_ = n.prev_;
+        }
+        n.prev_ = n.next_ = NONE;
+        n.slot_ = NONE;
+    }
+
+    /**
+     * @brief advance to a tick, firing every timer due by then
+     * @param to tick to advance to
+     * @param expired called with (uint32_t id, uint64_t key) for each timer
+     *        that fires, which is no longer scheduled; it may schedule or
+     *        destroy that timer, but no other
+    */
+    template<typename Expired>
+    void advance(uint64_t to, Expired expired) {
+        while (now_ < to) {
+            now_++;
+            // each level wrapping to 0 moves the next level's due slot down
+            for (size_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+                if (index(now_, level - 1) != 0) {
+                    break;
+                }
+                uint32_t& head = slots_[level][index(now_, level)];
+                while (head != NONE) {
+                    uint32_t id = head;
+                    cancel(id);
+                    link(id);
+                }
+            }
+            uint32_t& head = slots_[0][index(now_, 0)];
+            while (head != NONE) {
+                uint32_t id = head;
+                cancel(id);
+                expired(id, nodes_[id].key_);
+            }
+        }
+    }
+
+    /**
+     * @brief drop every timer, keeping allocated storage
+    */
+    void clear() {
+        nodes_.clear();
+        free_ = NONE;
+        free_count_ = 0;
+        for (auto& level: slots_) {
+            for (auto& slot: level) {
+                slot = NONE;
+            }
+        }
+    }
+
+private:
+    static constexpr size_t SLOTS = size_t{1} << TIMER_WHEEL_BITS;
+
+    struct node {
+        uint64_t key_;
+        uint64_t expires_;
+        uint32_t prev_;
+        uint32_t next_;
+        // level * SLOTS + index while scheduled, otherwise NONE
+        uint32_t slot_;
+    };
+
+    static size_t index(uint64_t tick, size_t level) {
+        return (tick >> (TIMER_WHEEL_BITS * level)) & (SLOTS - 1);
+    }
+
+    uint32_t& slot(uint32_t s) { return slots_[s / SLOTS][s % SLOTS]; }
+
+    /**
+     * @brief put a timer in the lowest level that covers its expiry
+    */
+    void link(uint32_t id) {
+        node& n = nodes_[id];
+        // ticks until expiry pick the level, a timer moved down as it falls
+        // due goes in the level 0 slot about to fire
+        uint64_t delta = n.expires_ - now_;
+        size_t level = 0;
+        while (level < TIMER_WHEEL_LEVELS - 1 && (delta >> (TIMER_WHEEL_BITS * (level + 1))) != 0) {
+            level++;
+        }
+        size_t i = index(n.expires_, level);
+        if ((delta >> (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) != 0) {
+            // beyond the wheel, park in the top level slot that is due last
+            i = (index(now_, level) + SLOTS - 1) % SLOTS;
+        }
+        uint32_t s = static_cast<uint32_t>(level * SLOTS + i);
+        n.slot_ = s;
+        n.prev_ = NONE;
+        n.next_ = slot(s);
+        if (n.next_ != NONE) {
+            nodes_[n.next_].prev_ = id;
+        }
+        slot(s) = id;
+    }
+
+    uint64_t now_;
+    std::vector<node> nodes_;
+    uint32_t free_ = NONE;
+    size_t free_count_ = 0;
+    uint32_t slots_[TIMER_WHEEL_LEVELS][SLOTS];
+};
+
+}; // namespace chat
@@ -0,0 +1,508 @@
+#pragma once
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <server_io.hpp>
+
+// Submission queue entries, so the most sends submitted in one call
+#define URING_ENTRIES 1024
+
+// Receive buffers the kernel picks from, a power of 2
+#define URING_RECV_BUFFERS 256
+
+namespace chat {
+
+/**
+ * @brief Backend using io_uring: a multishot receive fed from a ring of
+ *        provided buffers, and every send of a batch in one submission
+ *
+ * One receive stays posted for the life of the socket. The kernel picks a
+ * buffer from the ring for each datagram that arrives and posts a
+ * completion, so datagrams that arrive while the worker is busy are waiting
+ * in the completion queue when it comes back, with no syscall to fetch them.
+ * recv copies them out and hands the buffers straight back to the ring.
+ *
+ * send queues one sendmsg per datagram, linked so that the first the socket
+ * refuses cancels the rest, and a single io_uring_enter submits them all and
+ * waits for their completions, so the outbox is only borrowed for the call
+ * and refused datagrams keep their order for the send queues, as with
+ * sendmmsg. Completions of sends and receives share the completion queue, so
+ * receives reaped while sending are kept for the next recv.
+ *
+ * Like mmsg_datagram_socket, several can share a port with reuse_port.
+*/
+class uring_datagram_socket : public datagram_socket {
+public:
+    /**
+     * @param address to bind to
+     * @param batch_size maximum datagrams per recv
+     * @param reuse_port set SO_REUSEPORT before binding
+     * @param recv_timeout_ms if not 0, recv returns no datagrams after this long
+     * @throws std::system_error if the socket cannot be bound, or the kernel
+     *         lacks io_uring, multishot receives or provided buffer rings
+    */
+    uring_datagram_socket(
+        const sockaddr_in& address, size_t batch_size,
+        bool reuse_port = false, int recv_timeout_ms = 0) :
+        fd_{::socket(AF_INET, SOCK_DGRAM, 0)},
+        batch_size_{batch_size},
+        recv_timeout_ns_{static_cast<uint64_t>(recv_timeout_ms) * 1000000ULL} {
+        if (fd_ < 0) {
+            throw std::system_error(errno, std::generic_category(), "socket");
+        }
+
+        int on = 1;
+        if (reuse_port && ::setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            fail("setsockopt(SO_REUSEPORT)");
+        }
+        if (::bind(fd_, (const struct sockaddr *)&address, sizeof(address)) < 0) {
+            fail("bind");
+        }
+
+        setup_ring();
+        setup_buffers();
+
+        sends_ = sq_entries_ - 2;
+        headers_.resize(sends_);
+        iovecs_.resize(2 * sends_);
+        results_.resize(sends_);
+        received_.reserve(URING_RECV_BUFFERS);
+
+        // where the multishot receive puts the sender's address, in each buffer
+        memset(&recv_header_, 0, sizeof(recv_header_));
+        recv_header_.msg_namelen = sizeof(sockaddr_in);
+        arm_recv();
+    }
+
+    ~uring_datagram_socket() override {
+        release();
+    }
+
+    uring_datagram_socket(const uring_datagram_socket&) = delete;
+    uring_datagram_socket& operator=(const uring_datagram_socket&) = delete;
+
+    size_t recv(inbox& in) override {
+        reap();
+        while (next_received_ == received_.size()) {
+            arm_recv();
+            int r = enter(1, recv_timeout_ns_ > 0 ? &recv_timeout_ns_ : nullptr);
+            stats_.recv_calls_++;
+            reap();
+            if (r < 0 && errno == ETIME) {
+                break;
+            }
+        }
+
+        size_t count = in.capacity() < batch_size_ ? in.capacity() : batch_size_;
+        size_t n = 0;
+        for (; n < count && next_received_ < received_.size(); n++) {
+            uint16_t id = received_[next_received_++];
+            const char * buffer = buffer_of(id);
+            io_uring_recvmsg_out header;
+            memcpy(&header, buffer, sizeof(header));
+            sockaddr_in address{};
+            memcpy(&address, buffer + sizeof(header),
+                header.namelen < sizeof(address) ? header.namelen : sizeof(address));
+            // truncated datagrams are reported as empty, so they fail to decode
+            size_t length = (header.flags & MSG_TRUNC) ? 0 : header.payloadlen;
+            memcpy(in.data(n), buffer + sizeof(header) + sizeof(sockaddr_in), length);
+            in.set(n, length, address);
+            provide(id);
+        }
+        publish_buffers();
+        if (next_received_ == received_.size()) {
+            received_.clear();
+            next_received_ = 0;
+        }
+        stats_.datagrams_received_ += n;
+        in.resize(n);
+        return n;
+    }
+
+    bool wait(uint64_t timeout_ns, bool * writable = nullptr) override {
+        arm_recv();
+        if (writable != nullptr && !poll_armed_) {
+            // one shot poll for room in the send buffer
+            io_uring_sqe * sqe = next_sqe();
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = fd_;
+            sqe->poll32_events = POLLOUT;
+            sqe->user_data = POLL;
+            poll_armed_ = true;
+        }
+        reap();
+        if (next_received_ == received_.size() && !(writable != nullptr && writable_)) {
+            enter(1, &timeout_ns);
+            stats_.recv_calls_++;
+            reap();
+        }
+        if (writable != nullptr) {
+            *writable = writable_;
+            writable_ = false;
+        }
+        return next_received_ < received_.size();
+    }
+
+    void send(const outbox& out) override {
+        failed_.clear();
+        blocked_from_ = out.size();
+        size_t next = 0;
+        while (next < out.size()) {
+            size_t count = out.size() - next < sends_ ? out.size() - next : sends_;
+            for (size_t i = 0; i < count; i++) {
+                // header, if any, then payload
+                iovec * iov = &iovecs_[2 * i];
+                size_t iovlen = 0;
+                if (out.header_length(next + i) > 0) {
+                    iov[iovlen].iov_base = const_cast<char*>(out.header(next + i));
+                    iov[iovlen++].iov_len = out.header_length(next + i);
+                }
+                iov[iovlen].iov_base = const_cast<char*>(out.data(next + i));
+                iov[iovlen++].iov_len = out.length(next + i);
+                memset(&headers_[i], 0, sizeof(msghdr));
+                headers_[i].msg_iov = iov;
+                headers_[i].msg_iovlen = iovlen;
+                headers_[i].msg_name = const_cast<sockaddr_in*>(&out.address(next + i));
+                headers_[i].msg_namelen = sizeof(sockaddr_in);
+
+                io_uring_sqe * sqe = next_sqe();
+                sqe->opcode = IORING_OP_SENDMSG;
+                sqe->fd = fd_;
+                sqe->addr = reinterpret_cast<uint64_t>(&headers_[i]);
+                sqe->len = 1;
+                // never block, a full send buffer leaves the rest to the caller
+                sqe->msg_flags = MSG_DONTWAIT;
+                sqe->flags = i + 1 < count ? IOSQE_IO_LINK : 0;
+                sqe->user_data = i;
+            }
+
+            // one syscall submits the batch and waits for all of it
+            sends_completed_ = 0;
+            while (sends_completed_ < count) {
+                if (enter(count - sends_completed_, nullptr) < 0 &&
+                    errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                    throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+                }
+                stats_.send_calls_++;
+                reap();
+            }
+
+            size_t done = count;
+            for (size_t i = 0; i < count; i++) {
+                int res = results_[i];
+                if (res >= 0) {
+                    stats_.datagrams_sent_++;
+                    continue;
+                }
+                if (res == -EAGAIN || res == -EWOULDBLOCK || res == -ENOBUFS) {
+                    blocked_from_ = next + i;
+                    return;
+                }
+                if (res == -ECANCELED || res == -EINTR) {
+                    // send again from here
+                    done = i;
+                    break;
+                }
+                // skip the datagram that failed, the link cancelled the rest
+                stats_.send_failures_++;
+                failed_.push_back(next + i);
+                done = i + 1;
+                break;
+            }
+            next += done;
+        }
+    }
+
+private:
+    // user_data of the multishot receive and the writable poll, sends use their index
+    static constexpr uint64_t RECV = ~uint64_t{0};
+    static constexpr uint64_t POLL = ~uint64_t{0} - 1;
+
+    [[noreturn]] void fail(const char * what) {
+        int err = errno;
+        release();
+        throw std::system_error(err, std::generic_category(), what);
+    }
+
+    void release() {
+        if (ring_fd_ >= 0) {
+            ::close(ring_fd_);
+            ring_fd_ = -1;
+        }
+        if (sq_ring_ != MAP_FAILED) {
+            ::munmap(sq_ring_, sq_ring_size_);
+        }
+        if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+            ::munmap(cq_ring_, cq_ring_size_);
+        }
+        if (sqes_ != MAP_FAILED) {
+            ::munmap(sqes_, sq_entries_ * sizeof(io_uring_sqe));
+        }
+        if (buffer_ring_ != MAP_FAILED) {
+            ::munmap(buffer_ring_, URING_RECV_BUFFERS * sizeof(io_uring_buf));
+        }
+        sq_ring_ = cq_ring_ = sqes_ = buffer_ring_ = MAP_FAILED;
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    /**
+     * @brief create the ring and map its queues
+    */
+    void setup_ring() {
+        io_uring_params params{};
+        // completions are only needed when the worker enters the kernel anyway
+        params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+        ring_fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, URING_ENTRIES, &params));
+        if (ring_fd_ < 0 && errno == EINVAL) {
+            params = io_uring_params{};
+            ring_fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, URING_ENTRIES, &params));
+        }
+        if (ring_fd_ < 0) {
+            fail("io_uring_setup");
+        }
+        if ((params.features & IORING_FEAT_EXT_ARG) == 0) {
+            errno = ENOSYS;
+            fail("io_uring without timed waits");
+        }
+
+        sq_entries_ = params.sq_entries;
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring_fd_, IORING_OFF_SQ_RING);
+        if (sq_ring_ == MAP_FAILED) {
+            fail("mmap(sq ring)");
+        }
+        cq_ring_ = sq_ring_;
+        if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+            cq_ring_ = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring_fd_, IORING_OFF_CQ_RING);
+            if (cq_ring_ == MAP_FAILED) {
+                fail("mmap(cq ring)");
+            }
+        }
+        sqes_ = ::mmap(nullptr, sq_entries_ * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+        if (sqes_ == MAP_FAILED) {
+            fail("mmap(sqes)");
+        }
+
+        char * sq = static_cast<char*>(sq_ring_);
+        sq_head_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+        char * cq = static_cast<char*>(cq_ring_);
+        cq_head_ = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        sq_local_tail_ = *sq_tail_;
+    }
+
+    /**
+     * @brief register the ring of receive buffers and fill it
+    */
+    void setup_buffers() {
+        buffer_ring_ = ::mmap(nullptr, URING_RECV_BUFFERS * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer_ring_ == MAP_FAILED) {
+            fail("mmap(buffer ring)");
+        }
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(buffer_ring_);
+        reg.ring_entries = URING_RECV_BUFFERS;
+        reg.bgid = 0;
+        if (::syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            fail("io_uring_register(buffer ring)");
+        }
+        buffers_.resize(URING_RECV_BUFFERS * BUFFER_LENGTH);
+        for (uint16_t id = 0; id < URING_RECV_BUFFERS; id++) {
+            provide(id);
+        }
+        publish_buffers();
+    }
+
+    /**
+     * @brief receive buffer layout: io_uring_recvmsg_out, the sender's
+     *        address, then the datagram
+    */
+    static constexpr size_t BUFFER_LENGTH =
+        sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) + MAX_DATAGRAM_LENGTH;
+
+    char * buffer_of(uint16_t id) { return &buffers_[id * BUFFER_LENGTH]; }
+
+    /**
+     * @brief hand a receive buffer back to the kernel, seen once published
+    */
+    void provide(uint16_t id) {
+        // entries start at the ring itself, io_uring_buf_ring's flexible
+        // array is not at offset 0 when compiled as C++
+        io_uring_buf& buf = static_cast<io_uring_buf*>(buffer_ring_)[buffer_tail_ & (URING_RECV_BUFFERS - 1)];
+        buf.addr = reinterpret_cast<uint64_t>(buffer_of(id));
+        buf.len = BUFFER_LENGTH;
+        buf.bid = id;
+        buffer_tail_++;
+    }
+
+    /**
+     * @brief let the kernel see buffers provided since the last publish,
+     *        through the tail kept in the first entry's reserved field
+    */
+    void publish_buffers() {
+        uint16_t * tail = &static_cast<io_uring_buf*>(buffer_ring_)[0].resv;
+        __atomic_store_n(tail, buffer_tail_, __ATOMIC_RELEASE);
+    }
+
+    /**
+     * @brief next free submission queue entry, cleared, submitting what is
+     *        queued first if the queue is full
+    */
+    io_uring_sqe * next_sqe() {
+        while (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+            enter(0, nullptr);
+        }
+        uint32_t index = sq_local_tail_ & sq_mask_;
+        sq_array_[index] = index;
+        sq_local_tail_++;
+        io_uring_sqe * sqe = &static_cast<io_uring_sqe*>(sqes_)[index];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    /**
+     * @brief post the multishot receive, unless it is still posted
+    */
+    void arm_recv() {
+        if (recv_armed_) {
+            return;
+        }
+        io_uring_sqe * sqe = next_sqe();
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = fd_;
+        sqe->addr = reinterpret_cast<uint64_t>(&recv_header_);
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = RECV;
+        recv_armed_ = true;
+    }
+
+    /**
+     * @brief submit queued entries and wait for completions
+     * @param wait_for completions to wait for, 0 to only submit
+     * @param timeout_ns if not null, longest to wait
+     * @return result of io_uring_enter, -1 with errno ETIME on timeout
+    */
+    int enter(unsigned wait_for, const uint64_t * timeout_ns) {
+        uint32_t submit = sq_local_tail_ - *sq_tail_;
+        __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+        unsigned flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0;
+        if (timeout_ns == nullptr) {
+            return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd_, submit, wait_for, flags, nullptr, 0));
+        }
+        __kernel_timespec ts{
+            static_cast<int64_t>(*timeout_ns / 1000000000), static_cast<long long>(*timeout_ns % 1000000000)};
+        io_uring_getevents_arg arg{};
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd_, submit, wait_for,
+            flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)));
+    }
+
+    /**
+     * @brief take every completion off the queue, keeping received buffers
+     *        for recv and send results for send
+    */
+    void reap() {
+        uint32_t head = *cq_head_;
+        uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+            if (cqe.user_data == RECV) {
+                if (cqe.res >= 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+                    received_.push_back(static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+                }
+                // out of buffers or failed, posted again on the next wait
+                if ((cqe.flags & IORING_CQE_F_MORE) == 0) {
+                    recv_armed_ = false;
+                }
+            }
+            else if (cqe.user_data == POLL) {
+                poll_armed_ = false;
+                writable_ = cqe.res > 0 && (cqe.res & POLLOUT);
+            }
+            else if (cqe.user_data < results_.size()) {
+                results_[cqe.user_data] = cqe.res;
+                sends_completed_++;
+            }
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+
+    int fd_;
+    int ring_fd_ = -1;
+    size_t batch_size_;
+    uint64_t recv_timeout_ns_;
+
+    void * sq_ring_ = MAP_FAILED;
+    void * cq_ring_ = MAP_FAILED;
+    void * sqes_ = MAP_FAILED;
+    size_t sq_ring_size_ = 0;
+    size_t cq_ring_size_ = 0;
+    uint32_t sq_entries_ = 0;
+    uint32_t * sq_head_ = nullptr;
+    uint32_t * sq_tail_ = nullptr;
+    uint32_t sq_mask_ = 0;
+    uint32_t * sq_array_ = nullptr;
+    // entries queued up to here, published to the kernel by enter
+    uint32_t sq_local_tail_ = 0;
+    uint32_t * cq_head_ = nullptr;
+    uint32_t * cq_tail_ = nullptr;
+    uint32_t cq_mask_ = 0;
+    io_uring_cqe * cqes_ = nullptr;
+
+    void * buffer_ring_ = MAP_FAILED;
+    uint16_t buffer_tail_ = 0;
+    std::vector<char> buffers_;
+
+    msghdr recv_header_;
+    bool recv_armed_ = false;
+    // ids of buffers holding datagrams not yet passed to recv
+    std::vector<uint16_t> received_;
+    size_t next_received_ = 0;
+
+    bool poll_armed_ = false;
+    bool writable_ = false;
+
+    // most sends in one submission, leaving room for the receive and poll
+    size_t sends_ = 0;
+    std::vector<msghdr> headers_;
+    std::vector<iovec> iovecs_;
+    std::vector<int> results_;
+    size_t sends_completed_ = 0;
+};
+
+}; // namespace chat
@@ -0,0 +1,267 @@
+#pragma once
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#include <chat_ex2.hpp>
+#include <fanout.hpp>
+#include <pool.hpp>
+
+namespace chat {
+
+/**
+ * @brief address of a client, the wire format it talks and the capabilities
+ *        it advertised when joining
+*/
+struct client_endpoint {
+    sockaddr_in address_;
+    wire_format format_;
+    uint8_t capabilities_;
+};
+
+/**
+ * @struct user_record
+ * @brief An online user, stored by value in the registry
+ * @var user_record::name_
+ *  Member 'name_' username, not NUL terminated
+ * @var user_record::name_length_
+ *  Member 'name_length_' number of bytes used in name_
+ * @var user_record::endpoint_
+ *  Member 'endpoint_' where to send messages for this user
+ * @var user_record::fanout_slot_
+ *  Member 'fanout_slot_' position of the user's address in the registry's fanout
+ */
+struct user_record {
+    char name_[MAX_USERNAME_LENGTH];
+    uint8_t name_length_;
+    client_endpoint endpoint_;
+    uint32_t fanout_slot_;
+
+    std::string_view name() const { return std::string_view{&name_[0], name_length_}; }
+};
+
+/**
+ * @brief Online users, indexed by username and by IP:PORT
+ *
+ * Records live contiguously in a vector, in join order, with a slot removed by
+ * moving the last record into it. Two open addressing tables (linear probing,
+ * backward shift deletion) map a username and an address to a record, so every
+ * lookup, insert and erase is O(1) and no memory is allocated per user. The
+ * registry also keeps a fanout of every user's address in step with joins and
+ * leaves, for messages sent to everyone, and a roster version that increases
+ * on every change.
+*/
+class user_registry {
+public:
+    typedef std::vector<user_record>::const_iterator const_iterator;
+
+    explicit user_registry(size_t capacity = 64) {
+        records_.reserve(capacity);
+        size_t slots = 16;
+        while (slots < capacity * 2) {
+            slots *= 2;
+        }
+        by_name_.assign(slots, EMPTY);
+        by_address_.assign(slots, EMPTY);
+    }
+
+    size_t size() const { return records_.size(); }
+    bool empty() const { return records_.empty(); }
+
+    /**
+     * @brief roster version, incremented by every insert and erase
+    */
+    uint64_t version() const { return version_; }
+
+    const_iterator begin() const { return records_.begin(); }
+    const_iterator end() const { return records_.end(); }
+    const user_record& operator[](size_t i) const { return records_[i]; }
+
+    /**
+     * @brief packed addresses of every online user
+    */
+    const fanout& destinations() const { return fanout_; }
+
+    /**
+     * @brief find a user by name
+     * @return the user's record, or nullptr if not online
+    */
+    const user_record * find(std::string_view name) const {
+        size_t slot = find_name_slot(name);
+        return by_name_[slot] == EMPTY ? nullptr : &records_[by_name_[slot]];
+    }
+
+    /**
+     * @brief find a user by IP:PORT
+     * @return the user's record, or nullptr if no user joined from address
+    */
+    const user_record * find(const sockaddr_in& address) const {
+        size_t slot = find_address_slot(address_key(address));
+        return by_address_[slot] == EMPTY ? nullptr : &records_[by_address_[slot]];
+    }
+
+    /**
+     * @brief add a user
+     * @param name of user, truncated to MAX_USERNAME_LENGTH-1 bytes
+     * @param endpoint where to send messages for this user
+     * @return false if the name or address is already online, otherwise true
+    */
+    bool insert(std::string_view name, const client_endpoint& endpoint) {
+        if (name.length() > MAX_USERNAME_LENGTH - 1) {
+            name = name.substr(0, MAX_USERNAME_LENGTH - 1);
+        }
+        if (find(name) != nullptr || find(endpoint.address_) != nullptr) {
+            return false;
+        }
+        if ((records_.size() + 1) * 2 > by_name_.size()) {
+            rehash(by_name_.size() * 2);
+        }
+
+        user_record record;
+        memcpy(&record.name_[0], name.data(), name.length());
+        record.name_length_ = static_cast<uint8_t>(name.length());
+        record.endpoint_ = endpoint;
+
+        uint32_t index = static_cast<uint32_t>(records_.size());
+        record.fanout_slot_ = fanout_.add(endpoint.address_, group_of(endpoint), index);
+        records_.push_back(record);
+        by_name_[find_name_slot(name)] = index;
+        by_address_[find_address_slot(address_key(endpoint.address_))] = index;
+        version_++;
+        return true;
+    }
+
+    /**
+     * @brief remove a user
+     * @param name of user
+     * @return true if the user was online, otherwise false
+    */
+    bool erase(std::string_view name) {
+        size_t slot = find_name_slot(name);
+        uint32_t index = by_name_[slot];
+        if (index == EMPTY) {
+            return false;
+        }
+
+        erase_slot(by_name_, slot, [this](uint32_t i) { return hash(records_[i].name()); });
+        erase_slot(by_address_, find_address_slot(address_key(records_[index].endpoint_.address_)),
+            [this](uint32_t i) { return hash(address_key(records_[i].endpoint_.address_)); });
+
+        // the fanout moves one of its own entries into the hole it leaves
+        const user_record& removed = records_[index];
+        uint32_t moved = fanout_.remove(group_of(removed.endpoint_), removed.fanout_slot_);
+        if (moved != fanout::NONE) {
+            records_[moved].fanout_slot_ = removed.fanout_slot_;
+        }
+
+        // move the last record into the hole, and repoint its index entries
+        uint32_t last = static_cast<uint32_t>(records_.size() - 1);
+        if (index != last) {
+            by_name_[find_name_slot(records_[last].name())] = index;
+            by_address_[find_address_slot(address_key(records_[last].endpoint_.address_))] = index;
+            records_[index] = records_[last];
+            fanout_.set_owner(group_of(records_[index].endpoint_), records_[index].fanout_slot_, index);
+        }
+        records_.pop_back();
+        version_++;
+        return true;
+    }
+
+    /**
+     * @brief remove all users, keeping allocated storage
+    */
+    void clear() {
+        records_.clear();
+        fanout_.clear();
+        version_++;
+        by_name_.assign(by_name_.size(), EMPTY);
+        by_address_.assign(by_address_.size(), EMPTY);
+    }
+
+private:
+    static constexpr uint32_t EMPTY = 0xFFFFFFFF;
+
+    static size_t group_of(const client_endpoint& endpoint) {
+        return fanout::group_of(endpoint.format_, endpoint.capabilities_);
+    }
+
+    // FNV-1a
+    static size_t hash(std::string_view name) {
+        uint64_t h = 14695981039346656037ULL;
+        for (char c: name) {
+            h = (h ^ static_cast<uint8_t>(c)) * 1099511628211ULL;
+        }
+        return static_cast<size_t>(h);
+    }
+
+    // splitmix64 finaliser
+    static size_t hash(uint64_t k) {
+        k = (k ^ (k >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        k = (k ^ (k >> 27)) * 0x94d049bb133111ebULL;
+        return static_cast<size_t>(k ^ (k >> 31));
+    }
+
+    /**
+     * @brief slot holding name, or the empty slot where it would go
+    */
+    size_t find_name_slot(std::string_view name) const {
+        size_t mask = by_name_.size() - 1;
+        for (size_t slot = hash(name) & mask;; slot = (slot + 1) & mask) {
+            if (by_name_[slot] == EMPTY || records_[by_name_[slot]].name() == name) {
+                return slot;
+            }
+        }
+    }
+
+    /**
+     * @brief slot holding address k, or the empty slot where it would go
+    */
+    size_t find_address_slot(uint64_t k) const {
+        size_t mask = by_address_.size() - 1;
+        for (size_t slot = hash(k) & mask;; slot = (slot + 1) & mask) {
+            if (by_address_[slot] == EMPTY || address_key(records_[by_address_[slot]].endpoint_.address_) == k) {
+                return slot;
+            }
+        }
+    }
+
+    /**
+     * @brief empty slot, shifting back any later entries of the same probe run
+    */
+    template<typename Hash>
+    static void erase_slot(std::vector<uint32_t>& table, size_t slot, Hash hash_of) {
+        size_t mask = table.size() - 1;
+        size_t next = (slot + 1) & mask;
+        while (table[next] != EMPTY) {
+            size_t home = hash_of(table[next]) & mask;
+            // move the entry back if its home is not between the hole and it
+            if (((next - home) & mask) >= ((next - slot) & mask)) {
+                table[slot] = table[next];
+                slot = next;
+            }
+            next = (next + 1) & mask;
+        }
+        table[slot] = EMPTY;
+    }
+
+    void rehash(size_t slots) {
+        by_name_.assign(slots, EMPTY);
+        by_address_.assign(slots, EMPTY);
+        for (uint32_t i = 0; i < records_.size(); i++) {
+            by_name_[find_name_slot(records_[i].name())] = i;
+            by_address_[find_address_slot(address_key(records_[i].endpoint_.address_))] = i;
+        }
+    }
+
+    std::vector<user_record> records_;
+    std::vector<uint32_t> by_name_;
+    std::vector<uint32_t> by_address_;
+    fanout fanout_;
+    uint64_t version_ = 0;
+};
+
+}; // namespace chat